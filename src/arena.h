@@ -0,0 +1,70 @@
+#ifndef DHT_ARENA_H
+#define DHT_ARENA_H
+
+#include "types.h"
+
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include <cstddef>
+#include <new>
+
+namespace dhtpp {
+
+	// Bump allocator for objects that die together. The storage comes in
+	// blocks of BlockSize objects, nothing is freed one by one: all the
+	// objects are destroyed and the blocks released in one step.
+	template <typename T, uint16 BlockSize>
+	class CArena {
+	public:
+		CArena() {
+			blocks = NULL;
+			used = BlockSize;
+		}
+
+		~CArena() {
+			Release();
+		}
+
+		// Storage for one T, to be constructed by the caller with placement new
+		void *Allocate() {
+			if (used == BlockSize) {
+				Block *block = static_cast<Block *>(::operator new(sizeof(Block)));
+				block->next = blocks;
+				blocks = block;
+				used = 0;
+			}
+			return reinterpret_cast<T *>(&blocks->storage) + used++;
+		}
+
+		void Release() {
+			uint16 count = used;
+			while (blocks) {
+				Block *block = blocks;
+				T *objects = reinterpret_cast<T *>(&block->storage);
+				for (uint16 i = 0; i < count; ++i) {
+					objects[i].~T();
+				}
+				blocks = block->next;
+				::operator delete(block);
+				count = BlockSize;
+			}
+			used = BlockSize;
+		}
+
+	private:
+		struct Block {
+			Block *next;
+			typename boost::aligned_storage<sizeof(T) * BlockSize, boost::alignment_of<T>::value>::type storage;
+		};
+
+		// The newest block is the head, it is the only one not full
+		Block *blocks;
+		uint16 used;
+
+		CArena(const CArena &);
+		CArena &operator =(const CArena &);
+	};
+}
+
+#endif // DHT_ARENA_H
@@ -0,0 +1,149 @@
+#include "concurrent_routing_table.h"
+
+#include <cassert>
+#include <stdexcept>
+
+namespace dhtpp {
+
+	template <uint16 Bits>
+	CConcurrentRoutingTableT<Bits>::CConcurrentRoutingTableT(const NodeID &id) : current(NULL), epoch(1), writer_table(id) {
+		holder_id = id;
+		for (int i = 0; i < max_readers; ++i) {
+			readers[i].in_use.store(false);
+			readers[i].epoch.store(0);
+		}
+		Publish();
+	}
+
+	template <uint16 Bits>
+	CConcurrentRoutingTableT<Bits>::~CConcurrentRoutingTableT() {
+		for (int i = 0; i < max_readers; ++i) {
+			assert(!readers[i].in_use.load());
+		}
+		delete current.load();
+		for (typename std::vector<std::pair<uint64, const CRoutingTable *> >::size_type i = 0; i < retired.size(); ++i) {
+			delete retired[i].second;
+		}
+	}
+
+	template <uint16 Bits>
+	RoutingTableErrorCode CConcurrentRoutingTableT<Bits>::AddContact(const NodeInfo &info, bool &is_close_to_holder) {
+		boost::mutex::scoped_lock lock(write_mutex);
+		RoutingTableErrorCode res = writer_table.AddContact(info, is_close_to_holder);
+		// EXISTED and FULL change only the recency order or the replacements
+		if (res == SUCCEED)
+			Publish();
+		return res;
+	}
+
+	template <uint16 Bits>
+	uint16 CConcurrentRoutingTableT<Bits>::AddContacts(const NodeInfo *contacts, uint16 count,
+		RoutingTableErrorCode *results, bool *is_close_to_holder)
+	{
+		boost::mutex::scoped_lock lock(write_mutex);
+		uint16 added = writer_table.AddContacts(contacts, count, results, is_close_to_holder);
+		if (added)
+			Publish();
+		return added;
+	}
+
+	template <uint16 Bits>
+	bool CConcurrentRoutingTableT<Bits>::RemoveContact(const NodeID &node_id, bool &is_close_to_holder,
+		bool &is_promoted, NodeInfo &promoted, bool &promoted_close_to_holder)
+	{
+		boost::mutex::scoped_lock lock(write_mutex);
+		if (!writer_table.RemoveContact(node_id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder))
+			return false;
+		Publish();
+		return true;
+	}
+
+	template <uint16 Bits>
+	void CConcurrentRoutingTableT<Bits>::Publish() {
+		// The copy gets the filled holder range cache, the readers
+		// share it and must not write to it
+		writer_table.FillHolderRange();
+		CRoutingTable *table = new CRoutingTable(writer_table);
+
+		const CRoutingTable *old = current.exchange(table);
+		if (!old)
+			return;
+		// A reader that enters the new epoch loads the new table
+		uint64 old_epoch = epoch.fetch_add(1);
+		retired.push_back(std::make_pair(old_epoch + 1, old));
+
+		uint64 min_epoch = old_epoch + 1;
+		for (int i = 0; i < max_readers; ++i) {
+			uint64 e = readers[i].epoch.load();
+			if (e && e < min_epoch)
+				min_epoch = e;
+		}
+		// Free the tables replaced in the epochs all the readers have left
+		typename std::vector<std::pair<uint64, const CRoutingTable *> >::size_type kept = 0;
+		for (typename std::vector<std::pair<uint64, const CRoutingTable *> >::size_type i = 0; i < retired.size(); ++i) {
+			if (retired[i].first <= min_epoch) {
+				delete retired[i].second;
+			} else {
+				retired[kept++] = retired[i];
+			}
+		}
+		retired.resize(kept);
+	}
+
+	template <uint16 Bits>
+	CConcurrentRoutingTableT<Bits>::CReader::CReader(CConcurrentRoutingTableT &table_) : table(table_) {
+		for (slot = 0; slot < max_readers; ++slot) {
+			bool expected = false;
+			if (table.readers[slot].in_use.compare_exchange_strong(expected, true))
+				return;
+		}
+		throw std::runtime_error("CConcurrentRoutingTable: all the reader slots are taken");
+	}
+
+	template <uint16 Bits>
+	CConcurrentRoutingTableT<Bits>::CReader::~CReader() {
+		table.readers[slot].in_use.store(false);
+	}
+
+	template <uint16 Bits>
+	const typename CConcurrentRoutingTableT<Bits>::CRoutingTable *CConcurrentRoutingTableT<Bits>::CReader::Enter() {
+		// The epoch is announced before the table is loaded, so the writer
+		// that has seen the announcement keeps the table alive
+		table.readers[slot].epoch.store(table.epoch.load());
+		return table.current.load();
+	}
+
+	template <uint16 Bits>
+	void CConcurrentRoutingTableT<Bits>::CReader::Leave() {
+		table.readers[slot].epoch.store(0, boost::memory_order_release);
+	}
+
+	template <uint16 Bits>
+	bool CConcurrentRoutingTableT<Bits>::CReader::IdInHolderRange(const NodeID &id) {
+		bool res = Enter()->IdInHolderRange(id);
+		Leave();
+		return res;
+	}
+
+	template <uint16 Bits>
+	bool CConcurrentRoutingTableT<Bits>::CReader::GetContact(const NodeID &id, Contact &out) {
+		bool res = Enter()->GetContact(id, out);
+		Leave();
+		return res;
+	}
+
+	template <uint16 Bits>
+	void CConcurrentRoutingTableT<Bits>::CReader::GetClosestContacts(const NodeID &id, std::vector<NodeInfo> &out_contacts) {
+		Enter()->GetClosestContacts(id, out_contacts);
+		Leave();
+	}
+
+	template <uint16 Bits>
+	uint16 CConcurrentRoutingTableT<Bits>::CReader::GetClosestContacts(const NodeID &id, NodeInfo *out, uint16 capacity) {
+		uint16 res = Enter()->GetClosestContacts(id, out, capacity);
+		Leave();
+		return res;
+	}
+
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CConcurrentRoutingTableT)
+}
@@ -0,0 +1,108 @@
+#ifndef DHT_CONCURRENT_ROUTING_TABLE_H
+#define DHT_CONCURRENT_ROUTING_TABLE_H
+
+#include "routing_table.h"
+
+#include <boost/atomic.hpp>
+#include <boost/container/static_vector.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <utility>
+#include <vector>
+
+namespace dhtpp {
+
+	// Routing table shared by threads, for serving FIND_NODE and FIND_VALUE
+	// from several cores. The readers never lock: the writers change a table
+	// of their own, and a change of the contacts publishes a copy of it with
+	// an atomic pointer swap. A refresh of a known contact or a new
+	// replacement is not published by itself, the readers see it with the
+	// next published change (last_seen of their contacts can lag behind).
+	// The replaced tables are freed when no reader can still see them
+	// (epoch based reclamation: every reader announces the epoch it has
+	// entered in its own slot).
+	template <uint16 Bits>
+	class CConcurrentRoutingTableT {
+	public:
+		DECLARE_NODE_ID_TYPES(Bits)
+		typedef CRoutingTableT<Bits> CRoutingTable;
+
+		enum {
+			max_readers = 64
+		};
+
+		CConcurrentRoutingTableT(const NodeID &id);
+		~CConcurrentRoutingTableT();
+
+		// Writers, serialized with each other
+		RoutingTableErrorCode AddContact(const NodeInfo &info, bool &is_close_to_holder);
+		// Publishes once for all the contacts, see CRoutingTable::AddContacts
+		uint16 AddContacts(const NodeInfo *contacts, uint16 count,
+			RoutingTableErrorCode *results, bool *is_close_to_holder);
+		bool RemoveContact(const NodeID &node_id, bool &is_close_to_holder,
+			bool &is_promoted, NodeInfo &promoted, bool &promoted_close_to_holder);
+
+		// Takes one of the reader slots for the life of the object,
+		// it is used by one thread at a time. Throws std::runtime_error
+		// if all max_readers slots are taken.
+		class CReader {
+		public:
+			CReader(CConcurrentRoutingTableT &table);
+			~CReader();
+
+			bool IdInHolderRange(const NodeID &id);
+			bool GetContact(const NodeID &id, Contact &out);
+			void GetClosestContacts(const NodeID &id, std::vector<NodeInfo> &out_contacts);
+			uint16 GetClosestContacts(const NodeID &id, NodeInfo *out, uint16 capacity);
+			template <std::size_t N>
+			void GetClosestContacts(const NodeID &id, boost::container::static_vector<NodeInfo, N> &out_contacts) {
+				Enter()->GetClosestContacts(id, out_contacts);
+				Leave();
+			}
+
+		private:
+			CConcurrentRoutingTableT &table;
+			uint16 slot;
+
+			// The table is valid until Leave
+			const CRoutingTable *Enter();
+			void Leave();
+
+			CReader(const CReader &);
+			CReader &operator =(const CReader &);
+		};
+
+	private:
+		friend class CReader;
+
+		// Padded to a cache line, so the readers do not share them
+		struct ReaderSlot {
+			boost::atomic<bool> in_use;
+			// Epoch the reader has entered, 0 when it is outside
+			boost::atomic<uint64> epoch;
+			char padding[64 - sizeof(boost::atomic<bool>) - sizeof(boost::atomic<uint64>)];
+		};
+
+		NodeID holder_id;
+		boost::atomic<const CRoutingTable *> current;
+		boost::atomic<uint64> epoch;
+		ReaderSlot readers[max_readers];
+
+		boost::mutex write_mutex;
+		// The table the writers change, guarded by write_mutex
+		CRoutingTable writer_table;
+		// Replaced tables with the epoch they were replaced in
+		std::vector<std::pair<uint64, const CRoutingTable *> > retired;
+
+		// Makes a copy of writer_table current and frees the tables
+		// no reader sees
+		void Publish();
+
+		CConcurrentRoutingTableT(const CConcurrentRoutingTableT &);
+		CConcurrentRoutingTableT &operator =(const CConcurrentRoutingTableT &);
+	};
+
+	typedef CConcurrentRoutingTableT<NODE_ID_LENGTH_BITS> CConcurrentRoutingTable;
+}
+
+#endif // DHT_CONCURRENT_ROUTING_TABLE_H
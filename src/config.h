@@ -5,7 +5,9 @@
 
 namespace dhtpp {
 
+	// Default ID width, the ID containers are templates on the width in bits
 	const uint16 NODE_ID_LENGTH_BYTES = 20;
+	const uint16 NODE_ID_LENGTH_BITS = NODE_ID_LENGTH_BYTES * 8;
 	const uint16 K = 10;
 	const uint16 alpha = 3;
 	const uint64 timeout_period = 500; // ms
@@ -37,8 +39,55 @@ namespace dhtpp {
 	const uint16 rt_pow2_b_r = 1 << (rt_b - rt_r);
 	const uint16 hld_br_buck_count = (rt_pow2_r-1)*rt_pow2_b_r;
 
+	// Contacts a full bucket remembers to replace the evicted ones
+	const uint16 replacement_cache_size = 4;
+
+	// A node restored from a routing table snapshot pings alpha of the
+	// restored contacts every interval
+	const uint64 snapshot_revalidate_interval = 1000; // ms
+
+	// Candidates a lookup keeps, the farther ones are pruned
+	const uint16 shortlist_size = 3*K;
+
+	// Adaptive lookup parallelism: a timeout or a reply slower than
+	// slow_reply_time adds a request in flight, up to max_alpha,
+	// a faster reply takes one back, down to alpha
+	const uint16 max_alpha = 2*alpha;
+	const uint64 slow_reply_time = timeout_period / 2;
+
+	// With ADAPTIVE_RPC_TIMEOUT the contacts with a measured round trip
+	// time get srtt + 4*rttvar within the bounds, doubled on every retry.
+	// timeout_period is for the others.
+	const uint64 min_rpc_timeout = 100; // ms
+	const uint64 max_rpc_timeout = 2*timeout_period;
+	const uint64 rpc_timeout_hist_step = 50; // ms
+
+	// With HEDGED_LOOKUPS a find request pending for longer than this
+	// percentile of the find reply times gives its slot to the next
+	// candidate and stays pending. The percentile is taken over the last
+	// 2*hedge_min_samples replies at most, no hedging before
+	// hedge_min_samples of them.
+	const uint16 hedge_percentile = 90;
+	const uint32 hedge_min_samples = 64;
+
+	// Full buckets whose least recently seen contacts are pinged for new
+	// contacts at the same time. The new contacts of the buckets beyond
+	// are dropped, as the ones of a bucket already being checked are.
+	const uint16 max_pending_evictions = 32;
+
 #define FORCE_K_OPTIMIZATION 1
 #define DOWNLIST_OPTIMIZATION 1
+// Restarted nodes load the routing table saved on the deactivation
+#define RT_SNAPSHOT_RESTART 0
+#define ADAPTIVE_ALPHA 1
+#define ADAPTIVE_RPC_TIMEOUT 1
+#define HEDGED_LOOKUPS 1
+
+// ID widths the templates are compiled for
+#define INSTANTIATE_FOR_NODE_ID_WIDTHS(cl) \
+	template class cl<128>; \
+	template class cl<160>; \
+	template class cl<256>;
 }
 
 #endif // DHT_CONFIG_H
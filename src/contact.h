@@ -41,69 +41,122 @@ namespace dhtpp {
 		}
 	};
 
-	struct NodeInfo : public NodeAddress {
-		NodeID id;
+	inline std::size_t hash_value(const NodeAddress &addr) {
+		return (std::size_t) addr.ip;
+	}
 
-		const NodeID &GetId() const {
+	template <uint16 Bits>
+	struct NodeInfoT : public NodeAddress {
+		NodeIDT<Bits> id;
+
+		const NodeIDT<Bits> &GetId() const {
 			return id;
 		}
 
-		NodeInfo &operator =(const NodeInfo &o) {
+		NodeInfoT &operator =(const NodeInfoT &o) {
 			*(NodeAddress *) this = o;
 			id = o.id;
 			return *this;
 		}
 	};
 
-	struct Contact : public NodeInfo {
+	// Smoothed round trip time and its variation in ms, updated as the
+	// TCP retransmission timer does (RFC 6298)
+	struct RttEstimate {
+		enum {
+			unknown = 0xffff
+		};
+		uint16 srtt;
+		uint16 rttvar;
+
+		RttEstimate() {
+			srtt = unknown;
+			rttvar = 0;
+		}
+
+		bool IsKnown() const {
+			return srtt != unknown;
+		}
+
+		void AddSample(uint64 rtt) {
+			uint16 r = (uint16) (rtt < unknown ? rtt : unknown - 1);
+			if (!IsKnown()) {
+				srtt = r;
+				rttvar = r / 2;
+				return;
+			}
+			uint16 delta = srtt > r ? srtt - r : r - srtt;
+			rttvar = (uint16) ((3 * (uint32) rttvar + delta) / 4);
+			srtt = (uint16) ((7 * (uint32) srtt + r) / 8);
+		}
+
+		// srtt + 4*rttvar, without any bounds
+		uint64 GetTimeout() const {
+			return srtt + 4 * (uint64) rttvar;
+		}
+	};
+
+	template <uint16 Bits>
+	struct ContactT : public NodeInfoT<Bits> {
 		timestamp last_seen;
+		RttEstimate rtt;
 
-		Contact() {}
-		Contact(const Contact &o) {
+		ContactT() {}
+		ContactT(const ContactT &o) {
 			*this = o;
 		}
 
-		Contact &operator =(const Contact &o) {
-			*(NodeInfo *) this = o;
+		ContactT &operator =(const ContactT &o) {
+			*(NodeInfoT<Bits> *) this = o;
 			last_seen = o.last_seen;
+			rtt = o.rtt;
 			return *this;
 		}
 	};
 
-	template<typename T>
-	struct distance_comp_ge {
-		distance_comp_ge(const NodeID &holder_id_) : holder_id(holder_id_) {};
+	typedef NodeInfoT<NODE_ID_LENGTH_BITS> NodeInfo;
+	typedef ContactT<NODE_ID_LENGTH_BITS> Contact;
+
+	// Declares the ID dependent types of the given width inside a class template
+#define DECLARE_NODE_ID_TYPES(bits) \
+	typedef NodeIDT<bits> NodeID; \
+	typedef MaxNodeIDT<bits> MaxNodeID; \
+	typedef NullNodeIDT<bits> NullNodeID; \
+	typedef NodeInfoT<bits> NodeInfo; \
+	typedef ContactT<bits> Contact;
+
+	// Strict orderings by the distance to holder_id, see IsCloser
+	template<typename T, uint16 Bits = NODE_ID_LENGTH_BITS>
+	struct distance_comp_gt {
+		distance_comp_gt(const NodeIDT<Bits> &holder_id_) : holder_id(holder_id_) {};
 
 		bool operator()(const T &f1, const T &f2) {
-			return (f1.GetId() ^ holder_id) >= // Greater or equal
-				(f2.GetId() ^ holder_id);
+			return IsCloser(f2.GetId(), f1.GetId(), holder_id); // Greater
 		}
 
-		NodeID holder_id;
+		NodeIDT<Bits> holder_id;
 	};
 
-	template<typename T>
-	struct distance_comp_le {
-		distance_comp_le(const NodeID &holder_id_) : holder_id(holder_id_) {};
+	template<typename T, uint16 Bits = NODE_ID_LENGTH_BITS>
+	struct distance_comp_lt {
+		distance_comp_lt(const NodeIDT<Bits> &holder_id_) : holder_id(holder_id_) {};
 
 		bool operator()(const T &f1, const T &f2) {
-			return (f1.GetId() ^ holder_id) <= // Less or equal
-				(f2.GetId() ^ holder_id);
+			return IsCloser(f1.GetId(), f2.GetId(), holder_id); // Less
 		}
 
-		NodeID holder_id;
+		NodeIDT<Bits> holder_id;
 	};
 
-	template<typename T>
-	struct distance_comp_le_ptr {
-		distance_comp_le_ptr(const NodeID &holder_id_) : holder_id(holder_id_) {};
+	template<typename T, uint16 Bits = NODE_ID_LENGTH_BITS>
+	struct distance_comp_lt_ptr {
+		distance_comp_lt_ptr(const NodeIDT<Bits> &holder_id_) : holder_id(holder_id_) {};
 
 		bool operator()(const T &f1, const T &f2) {
-			return (f1->GetId() ^ holder_id) <= // Less or equal
-				(f2->GetId() ^ holder_id);
+			return IsCloser(f1->GetId(), f2->GetId(), holder_id); // Less
 		}
 
-		NodeID holder_id;
+		NodeIDT<Bits> holder_id;
 	};
 
 }
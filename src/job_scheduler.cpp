@@ -58,7 +58,7 @@ namespace dhtpp {
 						}
 						mutex.Unlock();
 					}
-					if (job) {
+					if (!job.empty()) {
 						job(); // do job
 						++jobs_done;
 					}
@@ -1,19 +1,20 @@
 #ifndef DHT_JOB_SCHEDULER_H
 #define DHT_JOB_SCHEDULER_H
 
-#include <boost/function.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/identity.hpp>
 #include <boost/multi_index/member.hpp>
+#include <boost/pool/pool_alloc.hpp>
 
 #include "semaphore.h"
 #include "mutex.h"
+#include "small_function.h"
 
 namespace dhtpp {
 	class CJobScheduler {
 	public:
-		typedef boost::function<void (void)> Job;
+		typedef CSmallFunction<void (void)> Job;
 		CJobScheduler();
 		~CJobScheduler();
 
@@ -64,7 +65,10 @@ namespace dhtpp {
 				// sort by owner
 				boost::multi_index::ordered_non_unique<boost::multi_index::tag<owner_tag>,
 					boost::multi_index::member<JobEntry, const void *, &JobEntry::owner> >
-			>
+			>,
+			// Every request schedules its timeout, the nodes are recycled
+			// instead of going to the heap each time
+			boost::fast_pool_allocator<JobEntry>
 		> Jobs;
 		Jobs jobs; // guarded by mutex
 
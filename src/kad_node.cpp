@@ -7,24 +7,32 @@
 
 namespace dhtpp {
 
-	CKadNode::CKadNode(const NodeInfo &info, CJobScheduler *sched, ITransport *tr) : routing_table(info.id) {
+	template <uint16 Bits>
+	CKadNodeT<Bits>::CKadNodeT(const NodeInfo &info, CJobScheduler *sched, ITransport *tr) : routing_table(info.id) {
 		scheduler = sched;
 		transport = tr;
 		my_info = info;
-		ping_id_counter = store_id_counter = find_id_counter = downlist_id_counter = 0;
 		join_pinging_nodesN = 0;
 		join_succeedN = 0;
 		join_state = NOT_JOINED;
 		store_to_first_node_count = 0;
+		for (uint16 i = 0; i < max_pending_evictions; ++i) {
+			pending_evictions[i].in_use = false;
+		}
+		shortlist_pruned_count = 0;
+		find_requests_count = hedged_find_requests_count = 0;
+		local_find_id_counter = 0;
 		store = new CStore(this, sched);
 	}
 
-	CKadNode::~CKadNode() {
+	template <uint16 Bits>
+	CKadNodeT<Bits>::~CKadNodeT() {
 		Terminate();
 		delete store;
 	}
 
-	void CKadNode::OnPingRequest(const PingRequest &req) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnPingRequest(const PingRequest &req) {
 		PingResponse resp;
 		resp.Init(my_info, req.from, my_info.GetId(), req.id);
 		transport->SendPingResponse(resp);
@@ -32,7 +40,8 @@ namespace dhtpp {
 		UpdateRoutingTable(req);
 	}
 
-	void CKadNode::OnStoreRequest(const StoreRequest &req) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnStoreRequest(const StoreRequest &req) {
 		store->StoreItem(req.key, req.value, req.time_to_live);
 
 		StoreResponse resp;
@@ -42,7 +51,8 @@ namespace dhtpp {
 		UpdateRoutingTable(req);
 	}
 
-	void CKadNode::OnFindNodeRequest(const FindNodeRequest &req) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnFindNodeRequest(const FindNodeRequest &req) {
 		FindNodeResponse resp;
 		resp.Init(my_info, req.from, my_info.GetId(), req.id);
 		routing_table.GetClosestContacts(req.target, resp.nodes);
@@ -51,7 +61,8 @@ namespace dhtpp {
 		UpdateRoutingTable(req);
 	}
 
-	void CKadNode::OnFindValueRequest(const FindValueRequest &req) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnFindValueRequest(const FindValueRequest &req) {
 		FindValueResponse resp;
 		resp.Init(my_info, req.from, my_info.GetId(), req.id);
 		store->GetItems(req.key, resp.values);
@@ -63,13 +74,14 @@ namespace dhtpp {
 		UpdateRoutingTable(req);
 	}
 
-	void CKadNode::OnDownlistRequest(const DownlistRequest &req) {
-		std::vector<NodeID>::const_iterator it;
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnDownlistRequest(const DownlistRequest &req) {
+		typename std::vector<NodeID>::const_iterator it;
 		for (it = req.down_nodes.begin(); it != req.down_nodes.end(); ++it) {
 			const NodeID &id = *it;
 			Contact info;
 			if (routing_table.GetContact(id, info)) {
-				Ping(info, boost::bind(&CKadNode::DoRemoveContact, this,
+				Ping(info, boost::bind(&CKadNodeT::DoRemoveContact, this,
 					id, boost::lambda::_1, boost::lambda::_2));
 			}
 		}
@@ -81,158 +93,263 @@ namespace dhtpp {
 		UpdateRoutingTable(req);
 	}
 
-	void CKadNode::UpdateRoutingTable(const RPCRequest &req) {
-		NodeInfo *contact = new NodeInfo;
-		contact->id = req.sender_id;
-		*(NodeAddress *) contact = req.from;
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::UpdateRoutingTable(const RPCRequest &req) {
+		NodeInfo contact;
+		contact.id = req.sender_id;
+		(NodeAddress &) contact = req.from;
 		UpdateRoutingTable(contact);
 	}
 
-	void CKadNode::UpdateRoutingTable(const RPCResponse &resp) {
-		NodeInfo *contact = new NodeInfo;
-		contact->id = resp.responder_id;
-		*(NodeAddress *) contact = resp.from;
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::UpdateRoutingTable(const RPCResponse &resp) {
+		NodeInfo contact;
+		contact.id = resp.responder_id;
+		(NodeAddress &) contact = resp.from;
 		UpdateRoutingTable(contact);
 	}
 
-	void CKadNode::UpdateRoutingTable(NodeInfo *contact) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::UpdateRoutingTable(const NodeInfo &contact) {
 		bool is_close_to_holder;
-		RoutingTableErrorCode err = routing_table.AddContact(*contact, is_close_to_holder);
+		RoutingTableErrorCode err = routing_table.AddContact(contact, is_close_to_holder);
 		if (err == SUCCEED) {
-			store->OnNewContact(*contact, is_close_to_holder);
+			store->OnNewContact(contact, is_close_to_holder);
 		} else if (err == FULL) {
 			// Check last seen contact
-			Contact *last_seen_contact = new Contact;
-			if (routing_table.LastSeenContact(contact->id, *last_seen_contact) 
-				&& (last_seen_contact->last_seen + min_rt_check_time_interval < GetTimerInstance()->GetCurrentTime()) 
-				&& !last_seen_contacts.count(last_seen_contact->id)) 
+			Contact last_seen_contact;
+			if (routing_table.LastSeenContact(contact.id, last_seen_contact) 
+				&& (last_seen_contact.last_seen + min_rt_check_time_interval < GetTimerInstance()->GetCurrentTime()) 
+				&& FindPendingEviction(last_seen_contact.id) == max_pending_evictions) 
 			{
-				last_seen_contacts.insert(last_seen_contact->id);
-				Ping(*last_seen_contact, boost::bind(&CKadNode::DoAddContact, this,
-					contact, last_seen_contact, 
-					boost::lambda::_1, boost::lambda::_2));
-				return;
+				uint16 eviction;
+				for (eviction = 0; eviction < max_pending_evictions && pending_evictions[eviction].in_use; ++eviction);
+				if (eviction == max_pending_evictions)
+					return;
+				PendingEviction &entry = pending_evictions[eviction];
+				entry.in_use = true;
+				entry.new_contact = contact;
+				entry.last_seen_id = last_seen_contact.id;
+				Ping(last_seen_contact, boost::bind(&CKadNodeT::DoAddContact, this,
+					eviction, boost::lambda::_1, boost::lambda::_2));
 			}
-			delete last_seen_contact;
 		}
-		delete contact;
 	}
 
-	void CKadNode::DoAddContact(NodeInfo *new_contact, Contact *last_seen_contact, ErrorCode code, rpc_id id) {
+	template <uint16 Bits>
+	uint16 CKadNodeT<Bits>::FindPendingEviction(const NodeID &last_seen_id) const {
+		for (uint16 i = 0; i < max_pending_evictions; ++i) {
+			if (pending_evictions[i].in_use && pending_evictions[i].last_seen_id == last_seen_id)
+				return i;
+		}
+		return max_pending_evictions;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::UpdateRoutingTable(const NodeInfo *contacts, uint16 count) {
+		RoutingTableErrorCode results[K];
+		bool is_close_to_holder[K];
+		NodeInfo added[K];
+		bool added_close_to_holder[K];
+		for (uint16 first = 0; first < count; first += K) {
+			uint16 n = std::min<uint16>(count - first, K);
+			routing_table.AddContacts(contacts + first, n, results, is_close_to_holder);
+			uint16 added_number = 0;
+			for (uint16 i = 0; i < n; ++i) {
+				if (results[i] == dhtpp::SUCCEED) {
+					added[added_number] = contacts[first + i];
+					added_close_to_holder[added_number++] = is_close_to_holder[i];
+				}
+			}
+			store->OnNewContacts(added, added_close_to_holder, added_number);
+		}
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::DoAddContact(uint16 eviction, ErrorCode code, rpc_id id) {
+		PendingEviction &entry = pending_evictions[eviction];
 		if (code == FAILED) {
 			// last_seen_contact is down
+			RemoveFromRoutingTable(entry.last_seen_id);
 			bool is_close_to_holder;
-			if (routing_table.RemoveContact(last_seen_contact->id, is_close_to_holder)) {
-				store->OnRemoveContact(last_seen_contact->id, is_close_to_holder);
-			}
-			if (routing_table.AddContact(*new_contact, is_close_to_holder) == SUCCEED) {
-				store->OnNewContact(*new_contact, is_close_to_holder);
+			if (routing_table.AddContact(entry.new_contact, is_close_to_holder) == SUCCEED) {
+				store->OnNewContact(entry.new_contact, is_close_to_holder);
 			}
 		}
-		last_seen_contacts.erase(last_seen_contact->id);
-		delete new_contact;
-		delete last_seen_contact;
+		entry.in_use = false;
 	}
 
-	void CKadNode::OnPingResponse(const PingResponse &resp) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnPingResponse(const PingResponse &resp) {
 		UpdateRoutingTable(resp);
-		PingRequestData temp, *data;
-		temp.req.id = resp.id;
-		PingRequests::iterator it = ping_requests.find(&temp);
-		if (it == ping_requests.end())
-			return;
-		data = *it;
-		if (data->req.to != resp.from)
+		PingRequestData *data = ping_requests.Get(resp.id);
+		if (!data || data->req.to != resp.from)
 			return;
+		UpdateRtt(resp.responder_id, data->sent_time, data->attempts);
 		scheduler->CancelJobsByOwner(data);
 		data->callback(SUCCEED, resp.id);
-		ping_requests.erase(it);
+		ping_requests.Remove(resp.id);
 		delete data;
 	}
 
-	rpc_id CKadNode::Ping(const NodeAddress &to, const ping_callback &callback) {
+	template <uint16 Bits>
+	rpc_id CKadNodeT<Bits>::Ping(const NodeAddress &to, const ping_callback &callback) {
 		PingRequestData *data = new PingRequestData;
-		data->req.Init(my_info, to, my_info.GetId(), ping_id_counter++);
+		rpc_id id = ping_requests.Add(data);
+		if (id == PingRequests::invalid_id) {
+			delete data;
+			callback(OVERLOADED, id);
+			return id;
+		}
+		data->req.Init(my_info, to, my_info.GetId(), id);
 		data->callback = callback;
-		transport->SendPingRequest(data->req);
-		ping_requests.insert(data);
-		scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::PingRequestTimeout, this, data->req.id), data);
+		SendPingRequest(data);
 		return data->req.id;
 	}
 
-	void CKadNode::PingRequestTimeout(rpc_id id) {
-		PingRequestData temp, *data;
-		temp.req.id = id;
-		PingRequests::iterator it = ping_requests.find(&temp);
-		if (it == ping_requests.end())
+	template <uint16 Bits>
+	rpc_id CKadNodeT<Bits>::Ping(const NodeInfo &to, const ping_callback &callback) {
+		PingRequestData *data = new PingRequestData;
+		rpc_id id = ping_requests.Add(data);
+		if (id == PingRequests::invalid_id) {
+			delete data;
+			callback(OVERLOADED, id);
+			return id;
+		}
+		data->req.Init(my_info, to, my_info.GetId(), id);
+		data->callback = callback;
+		data->to_id = to.id;
+		data->to_id_known = true;
+		SendPingRequest(data);
+		return data->req.id;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::SendPingRequest(PingRequestData *data) {
+		transport->SendPingRequest(data->req);
+		data->sent_time = GetTimerInstance()->GetCurrentTime();
+		uint64 timeout = data->to_id_known ? GetRpcTimeout(data->to_id, data->attempts) : GetRpcTimeout(RttEstimate(), data->attempts);
+		scheduler->AddJob_(timeout, boost::bind(&CKadNodeT::PingRequestTimeout, this, data->req.id), data);
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::PingRequestTimeout(rpc_id id) {
+		PingRequestData *data = ping_requests.Get(id);
+		if (!data)
 			return;
-		data = *it;
 		if (data->attempts++ < attempts_number) {
-			transport->SendPingRequest(data->req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::PingRequestTimeout, this, id), data);
+			SendPingRequest(data);
 		} else {
-			ping_requests.erase(it);
+			ping_requests.Remove(id);
 			data->callback(FAILED, id);
 			delete data;
 		}
 	}
 
-	void CKadNode::OnDownlistResponse(const DownlistResponse &resp) {
+	template <uint16 Bits>
+	uint64 CKadNodeT<Bits>::GetRpcTimeout(const NodeID &id, uint16 attempts) {
+		Contact contact;
+		if (!routing_table.GetContact(id, contact))
+			return GetRpcTimeout(RttEstimate(), attempts);
+		return GetRpcTimeout(contact.rtt, attempts);
+	}
+
+	template <uint16 Bits>
+	uint64 CKadNodeT<Bits>::GetRpcTimeout(const RttEstimate &rtt, uint16 attempts) {
+		uint64 timeout = timeout_period;
+#if ADAPTIVE_RPC_TIMEOUT
+		if (rtt.IsKnown())
+			timeout = std::min(max_rpc_timeout, std::max(min_rpc_timeout, rtt.GetTimeout()) << attempts);
+#endif
+		rpc_timeout_count[(int) (timeout / rpc_timeout_hist_step * rpc_timeout_hist_step)]++;
+		return timeout;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::UpdateRtt(const NodeID &id, uint64 sent_time, uint16 attempts) {
+#if ADAPTIVE_RPC_TIMEOUT
+		if (!attempts)
+			routing_table.UpdateRtt(id, GetTimerInstance()->GetCurrentTime() - sent_time);
+#endif
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnDownlistResponse(const DownlistResponse &resp) {
 		UpdateRoutingTable(resp);
-		DownlistRequestData temp, *data;
-		temp.id = resp.id;
-		DownlistRequests::iterator it = downlist_requests.find(&temp);
-		if (it == downlist_requests.end())
+		DownlistRequestData *data = downlist_requests.Get(resp.id);
+		if (!data)
 			return;
-		data = *it;
-
-		std::set<DownlistRequestData::RequestedNode *>::iterator rit = data->req_nodes.begin();
-		for (;rit != data->req_nodes.end(); ++rit) {
-			DownlistRequestData::RequestedNode *node = *rit;
-			if ((NodeAddress &)*node == resp.from) {
-				scheduler->CancelJobsByOwner(node);
-				data->req_nodes.erase(rit);
-				delete node;
-				break;
-			}
-		}
-		if (!data->req_nodes.size())
+		uint16 dest = DownlistRequests::GetDest(resp.id);
+		if (dest >= data->req_nodes.size())
+			return;
+		typename DownlistRequestData::RequestedNode *node = &data->req_nodes[dest];
+		if (!node->pending || (NodeAddress &)*node != resp.from)
+			return;
+		UpdateRtt(node->id, node->sent_time, node->attempts);
+		scheduler->CancelJobsByOwner(node);
+		node->pending = false;
+		if (!--data->pending_nodes)
 			FinishDownlistRequests(data);
 	}
 
-	CKadNode::FindRequestData *CKadNode::GetFindData(rpc_id id) {
-		// Get FindRequestData by rpc_id
-		FindRequestData temp;
-		temp.id = id;
-		FindRequests::iterator it = find_requests.find(&temp);
-		if (it == find_requests.end())
-			return NULL;
-		return *it;
+	template <uint16 Bits>
+	typename CKadNodeT<Bits>::FindRequestData *CKadNodeT<Bits>::GetFindData(rpc_id id) {
+		return find_requests.Get(id);
 	}
 
-	CKadNode::FindRequestData::Candidate *CKadNode::FindRequestData::GetCandidate(const NodeID &id) {
+	template <uint16 Bits>
+	typename CKadNodeT<Bits>::FindRequestData::Candidate *CKadNodeT<Bits>::FindRequestData::GetCandidate(const NodeID &id) {
 		// Get Candidate by NodeId
-		FindRequestData::CandidateLite lite;
+		typename FindRequestData::CandidateLite lite;
 		lite.distance = id ^ target;
-		FindRequestData::Candidates::iterator cit = candidates.find(lite, std::less<FindRequestData::CandidateLite>());
+		typename FindRequestData::Candidates::iterator cit = candidates.find(lite, std::less<typename FindRequestData::CandidateLite>());
 		if (cit == candidates.end())
 			return NULL;
 		return &*cit;
 	}
 
-	void CKadNode::FindRequestData::Update(const std::vector<NodeInfo> &nodes) {
+	template <uint16 Bits>
+	typename CKadNodeT<Bits>::FindRequestData::Candidate *CKadNodeT<Bits>::FindRequestData::AddCandidate(const NodeInfo &info) {
+		// The duplicates are found before anything is allocated
+		CandidateLite lite;
+		lite.distance = info.id ^ target;
+		typename Candidates::insert_commit_data commit_data;
+		if (!candidates.insert_check(lite, std::less<CandidateLite>(), commit_data).second)
+			return NULL;
+		if (candidates.size() >= shortlist_size) {
+			typename Candidates::reverse_iterator it = candidates.rbegin();
+			while (it != candidates.rend() && lite < *it && it->type != Candidate::UNKNOWN)
+				++it;
+			if (it == candidates.rend() || !(lite < *it)) {
+				// farther than every candidate it could replace
+				++pruned;
+				return NULL;
+			}
+			// The storage of the evicted candidate takes the node
+			Candidate *cand = &*it;
+			candidates.erase(candidates.iterator_to(*cand));
+			cand->~Candidate();
+			new (cand) Candidate(info, target);
+			candidates.insert(*cand);
+			++pruned;
+			return cand;
+		}
+		Candidate *cand = new (candidates_arena.Allocate()) Candidate(info, target);
+		candidates.insert_commit(*cand, commit_data);
+		return cand;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FindRequestData::Update(const typename FindNodeResponse::Nodes &nodes) {
 		// update contacts
-		std::vector<NodeInfo>::const_iterator vit;
+		typename FindNodeResponse::Nodes::const_iterator vit;
 		for (vit = nodes.begin(); vit != nodes.end(); ++vit) {
-			Candidate *cand = new Candidate(*vit, target);
-			if (!candidates.insert(*cand).second) {
-				// already exist
-				delete cand;
-			}
+			AddCandidate(*vit);
 		}
 	}
 
-	void CKadNode::OnFindNodeResponse(const FindNodeResponse &resp) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnFindNodeResponse(const FindNodeResponse &resp) {
 		UpdateRoutingTable(resp);
 		// Get FindRequestData by rpc_id
 		FindRequestData *data = GetFindData(resp.id);
@@ -240,22 +357,27 @@ namespace dhtpp {
 			return;
 
 		// Get Candidate by NodeId
-		FindRequestData::Candidate *cand = data->GetCandidate(resp.responder_id);
+		typename FindRequestData::Candidate *cand = data->GetCandidate(resp.responder_id);
 		if (!cand)
 			return;
 
 		// Cancel timeout
 		scheduler->CancelJobsByOwner(cand);
 
-		if (cand->type == FindRequestData::Candidate::PENDING)
-			data->pending_nodes--;
+		if (cand->type == FindRequestData::Candidate::PENDING) {
+			FindRequestDone(data, cand);
+			UpdateParallelism(data, cand);
+			UpdateRtt(cand->id, cand->sent_time, cand->attempts);
+			if (!cand->attempts)
+				find_reply_times.Add(GetTimerInstance()->GetCurrentTime() - cand->sent_time);
+		}
 
 		cand->type = FindRequestData::Candidate::UP;
 		
 		// update contacts
 		data->Update(resp.nodes);
 
-		while (data->pending_nodes < alpha && SendFindRequestToOneNode(data));
+		while (data->CanSend() && SendFindRequestToOneNode(data));
 
 		if (!data->pending_nodes) {
 			CallFindNodeCallback(data);
@@ -263,7 +385,8 @@ namespace dhtpp {
 		}
 	}
 
-	void CKadNode::OnFindValueResponse(const FindValueResponse &resp) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnFindValueResponse(const FindValueResponse &resp) {
 		UpdateRoutingTable(resp);
 		// Get FindRequestData by rpc_id
 		FindRequestData *data = GetFindData(resp.id);
@@ -271,25 +394,30 @@ namespace dhtpp {
 			return;
 
 		// Get Candidate by NodeId
-		FindRequestData::Candidate *cand = data->GetCandidate(resp.responder_id);
+		typename FindRequestData::Candidate *cand = data->GetCandidate(resp.responder_id);
 		if (!cand)
 			return;
 
 		// Cancel timeout
 		scheduler->CancelJobsByOwner(cand);
 
-		if (cand->type == FindRequestData::Candidate::PENDING)
-			data->pending_nodes--;
+		if (cand->type == FindRequestData::Candidate::PENDING) {
+			FindRequestDone(data, cand);
+			UpdateParallelism(data, cand);
+			UpdateRtt(cand->id, cand->sent_time, cand->attempts);
+			if (!cand->attempts)
+				find_reply_times.Add(GetTimerInstance()->GetCurrentTime() - cand->sent_time);
+		}
 
 		cand->type = FindRequestData::Candidate::UP;
 
 		if (resp.values.size()) {
-			data->find_value_callback_(SUCCEED, &resp);
+			CallFindValueCallback(data, SUCCEED, &resp);
 
 			// store the key/value pair at the closest node seen which did not return the value
-			FindRequestData::Candidates::iterator it = data->candidates.begin();
+			typename FindRequestData::Candidates::iterator it = data->candidates.begin();
 			for (; it != data->candidates.end(); ++it) {
-				FindRequestData::Candidate *cand = &*it;
+				typename FindRequestData::Candidate *cand = &*it;
 				if (cand->type != FindRequestData::Candidate::UP)
 					continue;
 				if (cand->id == resp.responder_id)
@@ -297,7 +425,7 @@ namespace dhtpp {
 				// Do store
 				for (std::vector<std::string>::size_type i = 0; i < resp.values.size(); ++i) {
 					StoreToNode(*cand, data->target, resp.values[i], republish_time,
-						boost::bind(&CKadNode::StoreToFirstNodeCallback, this, 
+						boost::bind(&CKadNodeT::StoreToFirstNodeCallback, this, 
 						boost::lambda::_1, boost::lambda::_2, boost::lambda::_3));
 				}
 				break;
@@ -310,74 +438,117 @@ namespace dhtpp {
 		// update contacts
 		data->Update(resp.nodes);
 
-		while (data->pending_nodes < alpha && SendFindRequestToOneNode(data));
+		while (data->CanSend() && SendFindRequestToOneNode(data));
 
 		if (!data->pending_nodes) {
-			data->find_value_callback_(FAILED, NULL);
+			CallFindValueCallback(data, FAILED, NULL);
 			FinishSearch(data);
 		}
 	}
 
-	rpc_id CKadNode::FindCloseNodes(const NodeID &id, const find_node_callback &callback) {
+	template <uint16 Bits>
+	rpc_id CKadNodeT<Bits>::FindCloseNodes(const NodeID &id, const find_node_callback &callback) {
+		FindRequestData *data = GetRunningFindData(id, FindRequestData::FIND_NODE);
+		if (data) {
+			data->find_node_callbacks.push_back(callback);
+			return data->id;
+		}
+
 		// Create request data
-		FindRequestData *data = CreateFindData(id, FindRequestData::FIND_NODE);
-		data->find_node_callback_ = callback;
+		data = CreateFindData(id, FindRequestData::FIND_NODE);
+		if (!data) {
+			callback(OVERLOADED, NULL);
+			return FindRequests::invalid_id;
+		}
+		data->find_node_callbacks.push_back(callback);
 
 		// Send requests to closest alpha nodes
-		for (int i = 0; i < alpha; ++i) {
+		for (int i = 0; i < data->parallelism; ++i) {
 			SendFindRequestToOneNode(data);
 		}
 		return data->id;
 	}
 
-	rpc_id CKadNode::FindValue(const NodeID &key, const find_value_callback &callback) {
+	template <uint16 Bits>
+	rpc_id CKadNodeT<Bits>::FindValue(const NodeID &key, const find_value_callback &callback) {
 		// Check our store
 		FindValueResponse resp;
 		store->GetItems(key, resp.values);
 		if (resp.values.size()) {
-			resp.id = find_id_counter++;
+			resp.id = FindRequests::LocalId(local_find_id_counter++);
 			callback(SUCCEED, &resp);
 			return resp.id;
 		}
 
+		FindRequestData *data = GetRunningFindData(key, FindRequestData::FIND_VALUE);
+		if (data) {
+			data->find_value_callbacks.push_back(callback);
+			return data->id;
+		}
+
 		// Start searching process
 		// Create request data
-		FindRequestData *data = CreateFindData(key, FindRequestData::FIND_VALUE);
-		data->find_value_callback_ = callback;
+		data = CreateFindData(key, FindRequestData::FIND_VALUE);
+		if (!data) {
+			callback(OVERLOADED, NULL);
+			return FindRequests::invalid_id;
+		}
+		data->find_value_callbacks.push_back(callback);
 
 		// Send requests to closest alpha nodes
-		for (int i = 0; i < alpha; ++i) {
+		for (int i = 0; i < data->parallelism; ++i) {
 			SendFindRequestToOneNode(data);
 		}
 		return data->id;
 	}
 
-	void CKadNode::GetLocalCloseNodes(const NodeID &id, std::vector<NodeInfo> &out) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::GetLocalCloseNodes(const NodeID &id, std::vector<NodeInfo> &out) {
 		routing_table.GetClosestContacts(id, out);
 	}
 
-	CKadNode::FindRequestData *CKadNode::CreateFindData(const NodeID &id, FindRequestData::FindType type) {
+	template <uint16 Bits>
+	typename CKadNodeT<Bits>::FindRequestData *CKadNodeT<Bits>::CreateFindData(const NodeID &id, typename FindRequestData::FindType type) {
 		// Create request data
 		FindRequestData *data = new FindRequestData;
-		data->id = find_id_counter++;
+		data->id = find_requests.Add(data);
+		if (data->id == FindRequests::invalid_id) {
+			delete data;
+			return NULL;
+		}
 		data->type = type;
 		data->target = id;
+#if HEDGED_LOOKUPS
+		data->hedge_deadline = find_reply_times.GetPercentile(hedge_percentile);
+#endif
 
 		// Fill by our closest contacts
 		std::vector<NodeInfo> closest_contacts;
 		routing_table.GetClosestContacts(id, closest_contacts);
 		assert(closest_contacts.size());
-		std::vector<NodeInfo>::iterator it;
+		typename std::vector<NodeInfo>::iterator it;
 		for (it = closest_contacts.begin(); it != closest_contacts.end(); ++it) {
-			FindRequestData::Candidate *cand = new FindRequestData::Candidate(*it, id);
-			data->candidates.insert(*cand);
+			data->AddCandidate(*it);
 		}
-
-		find_requests.insert(data);
 		return data;
 	}
 
-	void CKadNode::FindRequestTimeout(FindRequestData *data, FindRequestData::Candidate *cand) {
+	template <uint16 Bits>
+	typename CKadNodeT<Bits>::FindRequestData *CKadNodeT<Bits>::GetRunningFindData(const NodeID &id, typename FindRequestData::FindType type) {
+		// Only a few lookups are in flight, a scan is enough
+		for (uint32 slot = 0; slot < find_requests.SlotsNumber(); ++slot) {
+			FindRequestData *data = find_requests.GetBySlot(slot);
+			if (data && data->type == type && !data->finished && data->target == id)
+				return data;
+		}
+		return NULL;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FindRequestTimeout(FindRequestData *data, typename FindRequestData::Candidate *cand) {
+		// The hedge job, if the timeout came first
+		scheduler->CancelJobsByOwner(cand);
+
 		if (cand->attempts++ < attempts_number) {
 			// this node can be requested again
 			cand->type = FindRequestData::Candidate::UNKNOWN;
@@ -385,23 +556,27 @@ namespace dhtpp {
 			cand->type = FindRequestData::Candidate::DOWN;
 		}
 
-		data->pending_nodes--;
+		FindRequestDone(data, cand);
+#if ADAPTIVE_ALPHA
+		data->Widen();
+#endif
 
-		while (data->pending_nodes < alpha && SendFindRequestToOneNode(data));
+		while (data->CanSend() && SendFindRequestToOneNode(data));
 
 		if (!data->pending_nodes) {
 			if (data->type == FindRequestData::FIND_NODE)
 				CallFindNodeCallback(data);
-			else data->find_value_callback_(FAILED, NULL);
+			else CallFindValueCallback(data, FAILED, NULL);
 			FinishSearch(data);
 		}
 	}
 
-	bool CKadNode::SendFindRequestToOneNode(FindRequestData *data) {
-		FindRequestData::Candidates::iterator it;
+	template <uint16 Bits>
+	bool CKadNodeT<Bits>::SendFindRequestToOneNode(FindRequestData *data) {
+		typename FindRequestData::Candidates::iterator it;
 		int up_count = 0;
 		for (it = data->candidates.begin(); it != data->candidates.end() && up_count < K; ++it) {
-			FindRequestData::Candidate *cand = &*it;
+			typename FindRequestData::Candidate *cand = &*it;
 			if (cand->type == FindRequestData::Candidate::UP)
 				++up_count;
 			if (cand->type != FindRequestData::Candidate::UNKNOWN)
@@ -415,52 +590,100 @@ namespace dhtpp {
 		return false;
 	}
 
-	void CKadNode::SendFindRequestToOneNode(FindRequestData *data, FindRequestData::Candidate *cand) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::SendFindRequestToOneNode(FindRequestData *data, typename FindRequestData::Candidate *cand) {
 		if (data->type == FindRequestData::FIND_NODE) {
 			FindNodeRequest req;
 			req.Init(my_info, *cand, my_info.GetId(), data->id);
 			req.target = data->target;
 			cand->type = FindRequestData::Candidate::PENDING;
 			transport->SendFindNodeRequest(req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::FindRequestTimeout, this, data, cand), cand);
 		} else {
 			FindValueRequest req;
 			req.Init(my_info, *cand, my_info.GetId(), data->id);
 			req.key = data->target;
 			cand->type = FindRequestData::Candidate::PENDING;
 			transport->SendFindValueRequest(req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::FindRequestTimeout, this, data, cand), cand);
 		}
+		uint64 timeout = GetRpcTimeout(cand->id, cand->attempts);
+		scheduler->AddJob_(timeout, boost::bind(&CKadNodeT::FindRequestTimeout, this, data, cand), cand);
+#if HEDGED_LOOKUPS
+		if (data->hedge_deadline && data->hedge_deadline < timeout)
+			scheduler->AddJob_(data->hedge_deadline, boost::bind(&CKadNodeT::FindRequestHedge, this, data, cand), cand);
+#endif
+		cand->sent_time = GetTimerInstance()->GetCurrentTime();
 		data->requests_total++;
+		find_requests_count++;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FindRequestHedge(FindRequestData *data, typename FindRequestData::Candidate *cand) {
+		// The candidate stays pending, its late reply is taken as usual
+		cand->hedged = true;
+		data->hedged_nodes++;
+		int requests_total = data->requests_total;
+		while (data->CanSend() && SendFindRequestToOneNode(data));
+		hedged_find_requests_count += data->requests_total - requests_total;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FindRequestDone(FindRequestData *data, typename FindRequestData::Candidate *cand) {
+		data->pending_nodes--;
+		if (cand->hedged) {
+			cand->hedged = false;
+			data->hedged_nodes--;
+		}
 	}
 
-	void CKadNode::CallFindNodeCallback(FindRequestData *data) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::UpdateParallelism(FindRequestData *data, const typename FindRequestData::Candidate *cand) {
+#if ADAPTIVE_ALPHA
+		if (GetTimerInstance()->GetCurrentTime() - cand->sent_time > slow_reply_time)
+			data->Widen();
+		else data->Narrow();
+#endif
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::CallFindNodeCallback(FindRequestData *data) {
 		assert(data->type == FindRequestData::FIND_NODE);
 		// do callback
 		FindNodeResponse closest_contacts;
 		closest_contacts.id = data->id;
 		int i = 0;
-		FindRequestData::Candidates::iterator it;
+		typename FindRequestData::Candidates::iterator it;
 		for (it = data->candidates.begin(); it != data->candidates.end() && i < K; ++it) {
-			FindRequestData::Candidate *cand = &*it;
+			typename FindRequestData::Candidate *cand = &*it;
 			if (cand->type == FindRequestData::Candidate::UP) {
 				++i;
 				closest_contacts.nodes.push_back(*(const NodeInfo *)cand);
 			}
 		}
 
-		if (closest_contacts.nodes.size())
-			data->find_node_callback_(SUCCEED, &closest_contacts);
-		else data->find_node_callback_(FAILED, NULL);		
+		data->finished = true;
+		for (std::size_t i = 0; i < data->find_node_callbacks.size(); ++i) {
+			if (closest_contacts.nodes.size())
+				data->find_node_callbacks[i](SUCCEED, &closest_contacts);
+			else data->find_node_callbacks[i](FAILED, NULL);
+		}
 	}
 
-	void CKadNode::FinishSearch(FindRequestData *data) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::CallFindValueCallback(FindRequestData *data, ErrorCode code, const FindValueResponse *resp) {
+		assert(data->type == FindRequestData::FIND_VALUE);
+		data->finished = true;
+		for (std::size_t i = 0; i < data->find_value_callbacks.size(); ++i) {
+			data->find_value_callbacks[i](code, resp);
+		}
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FinishSearch(FindRequestData *data) {
 		DownlistRequestData *ddata = new DownlistRequestData;
 		// Clean up
-		FindRequestData::Candidates::iterator it;
-		for (it = data->candidates.begin(); it != data->candidates.end(); ) {
-			FindRequestData::Candidate *cand = &*it;
-			it = data->candidates.erase(it);
+		typename FindRequestData::Candidates::iterator it;
+		for (it = data->candidates.begin(); it != data->candidates.end(); ++it) {
+			typename FindRequestData::Candidate *cand = &*it;
 
 			switch (cand->type) {
 				case FindRequestData::Candidate::PENDING:
@@ -470,9 +693,12 @@ namespace dhtpp {
 					}
 				case FindRequestData::Candidate::UP:
 					{
-						DownlistRequestData::RequestedNode *nd = new DownlistRequestData::RequestedNode;
-						*(NodeInfo *)nd = *(NodeInfo *)cand;
-						ddata->req_nodes.insert(nd);
+						// The farthest ones are left out if the destinations
+						// do not fit the rpc_id
+						if (ddata->req_nodes.size() < DownlistRequests::max_dests) {
+							ddata->req_nodes.push_back(typename DownlistRequestData::RequestedNode());
+							*(NodeInfo *)&ddata->req_nodes.back() = *(NodeInfo *)cand;
+						}
 						break;
 					}
 				case FindRequestData::Candidate::DOWN:
@@ -481,71 +707,87 @@ namespace dhtpp {
 						break;
 					}
 			}
-
-			delete cand;
 		}
 
+		shortlist_pruned_count += data->pruned;
+		find_parallelism_count[data->max_parallelism]++;
+
 		if (data->type == FindRequestData::FIND_NODE) {
 			find_node_reqs_count[data->requests_total]++;
 		} else {
 			find_value_reqs_count[data->requests_total]++;
 		}
 
-		find_requests.erase(data);
+		find_requests.Remove(data->id);
 		delete data;
 
 		DoDownlistRequests(ddata);
 	}
 
-	rpc_id CKadNode::Store(const NodeID &key, const std::string &value, uint64 time_to_live, const store_callback &callback) {
+	template <uint16 Bits>
+	rpc_id CKadNodeT<Bits>::Store(const NodeID &key, const std::string &value, uint64 time_to_live, const store_callback &callback) {
 		StoreRequestData *data = new StoreRequestData;
 		data->key = key;
 		data->value = value;
 		data->callback = callback;
 		data->time_to_live = time_to_live;
-		data->id = store_id_counter++;
-		FindCloseNodes(key, boost::bind(&CKadNode::DoStore, this, data, false, boost::lambda::_1, boost::lambda::_2));
-		return data->id;
+		rpc_id id = data->id = store_requests.Add(data);
+		if (id == StoreRequests::invalid_id) {
+			delete data;
+			callback(OVERLOADED, id, NULL);
+			return id;
+		}
+		// DoStore can finish the request before FindCloseNodes returns
+		FindCloseNodes(key, boost::bind(&CKadNodeT::DoStore, this, data, false, boost::lambda::_1, boost::lambda::_2));
+		return id;
 	}
 
-	rpc_id CKadNode::StoreToNode(const NodeInfo &to_node, const NodeID &key, const std::string &value, uint64 time_to_live, const store_callback &callback) {
+	template <uint16 Bits>
+	rpc_id CKadNodeT<Bits>::StoreToNode(const NodeInfo &to_node, const NodeID &key, const std::string &value, uint64 time_to_live, const store_callback &callback) {
 		StoreRequestData *data = new StoreRequestData;
 		data->key = key;
 		data->value = value;
 		data->callback = callback;
 		data->time_to_live = time_to_live;
-		data->id = store_id_counter++;
+		rpc_id id = data->id = store_requests.Add(data);
+		if (id == StoreRequests::invalid_id) {
+			delete data;
+			callback(OVERLOADED, id, NULL);
+			return id;
+		}
 		FindNodeResponse resp;
 		resp.nodes.push_back(to_node);
 		DoStore(data, true, SUCCEED, &resp);
-		return data->id;
+		return id;
 	}
 
-	void CKadNode::DoStore(StoreRequestData *data, bool single, ErrorCode code, const FindNodeResponse *resp) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::DoStore(StoreRequestData *data, bool single, ErrorCode code, const FindNodeResponse *resp) {
 		if (code != SUCCEED) {
+			store_requests.Remove(data->id);
 			data->callback(code, data->id, NULL);
 			delete data;
 			return;
 		}
 
-		store_requests.insert(data);
-
 		// Send Store requests
 		StoreRequest req;
 		req.key = data->key;
 		req.value = data->value;
 		req.time_to_live = data->time_to_live;
 
-		std::vector<NodeInfo>::const_iterator it;
+		typename FindNodeResponse::Nodes::const_iterator it;
 		for (it = resp->nodes.begin(); it != resp->nodes.end(); ++it) {
 			if (*it == my_info) // do not send store to yourself
 				continue;
-			StoreRequestData::StoreNode *node = new StoreRequestData::StoreNode;
+			data->store_nodes.push_back(typename StoreRequestData::StoreNode());
+			typename StoreRequestData::StoreNode *node = &data->store_nodes.back();
 			*(NodeInfo *)node = *it;
-			data->store_nodes.insert(node);
-			req.Init(my_info, *(NodeAddress *)node, my_info.GetId(), data->id);
+			++data->pending_nodes;
+			req.Init(my_info, *(NodeAddress *)node, my_info.GetId(), StoreRequests::WithDest(data->id, data->store_nodes.size() - 1));
 			transport->SendStoreRequest(req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::StoreRequestTimeout, this, data, node), node);
+			node->sent_time = GetTimerInstance()->GetCurrentTime();
+			scheduler->AddJob_(GetRpcTimeout(node->id, node->attempts), boost::bind(&CKadNodeT::StoreRequestTimeout, this, data, node), node);
 		}
 
 		if (!single && resp->nodes.size() < K) {
@@ -553,73 +795,77 @@ namespace dhtpp {
 		} else {
 			data->max_distance = resp->nodes[resp->nodes.size()-1].id ^ data->key;
 		}
+		// Nobody to store to but us, the slot is not kept forever
+		if (!data->pending_nodes)
+			FinishStore(data);
 	}
 
-	void CKadNode::StoreRequestTimeout(StoreRequestData *data, StoreRequestData::StoreNode *node) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::StoreRequestTimeout(StoreRequestData *data, typename StoreRequestData::StoreNode *node) {
 		if (node->attempts++ < attempts_number) {
 			// Repeat request
 			StoreRequest req;
 			req.key = data->key;
 			req.value = data->value;
-			req.Init(my_info, *(NodeAddress *)node, my_info.GetId(), data->id);
+			req.Init(my_info, *(NodeAddress *)node, my_info.GetId(), StoreRequests::WithDest(data->id, node - &data->store_nodes[0]));
 			transport->SendStoreRequest(req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::StoreRequestTimeout, this, data, node), node);
+			node->sent_time = GetTimerInstance()->GetCurrentTime();
+			scheduler->AddJob_(GetRpcTimeout(node->id, node->attempts), boost::bind(&CKadNodeT::StoreRequestTimeout, this, data, node), node);
 		} else {
-			data->store_nodes.erase(node);
-			delete node;
-			if (!data->store_nodes.size())
+			node->pending = false;
+			if (!--data->pending_nodes)
 				FinishStore(data);
 		}
 	}
 
-	void CKadNode::FinishStore(StoreRequestData *data) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FinishStore(StoreRequestData *data) {
 		if (data->succeded > 0)
 			data->callback(SUCCEED, data->id, &data->max_distance);
 		else data->callback(FAILED, data->id, NULL);
 
-		store_requests.erase(data);
+		store_requests.Remove(data->id);
 
 		delete data;
 	}
 
-	void CKadNode::OnStoreResponse(const StoreResponse &resp) {
-		StoreRequestData temp, *data;
-		temp.id = resp.id;
-		StoreRequests::iterator it = store_requests.find(&temp);
-		if (it == store_requests.end())
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::OnStoreResponse(const StoreResponse &resp) {
+		StoreRequestData *data = store_requests.Get(resp.id);
+		if (!data)
 			return;
-		data = *it;
-
-		std::set<StoreRequestData::StoreNode *>::iterator sit;
-		for (sit = data->store_nodes.begin(); sit != data->store_nodes.end(); ++sit) {
-			StoreRequestData::StoreNode *node = *sit;
-			if (node->id == resp.responder_id) {
-				scheduler->CancelJobsByOwner(node);
-				data->store_nodes.erase(sit);
-				data->succeded++;
-				delete node;
-				break;
-			}
-		}
-		if (!data->store_nodes.size())
+		uint16 dest = StoreRequests::GetDest(resp.id);
+		if (dest >= data->store_nodes.size())
+			return;
+		typename StoreRequestData::StoreNode *node = &data->store_nodes[dest];
+		if (!node->pending || !(node->id == resp.responder_id))
+			return;
+		UpdateRtt(node->id, node->sent_time, node->attempts);
+		scheduler->CancelJobsByOwner(node);
+		node->pending = false;
+		data->succeded++;
+		if (!--data->pending_nodes)
 			FinishStore(data);
 	}
 
-	void CKadNode::SaveBootstrapContacts(std::vector<NodeAddress> &out) const {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::SaveBootstrapContacts(std::vector<NodeAddress> &out) const {
 		routing_table.SaveBootstrapContacts(out);
 	}
 
-	void CKadNode::JoinNetwork(const std::vector<NodeAddress> &bootstrap_contacts, const join_callback &callback) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::JoinNetwork(const std::vector<NodeAddress> &bootstrap_contacts, const join_callback &callback) {
 		std::copy(bootstrap_contacts.begin(), bootstrap_contacts.end(), std::back_inserter(join_bootstrap_contacts));
 		join_callback_ = callback;
 		for ( ;join_pinging_nodesN < alpha && join_bootstrap_contacts.size(); ++join_pinging_nodesN) {
 			Ping(bootstrap_contacts[join_bootstrap_contacts.size()-1], 
-				boost::bind(&CKadNode::Join_PingCallback, this, boost::lambda::_1, boost::lambda::_2));
+				boost::bind(&CKadNodeT::Join_PingCallback, this, boost::lambda::_1, boost::lambda::_2));
 			join_bootstrap_contacts.pop_back();
 		}
 	}
 
-	void CKadNode::Join_PingCallback(ErrorCode code, rpc_id id) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::Join_PingCallback(ErrorCode code, rpc_id id) {
 		--join_pinging_nodesN;
 		if (code == SUCCEED)
 			++join_succeedN;
@@ -631,27 +877,31 @@ namespace dhtpp {
 			}
 			join_state = FIND_NODES_STARTED;
 			FindCloseNodes(my_info.GetId(), 
-				boost::bind(&CKadNode::Join_FindNodeCallback, this, 
+				boost::bind(&CKadNodeT::Join_FindNodeCallback, this, 
 				join_bootstrap_contacts.size() > 0, boost::lambda::_1, boost::lambda::_2));
 		}
 
 		for ( ;join_pinging_nodesN < alpha && join_bootstrap_contacts.size(); ++join_pinging_nodesN) {
 			Ping(join_bootstrap_contacts[join_bootstrap_contacts.size()-1], 
-				boost::bind(&CKadNode::Join_PingCallback, this, boost::lambda::_1, boost::lambda::_2));
+				boost::bind(&CKadNodeT::Join_PingCallback, this, boost::lambda::_1, boost::lambda::_2));
 			join_bootstrap_contacts.pop_back();
 		}
 	}
 
-	void CKadNode::Join_FindNodeCallback(bool try_again, ErrorCode code, const FindNodeResponse *resp) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::Join_FindNodeCallback(bool try_again, ErrorCode code, const FindNodeResponse *resp) {
 		if (code == SUCCEED) {
+			// The closest nodes to us have all answered the lookup
+			UpdateRoutingTable(resp->nodes.data(), (uint16) resp->nodes.size());
 			join_state = JOINED;
 			join_callback_(SUCCEED);
 		} else {
 			join_state = NOT_JOINED;
-			if (try_again) {
+			// An overloaded node would fail the new lookup right away
+			if (try_again && code != OVERLOADED) {
 				join_state = FIND_NODES_STARTED;
 				FindCloseNodes(my_info.GetId(), 
-					boost::bind(&CKadNode::Join_FindNodeCallback, this, 
+					boost::bind(&CKadNodeT::Join_FindNodeCallback, this, 
 					join_bootstrap_contacts.size() > 0, boost::lambda::_1, boost::lambda::_2));
 			} else {
 				join_callback_(FAILED);
@@ -659,140 +909,211 @@ namespace dhtpp {
 		}
 	}
 
-	void CKadNode::DoDownlistRequests(DownlistRequestData *data) {
+	template <uint16 Bits>
+	bool CKadNodeT<Bits>::SaveRoutingTable(const std::string &filename) const {
+		return routing_table.SaveSnapshot(filename);
+	}
+
+	template <uint16 Bits>
+	bool CKadNodeT<Bits>::RestoreRoutingTable(const std::string &filename, const join_callback &callback) {
+		assert(join_state == NOT_JOINED);
+		if (!routing_table.LoadSnapshot(filename, revalidate_contacts))
+			return false;
+		if (!revalidate_contacts.size())
+			return false;
+
+		join_state = JOINED;
+		join_callback_ = callback;
+		scheduler->AddJob_(0, boost::bind(&CKadNodeT::Join_Restored, this), this);
+		return true;
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::Join_Restored() {
+		join_callback_(SUCCEED);
+		RevalidateContacts();
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::RevalidateContacts() {
+		for (int i = 0; i < alpha && revalidate_contacts.size(); ++i) {
+			const NodeInfo &contact = revalidate_contacts.back();
+			Ping(contact, boost::bind(&CKadNodeT::Revalidate_PingCallback, this, contact.id,
+				boost::lambda::_1, boost::lambda::_2));
+			revalidate_contacts.pop_back();
+		}
+		if (revalidate_contacts.size())
+			scheduler->AddJob_(snapshot_revalidate_interval, boost::bind(&CKadNodeT::RevalidateContacts, this), this);
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::Revalidate_PingCallback(NodeID id, ErrorCode code, rpc_id) {
+		// The response itself refreshes the contact
+		if (code == FAILED)
+			RemoveFromRoutingTable(id);
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::DoDownlistRequests(DownlistRequestData *data) {
 		// Remove down nodes from our routing table
-		for (std::vector<NodeID>::size_type i = 0; i < data->down_nodes.size(); ++i) {
-			bool is_close_to_holder;
-			if (routing_table.RemoveContact(data->down_nodes[i], is_close_to_holder)) {
-				store->OnRemoveContact(data->down_nodes[i], is_close_to_holder);
-			}
+		for (typename std::vector<NodeID>::size_type i = 0; i < data->down_nodes.size(); ++i) {
+			RemoveFromRoutingTable(data->down_nodes[i]);
 		}
 		if (!data->down_nodes.size() || !data->req_nodes.size()) {
-			FinishDownlistRequests(data);
+			delete data;
 			return;
 		}
-		std::set<DownlistRequestData::RequestedNode *>::iterator it = data->req_nodes.begin();
 		DownlistRequest req;
 		std::copy(data->down_nodes.begin(), data->down_nodes.end(), std::back_inserter(req.down_nodes));
-		data->id = downlist_id_counter++;
-		downlist_requests.insert(data);
-		for (; it != data->req_nodes.end(); ++it) {
-			DownlistRequestData::RequestedNode *node = *it;
-			req.Init(my_info, *node, my_info.GetId(), data->id);
+		data->id = downlist_requests.Add(data);
+		// Nobody waits for the downlist, it is dropped
+		if (data->id == DownlistRequests::invalid_id) {
+			delete data;
+			return;
+		}
+		data->pending_nodes = (uint16) data->req_nodes.size();
+		for (uint16 i = 0; i < data->req_nodes.size(); ++i) {
+			typename DownlistRequestData::RequestedNode *node = &data->req_nodes[i];
+			req.Init(my_info, *node, my_info.GetId(), DownlistRequests::WithDest(data->id, i));
 			transport->SendDownlistRequest(req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::DownlistRequestTimeout, this, data, node), node);
+			node->sent_time = GetTimerInstance()->GetCurrentTime();
+			scheduler->AddJob_(GetRpcTimeout(node->id, node->attempts), boost::bind(&CKadNodeT::DownlistRequestTimeout, this, data, node), node);
 		}
 	}
 
-	void CKadNode::DoRemoveContact(NodeID node_id, ErrorCode code, rpc_id id) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::DoRemoveContact(NodeID node_id, ErrorCode code, rpc_id id) {
 		if (code == FAILED) {
 			// Node is not responding on pings
-			bool is_close_to_holder;
-			if (routing_table.RemoveContact(node_id, is_close_to_holder)) {
-				store->OnRemoveContact(node_id, is_close_to_holder);
-			}
+			RemoveFromRoutingTable(node_id);
 		}
 	}
 
-	void CKadNode::DownlistRequestTimeout(DownlistRequestData *data, DownlistRequestData::RequestedNode *node) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::RemoveFromRoutingTable(const NodeID &node_id) {
+		bool is_close_to_holder, is_promoted, promoted_close_to_holder;
+		NodeInfo promoted;
+		if (routing_table.RemoveContact(node_id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder)) {
+			store->OnRemoveContact(node_id, is_close_to_holder);
+			if (is_promoted)
+				store->OnNewContact(promoted, promoted_close_to_holder);
+		}
+	}
+
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::DownlistRequestTimeout(DownlistRequestData *data, typename DownlistRequestData::RequestedNode *node) {
 		if (node->attempts++ < attempts_number) {
 			DownlistRequest req;
 			std::copy(data->down_nodes.begin(), data->down_nodes.end(), std::back_inserter(req.down_nodes));
-			req.Init(my_info, *node, my_info.GetId(), data->id);
+			req.Init(my_info, *node, my_info.GetId(), DownlistRequests::WithDest(data->id, node - &data->req_nodes[0]));
 			transport->SendDownlistRequest(req);
-			scheduler->AddJob_(timeout_period, boost::bind(&CKadNode::DownlistRequestTimeout, this, data, node), node);
+			node->sent_time = GetTimerInstance()->GetCurrentTime();
+			scheduler->AddJob_(GetRpcTimeout(node->id, node->attempts), boost::bind(&CKadNodeT::DownlistRequestTimeout, this, data, node), node);
 		} else {
-			data->req_nodes.erase(node);
-			delete node;
-			if (!data->req_nodes.size())
+			node->pending = false;
+			if (!--data->pending_nodes)
 				FinishDownlistRequests(data);
 		}
 	}
 
-	void CKadNode::FinishDownlistRequests(DownlistRequestData *data) {
-		downlist_requests.erase(data);
-		std::set<DownlistRequestData::RequestedNode *>::iterator it = data->req_nodes.begin();
-		for (; it != data->req_nodes.end();) {
-			DownlistRequestData::RequestedNode *node = *it;
-			scheduler->CancelJobsByOwner(node);
-			delete node;
-			it = data->req_nodes.erase(it);
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::FinishDownlistRequests(DownlistRequestData *data) {
+		downlist_requests.Remove(data->id);
+		for (std::size_t i = 0; i < data->req_nodes.size(); ++i) {
+			if (data->req_nodes[i].pending)
+				scheduler->CancelJobsByOwner(&data->req_nodes[i]);
 		}
 		delete data;
 	}
 
-	void CKadNode::Terminate() {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::Terminate() {
+		// the restore and revalidation jobs are owned by the node itself
+		scheduler->CancelJobsByOwner(this);
+		revalidate_contacts.clear();
 		TerminatePingRequests();
 		TerminateFindRequests();
 		TerminateStoreRequests();
 		TerminateDownlistRequests();
 	}
 
-	void CKadNode::TerminatePingRequests() {
-		PingRequests::iterator it;
-		for (it = ping_requests.begin(); it != ping_requests.end(); ) {
-			PingRequestData *data = *it;
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::TerminatePingRequests() {
+		for (uint32 slot = 0; slot < ping_requests.SlotsNumber(); ++slot) {
+			PingRequestData *data = ping_requests.GetBySlot(slot);
+			if (!data)
+				continue;
 			scheduler->CancelJobsByOwner(data);
-			data->callback(TERMINATED, data->GetId());
-			it = ping_requests.erase(it);
+			ping_requests.Remove(data->req.id);
+			data->callback(TERMINATED, data->req.id);
 			delete data;
 		}
 	}
 
-	void CKadNode::TerminateFindRequests() {
-		FindRequests::iterator it;
-		for (it = find_requests.begin(); it != find_requests.end(); ) {
-			FindRequestData *data = *it;
-			FindRequestData::Candidates::iterator cit;
-			for (cit = data->candidates.begin(); cit != data->candidates.end();) {
-				FindRequestData::Candidate *cand = &*cit;
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::TerminateFindRequests() {
+		for (uint32 slot = 0; slot < find_requests.SlotsNumber(); ++slot) {
+			FindRequestData *data = find_requests.GetBySlot(slot);
+			if (!data)
+				continue;
+			typename FindRequestData::Candidates::iterator cit;
+			for (cit = data->candidates.begin(); cit != data->candidates.end(); ++cit) {
+				typename FindRequestData::Candidate *cand = &*cit;
 				if (cand->type == FindRequestData::Candidate::PENDING) {
 					scheduler->CancelJobsByOwner(cand);
 				}
-				cit = data->candidates.erase(cit);
-				delete cand;
 			}
-			it = find_requests.erase(it);
+			find_requests.Remove(data->id);
+			shortlist_pruned_count += data->pruned;
 			if (data->type == FindRequestData::FIND_NODE) {
-				data->find_node_callback_(TERMINATED, NULL);
+				for (std::size_t i = 0; i < data->find_node_callbacks.size(); ++i) {
+					data->find_node_callbacks[i](TERMINATED, NULL);
+				}
 			} else {
-				data->find_value_callback_(TERMINATED, NULL);
+				for (std::size_t i = 0; i < data->find_value_callbacks.size(); ++i) {
+					data->find_value_callbacks[i](TERMINATED, NULL);
+				}
 			}
 			delete data;
 		}
 	}
 
-	void CKadNode::TerminateStoreRequests() {
-		StoreRequests::iterator it;
-		for (it = store_requests.begin(); it != store_requests.end(); ) {
-			StoreRequestData *data = *it;
-			std::set<StoreRequestData::StoreNode *>::iterator sit;
-			for (sit = data->store_nodes.begin(); sit != data->store_nodes.end(); ) {
-				StoreRequestData::StoreNode *node = *sit;
-				scheduler->CancelJobsByOwner(node);
-				sit = data->store_nodes.erase(sit);
-				delete node;
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::TerminateStoreRequests() {
+		for (uint32 slot = 0; slot < store_requests.SlotsNumber(); ++slot) {
+			StoreRequestData *data = store_requests.GetBySlot(slot);
+			if (!data)
+				continue;
+			for (std::size_t i = 0; i < data->store_nodes.size(); ++i) {
+				if (data->store_nodes[i].pending)
+					scheduler->CancelJobsByOwner(&data->store_nodes[i]);
 			}
-			it = store_requests.erase(it);
+			store_requests.Remove(data->id);
 			data->callback(TERMINATED, data->id, NULL);
 			delete data;
 		}
 	}
 
-	void CKadNode::TerminateDownlistRequests() {
-		while (downlist_requests.size()) {
-			FinishDownlistRequests(*downlist_requests.begin());
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::TerminateDownlistRequests() {
+		for (uint32 slot = 0; slot < downlist_requests.SlotsNumber(); ++slot) {
+			DownlistRequestData *data = downlist_requests.GetBySlot(slot);
+			if (data)
+				FinishDownlistRequests(data);
 		}
 	}
 
-	void CKadNode::StoreToFirstNodeCallback(ErrorCode code, rpc_id id, const NodeID *max_distance) {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::StoreToFirstNodeCallback(ErrorCode code, rpc_id id, const NodeID *max_distance) {
 		if (code == SUCCEED) {
 			++store_to_first_node_count;
 		}
 	}
 
-	void CKadNode::SaveStoreTo(std::ofstream &f) const {
+	template <uint16 Bits>
+	void CKadNodeT<Bits>::SaveStoreTo(std::ofstream &f) const {
 		store->SaveStoreTo(f);
 	}
 
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CKadNodeT)
 }
@@ -1,25 +1,38 @@
 #ifndef DHT_KAD_NODE_H
 #define DHT_KAD_NODE_H
 
+#include "arena.h"
 #include "transport.h"
 #include "routing_table.h"
+#include "slot_table.h"
+#include "small_function.h"
 #include "types.h"
 #include "job_scheduler.h"
 
-#include <set>
+#include <algorithm>
 #include <map>
 #include <vector>
 
-#include <boost/function.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/container/static_vector.hpp>
 #include <boost/intrusive/set.hpp>
+#include <boost/static_assert.hpp>
 
 namespace dhtpp {
 
-	class CStore;
-	class CKadNode : public INode {
+	template <uint16 Bits> class CStoreT;
+
+	template <uint16 Bits>
+	class CKadNodeT : public INodeT<Bits> {
 	public:
-		CKadNode(const NodeInfo &info, CJobScheduler *sched, ITransport *transport);
-		~CKadNode();
+		DECLARE_NODE_ID_TYPES(Bits)
+		DECLARE_RPC_TYPES(Bits)
+		typedef ITransportT<Bits> ITransport;
+		typedef CRoutingTableT<Bits> CRoutingTable;
+		typedef CStoreT<Bits> CStore;
+
+		CKadNodeT(const NodeInfo &info, CJobScheduler *sched, ITransport *transport);
+		~CKadNodeT();
 
 		const NodeInfo &GetNodeInfo() const {
 			return my_info;
@@ -44,18 +57,22 @@ namespace dhtpp {
 			SUCCEED,
 			FAILED,
 			TERMINATED,
+			// Not sent, too many requests of its kind are in flight
+			OVERLOADED,
 		};
 
-		typedef boost::function<void (ErrorCode code, rpc_id id)> ping_callback;
-		typedef boost::function<void (ErrorCode code, rpc_id id, const NodeID *max_distance)> store_callback;
-		typedef boost::function<void (ErrorCode code, const FindNodeResponse *resp)> find_node_callback;
-		typedef boost::function<void (ErrorCode code, const FindValueResponse *resp)> find_value_callback;
+		typedef CSmallFunction<void (ErrorCode code, rpc_id id)> ping_callback;
+		typedef CSmallFunction<void (ErrorCode code, rpc_id id, const NodeID *max_distance)> store_callback;
+		typedef CSmallFunction<void (ErrorCode code, const FindNodeResponse *resp)> find_node_callback;
+		typedef CSmallFunction<void (ErrorCode code, const FindValueResponse *resp)> find_value_callback;
 
-		typedef boost::function<void (ErrorCode code)> join_callback;
+		typedef CSmallFunction<void (ErrorCode code)> join_callback;
 
 		void GetLocalCloseNodes(const NodeID &id, std::vector<NodeInfo> &out);
 
 		rpc_id Ping(const NodeAddress &to, const ping_callback &callback);
+		// The timeout follows the round trip time of the node
+		rpc_id Ping(const NodeInfo &to, const ping_callback &callback);
 		rpc_id Store(const NodeID &key, const std::string &value, uint64 time_to_live, const store_callback &callback);
 		rpc_id StoreToNode(const NodeInfo &to_node, const NodeID &key, const std::string &value, uint64 time_to_live, const store_callback &callback);
 		rpc_id FindCloseNodes(const NodeID &id, const find_node_callback &callback);
@@ -63,6 +80,13 @@ namespace dhtpp {
 
 		void JoinNetwork(const std::vector<NodeAddress> &bootstrap_contacts, const join_callback &callback);
 
+		// Warm restart from the routing table saved by SaveRoutingTable.
+		// The node is joined at once and pings the restored contacts in
+		// the background, the dead ones are removed. False if the snapshot
+		// can not be loaded, JoinNetwork is needed then.
+		bool SaveRoutingTable(const std::string &filename) const;
+		bool RestoreRoutingTable(const std::string &filename, const join_callback &callback);
+
 		const std::map<int, int> &GetFindNodeStats() const {
 			return find_node_reqs_count;
 		}
@@ -71,6 +95,14 @@ namespace dhtpp {
 			return find_value_reqs_count;
 		}
 
+		const std::map<int, int> &GetFindParallelismStats() const {
+			return find_parallelism_count;
+		}
+
+		const std::map<int, int> &GetRpcTimeoutStats() const {
+			return rpc_timeout_count;
+		}
+
 		bool IdInHolderRange(const NodeID &id) const {
 			return routing_table.IdInHolderRange(id);
 		}
@@ -83,6 +115,20 @@ namespace dhtpp {
 			return store_to_first_node_count;
 		}
 
+		// Candidates dropped by the lookups to keep their shortlists bounded
+		uint64 GetShortlistPrunedCount() const {
+			return shortlist_pruned_count;
+		}
+
+		uint64 GetFindRequestsCount() const {
+			return find_requests_count;
+		}
+
+		// Find requests sent because an earlier one was slow, see HEDGED_LOOKUPS
+		uint64 GetHedgedFindRequestsCount() const {
+			return hedged_find_requests_count;
+		}
+
 		void SaveStoreTo(std::ofstream &f) const;
 
 	protected:
@@ -95,24 +141,28 @@ namespace dhtpp {
 		struct PingRequestData {
 			PingRequestData() {
 				attempts = 0;
+				to_id_known = false;
 			}
 			PingRequest req;
 			ping_callback callback;
 			uint16 attempts;
-			rpc_id GetId() const {
-				return req.id;
-			}
+			// Known if the node is pinged by its NodeInfo
+			NodeID to_id;
+			bool to_id_known;
+			uint64 sent_time;
 		};
 
 		struct FindRequestData {
 			FindRequestData() {
 				pending_nodes = 0;
 				requests_total = 0;
+				pruned = 0;
+				finished = false;
+				parallelism = max_parallelism = alpha;
+				hedged_nodes = 0;
+				hedge_deadline = 0;
 			}
 			rpc_id id;
-			rpc_id GetId() const {
-				return id;
-			}
 
 			NodeID target;
 
@@ -121,8 +171,12 @@ namespace dhtpp {
 				FIND_VALUE,
 			} type;
 
-			find_node_callback find_node_callback_;
-			find_value_callback find_value_callback_;
+			// The lookups started for the same target and type while this
+			// one runs add their callbacks here, all get the same result
+			boost::container::small_vector<find_node_callback, 1> find_node_callbacks;
+			boost::container::small_vector<find_value_callback, 1> find_value_callbacks;
+			// Set once the result is out, no callback is added after it
+			bool finished;
 
 			struct CandidateLite {
 				NodeID distance;
@@ -131,15 +185,19 @@ namespace dhtpp {
 				}
 			};
 
+			// The hooks are not reset on destruction: the candidates die
+			// with their arena and the set is never walked again
 			struct Candidate : 
 				public CandidateLite,
 				public NodeInfo,
-				public boost::intrusive::set_base_hook<> 
+				public boost::intrusive::set_base_hook<boost::intrusive::link_mode<boost::intrusive::normal_link> > 
 			{
 				Candidate(const NodeInfo &info, const NodeID &target) {
 					*(NodeInfo *)this = info;
-					distance = id ^ target;
+					this->distance = info.id ^ target;
 					attempts = 0;
+					sent_time = 0;
+					hedged = false;
 					type = UNKNOWN;
 				}
 
@@ -151,17 +209,57 @@ namespace dhtpp {
 				} type;
 
 				uint16 attempts;
+				// When the last request was sent
+				uint64 sent_time;
+				// Pending past the hedge deadline, its slot is given away
+				bool hedged;
 
 				using CandidateLite::operator <;
 			};
 
+			// Storage of the candidates, released with the search
+			CArena<Candidate, 4*K> candidates_arena;
+
 			typedef boost::intrusive::set<Candidate> Candidates;
 			Candidates candidates;
 			int pending_nodes;
 			int requests_total;
+			// Candidates discarded or evicted to stay within shortlist_size
+			uint32 pruned;
+			// Requests kept in flight, alpha unless ADAPTIVE_ALPHA
+			uint16 parallelism;
+			uint16 max_parallelism;
+			// The hedged candidates are pending but take no slot
+			int hedged_nodes;
+			// Reply time after which a request is hedged, 0 for never
+			uint64 hedge_deadline;
+
+			bool CanSend() const {
+				return pending_nodes - hedged_nodes < parallelism;
+			}
+
+			// A timeout or a slow reply
+			void Widen() {
+				if (parallelism < max_alpha)
+					++parallelism;
+				if (parallelism > max_parallelism)
+					max_parallelism = parallelism;
+			}
+
+			// A fast reply
+			void Narrow() {
+				if (parallelism > alpha)
+					--parallelism;
+			}
 
 			Candidate *GetCandidate(const NodeID &id);
-			void Update(const std::vector<NodeInfo> &nodes);
+			// Returns NULL if the node is a candidate already or is pruned.
+			// A full shortlist takes only nodes closer than its farthest
+			// candidate not asked yet, which is evicted for them. The asked
+			// ones (pending, up or down) stay: an evicted one would come back
+			// from the next responses and be asked again.
+			Candidate *AddCandidate(const NodeInfo &info);
+			void Update(const typename FindNodeResponse::Nodes &nodes);
 		};
 
 		struct StoreRequestData {
@@ -176,76 +274,102 @@ namespace dhtpp {
 
 			StoreRequestData() {
 				succeded = 0;
-			}
-
-			rpc_id GetId() const {
-				return id;
+				pending_nodes = 0;
 			}
 
 			struct StoreNode : public NodeInfo {
 				StoreNode() {
 					attempts = 0;
+					pending = true;
 				}
 				uint16 attempts;
+				uint64 sent_time;
+				bool pending;
 			};
 
-			std::set<StoreNode *> store_nodes;
+			// Indexed by the destination of the rpc_id the node is sent
+			boost::container::static_vector<StoreNode, K> store_nodes;
+			uint16 pending_nodes;
 		};
 
 		struct DownlistRequestData {
+			DownlistRequestData() {
+				pending_nodes = 0;
+			}
+
 			std::vector<NodeID> down_nodes;
 			rpc_id id;
-			rpc_id GetId() const {
-				return id;
-			}
 			struct RequestedNode : public NodeInfo {
 				RequestedNode() {
 					attempts = 0;
+					pending = true;
 				}
 				uint16 attempts;
+				uint64 sent_time;
+				bool pending;
 			};
 
-			std::set<RequestedNode *> req_nodes;
-		};
-
-		template <typename ReqType>
-		struct Comp {
-			bool operator()(const ReqType *d1, const ReqType *d2) const {
-				return d1->GetId() < d2->GetId();
-			}
+			// Indexed by the destination of the rpc_id the node is sent,
+			// filled before the requests are sent and not resized after
+			std::vector<RequestedNode> req_nodes;
+			uint16 pending_nodes;
 		};
 
-		typedef std::set<PingRequestData *, Comp<PingRequestData> > PingRequests;
-		typedef std::set<FindRequestData *, Comp<FindRequestData> > FindRequests;
-		typedef std::set<StoreRequestData *, Comp<StoreRequestData> > StoreRequests;
-		typedef std::set<DownlistRequestData *, Comp<DownlistRequestData> > DownlistRequests;
+		// A node replicates its items to every new close contact, so the
+		// stores in flight run into the thousands. A downlist request goes
+		// to all the nodes that answered a lookup, more than K of them.
+		typedef CSlotTable<PingRequestData, 16, 0> PingRequests;
+		typedef CSlotTable<FindRequestData, 12, 0> FindRequests;
+		typedef CSlotTable<StoreRequestData, 18, 4> StoreRequests;
+		typedef CSlotTable<DownlistRequestData, 12, 6> DownlistRequests;
+		BOOST_STATIC_ASSERT(K <= StoreRequests::max_dests);
 
 		PingRequests ping_requests;
 		FindRequests find_requests;
 		StoreRequests store_requests;
 		DownlistRequests downlist_requests;
-
-		rpc_id ping_id_counter, store_id_counter, find_id_counter, downlist_id_counter;
+		// The ids of the values found in the own store
+		uint32 local_find_id_counter;
 
 		void UpdateRoutingTable(const RPCRequest &req);
 		void UpdateRoutingTable(const RPCResponse &resp);
-		void UpdateRoutingTable(NodeInfo *contact);
-		void DoAddContact(NodeInfo *new_contact, Contact *last_seen_contact, ErrorCode code, rpc_id id);
+		void UpdateRoutingTable(const NodeInfo &contact);
+		// Verified contacts in bulk. The full buckets keep them as replacements,
+		// without pinging their least recently seen contacts.
+		void UpdateRoutingTable(const NodeInfo *contacts, uint16 count);
+		void DoAddContact(uint16 eviction, ErrorCode code, rpc_id id);
+		void SendPingRequest(PingRequestData *data);
 		void PingRequestTimeout(rpc_id id);
 
-		FindRequestData *CreateFindData(const NodeID &id, FindRequestData::FindType);
-		void FindRequestTimeout(FindRequestData *data, FindRequestData::Candidate *cand);
+		// Timeout of the attempts-th retry of an RPC to the node
+		uint64 GetRpcTimeout(const NodeID &id, uint16 attempts);
+		uint64 GetRpcTimeout(const RttEstimate &rtt, uint16 attempts);
+		// Feeds the reply time to the round trip time estimate of the node.
+		// The retried requests are skipped (Karn's algorithm): the reply may
+		// be to any of the attempts.
+		void UpdateRtt(const NodeID &id, uint64 sent_time, uint16 attempts);
+
+		FindRequestData *CreateFindData(const NodeID &id, typename FindRequestData::FindType);
+		// The lookup in flight the new one can join, NULL if none
+		FindRequestData *GetRunningFindData(const NodeID &id, typename FindRequestData::FindType type);
+		void FindRequestTimeout(FindRequestData *data, typename FindRequestData::Candidate *cand);
+		void FindRequestHedge(FindRequestData *data, typename FindRequestData::Candidate *cand);
+		// The candidate is not pending any more
+		void FindRequestDone(FindRequestData *data, typename FindRequestData::Candidate *cand);
 
 		// return true if there is pending nodes
 		bool SendFindRequestToOneNode(FindRequestData *data);
 
-		void SendFindRequestToOneNode(FindRequestData *data, FindRequestData::Candidate *cand);
+		void SendFindRequestToOneNode(FindRequestData *data, typename FindRequestData::Candidate *cand);
+		// Adapts the parallelism of the lookup to the reply time of the candidate
+		void UpdateParallelism(FindRequestData *data, const typename FindRequestData::Candidate *cand);
 		void CallFindNodeCallback(FindRequestData *data);
+		void CallFindValueCallback(FindRequestData *data, ErrorCode code, const FindValueResponse *resp);
 		void FinishSearch(FindRequestData *data);
 		FindRequestData *GetFindData(rpc_id id);
 
 		void DoStore(StoreRequestData *data, bool single, ErrorCode code, const FindNodeResponse *resp);
-		void StoreRequestTimeout(StoreRequestData *data, StoreRequestData::StoreNode *node);
+		void StoreRequestTimeout(StoreRequestData *data, typename StoreRequestData::StoreNode *node);
 		void FinishStore(StoreRequestData *data);
 
 		// Bootstrap
@@ -254,6 +378,12 @@ namespace dhtpp {
 		int join_pinging_nodesN, join_succeedN;
 		void Join_PingCallback(ErrorCode code, rpc_id id);
 		void Join_FindNodeCallback(bool try_again, ErrorCode code, const FindNodeResponse *resp);
+		void Join_Restored();
+
+		// Restored contacts not pinged yet
+		std::vector<NodeInfo> revalidate_contacts;
+		void RevalidateContacts();
+		void Revalidate_PingCallback(NodeID id, ErrorCode code, rpc_id);
 		enum {
 			NOT_JOINED,
 			FIND_NODES_STARTED,
@@ -263,16 +393,84 @@ namespace dhtpp {
 		// Downlist optimization
 		void DoDownlistRequests(DownlistRequestData *data);
 		void DoRemoveContact(NodeID node_id, ErrorCode code, rpc_id id);
-		void DownlistRequestTimeout(DownlistRequestData *data, DownlistRequestData::RequestedNode *node);
+		// Removes the contact and reports the replacement taking its place
+		void RemoveFromRoutingTable(const NodeID &node_id);
+		void DownlistRequestTimeout(DownlistRequestData *data, typename DownlistRequestData::RequestedNode *node);
 		void FinishDownlistRequests(DownlistRequestData *data);
 
 		// histogram of the number of requests in find procedures
 		std::map<int, int> find_node_reqs_count, find_value_reqs_count;
-
-		// Contacts we are pinging
-		std::set<NodeID> last_seen_contacts;
+		// histogram of the highest parallelism of find procedures
+		std::map<int, int> find_parallelism_count;
+		// histogram of the RPC timeouts
+		std::map<int, int> rpc_timeout_count;
+
+		// A new contact for a full bucket waits for the ping of the least
+		// recently seen contact of the bucket. One contact per bucket is
+		// pinged at a time, a new contact finding no free entry is dropped.
+		struct PendingEviction {
+			NodeInfo new_contact;
+			NodeID last_seen_id;
+			bool in_use;
+		};
+		PendingEviction pending_evictions[max_pending_evictions];
+		// The entry of the contact pinged, max_pending_evictions if there is none
+		uint16 FindPendingEviction(const NodeID &last_seen_id) const;
 
 		uint64 store_to_first_node_count;
+		uint64 shortlist_pruned_count;
+		uint64 find_requests_count, hedged_find_requests_count;
+
+		// Reply times of the first attempts of the find requests,
+		// the hedge deadlines are their percentile
+		struct ReplyTimes {
+			enum {
+				step = 10, // ms
+				buckets = max_rpc_timeout / step + 1
+			};
+
+			uint32 count[buckets];
+			uint32 total;
+			// hedge_min_samples replies were taken. The halving rounds
+			// down and can leave fewer of them, the percentile is still
+			// taken from those.
+			bool sampled;
+
+			ReplyTimes() {
+				std::fill(count, count + buckets, 0);
+				total = 0;
+				sampled = false;
+			}
+
+			void Add(uint64 t) {
+				uint32 i = (uint32) std::min<uint64>(t / step, buckets - 1);
+				++count[i];
+				if (++total >= hedge_min_samples)
+					sampled = true;
+				if (total < 2*hedge_min_samples)
+					return;
+				// Halve the counts, so the old replies fade out
+				total = 0;
+				for (i = 0; i < buckets; ++i) {
+					count[i] /= 2;
+					total += count[i];
+				}
+			}
+
+			// 0 if there are too few replies
+			uint64 GetPercentile(uint16 p) const {
+				if (!sampled || !total)
+					return 0;
+				uint64 sum = 0;
+				for (uint32 i = 0; i < buckets; ++i) {
+					sum += count[i];
+					if (sum * 100 >= (uint64) p * total)
+						return (i + 1) * step;
+				}
+				return buckets * step;
+			}
+		};
+		ReplyTimes find_reply_times;
 		void StoreToFirstNodeCallback(ErrorCode code, rpc_id id, const NodeID *max_distance);
 
 		void TerminatePingRequests();
@@ -280,6 +478,8 @@ namespace dhtpp {
 		void TerminateStoreRequests();
 		void TerminateDownlistRequests();
 	};
+
+	typedef CKadNodeT<NODE_ID_LENGTH_BITS> CKadNode;
 }
 
 #endif // DHT_KAD_NODE_H
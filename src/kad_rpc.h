@@ -4,6 +4,8 @@
 #include "contact.h"
 #include "types.h"
 
+#include <boost/container/static_vector.hpp>
+
 #include <vector>
 #include <string>
 
@@ -20,63 +22,63 @@ namespace dhtpp {
 		}
 	};
 
-	struct RPCRequest : public RPCMessage {
-		NodeID sender_id;
-		void Init(const NodeAddress &from_, const NodeAddress &to_, const NodeID &sender_id_, rpc_id id_) {
+	template <uint16 Bits>
+	struct RPCRequestT : public RPCMessage {
+		NodeIDT<Bits> sender_id;
+		void Init(const NodeAddress &from_, const NodeAddress &to_, const NodeIDT<Bits> &sender_id_, rpc_id id_) {
 			from = from_;
 			to = to_;
 			sender_id = sender_id_;
 			id = id_;
 		}
 
-		RPCRequest(){}
-		RPCRequest(const RPCRequest &o) {
+		RPCRequestT(){}
+		RPCRequestT(const RPCRequestT &o) {
 			*this = o;
 		}
 
-		RPCRequest &operator = (const RPCRequest &o) {
+		RPCRequestT &operator = (const RPCRequestT &o) {
 			*(RPCMessage *)this = o;
 			sender_id = o.sender_id;
 			return *this;
 		}
 	};
 
-	struct RPCResponse : public RPCMessage {
-		NodeID responder_id;
-		void Init(const NodeAddress &from_, const NodeAddress &to_, const NodeID &responder_id_, rpc_id rpc_id_) {
+	template <uint16 Bits>
+	struct RPCResponseT : public RPCMessage {
+		NodeIDT<Bits> responder_id;
+		void Init(const NodeAddress &from_, const NodeAddress &to_, const NodeIDT<Bits> &responder_id_, rpc_id rpc_id_) {
 			from = from_;
 			to = to_;
 			responder_id = responder_id_;
 			id = rpc_id_;
 		}
 
-		RPCResponse(){}
-		RPCResponse(const RPCResponse &o) {
+		RPCResponseT(){}
+		RPCResponseT(const RPCResponseT &o) {
 			*this = o;
 		}
 
-		RPCResponse &operator = (const RPCResponse &o) {
+		RPCResponseT &operator = (const RPCResponseT &o) {
 			*(RPCMessage *)this = o;
 			responder_id = o.responder_id;
 			return *this;
 		}
 	};
 
-	typedef RPCRequest PingRequest;
-	typedef RPCResponse PingResponse;
-
-	struct StoreRequest : public RPCRequest {
+	template <uint16 Bits>
+	struct StoreRequestT : public RPCRequestT<Bits> {
 		uint64 time_to_live;
-		NodeID key;
+		NodeIDT<Bits> key;
 		std::string value;
 
-		StoreRequest(){}
-		StoreRequest(const StoreRequest &o) {
+		StoreRequestT(){}
+		StoreRequestT(const StoreRequestT &o) {
 			*this = o;
 		}
 
-		StoreRequest &operator = (const StoreRequest &o) {
-			*(RPCRequest *)this = o;
+		StoreRequestT &operator = (const StoreRequestT &o) {
+			*(RPCRequestT<Bits> *)this = o;
 			key = o.key;
 			value = o.value;
 			time_to_live = o.time_to_live;
@@ -84,85 +86,106 @@ namespace dhtpp {
 		}
 	};
 
-	typedef RPCResponse StoreResponse;
+	template <uint16 Bits>
+	struct FindNodeRequestT : public RPCRequestT<Bits> {
+		NodeIDT<Bits> target;
 
-	struct FindNodeRequest : public RPCRequest {
-		NodeID target;
-
-		FindNodeRequest(){}
-		FindNodeRequest(const FindNodeRequest &o) {
+		FindNodeRequestT(){}
+		FindNodeRequestT(const FindNodeRequestT &o) {
 			*this = o;
 		}
 
-		FindNodeRequest &operator = (const FindNodeRequest &o) {
-			*(RPCRequest *)this = o;
+		FindNodeRequestT &operator = (const FindNodeRequestT &o) {
+			*(RPCRequestT<Bits> *)this = o;
 			target = o.target;
 			return *this;
 		}
 	};
-	struct FindNodeResponse : public RPCResponse {
-		std::vector<NodeInfo> nodes;
-
-		FindNodeResponse(){}
-		FindNodeResponse(const FindNodeResponse &o) {
+	template <uint16 Bits>
+	struct FindNodeResponseT : public RPCResponseT<Bits> {
+		// At most K contacts, kept inside the message
+		typedef boost::container::static_vector<NodeInfoT<Bits>, K> Nodes;
+		Nodes nodes;
+
+		FindNodeResponseT(){}
+		FindNodeResponseT(const FindNodeResponseT &o) {
 			*this = o;
 		}
 
-		FindNodeResponse &operator = (const FindNodeResponse &o) {
-			*(RPCResponse *)this = o;
+		FindNodeResponseT &operator = (const FindNodeResponseT &o) {
+			*(RPCResponseT<Bits> *)this = o;
 			nodes = o.nodes;
 			return *this;
 		}
 	};
 
-	struct FindValueRequest : public RPCRequest {
-		NodeID key;
+	template <uint16 Bits>
+	struct FindValueRequestT : public RPCRequestT<Bits> {
+		NodeIDT<Bits> key;
 
-		FindValueRequest(){}
-		FindValueRequest(const FindValueRequest &o) {
+		FindValueRequestT(){}
+		FindValueRequestT(const FindValueRequestT &o) {
 			*this = o;
 		}
 
-		FindValueRequest &operator = (const FindValueRequest &o) {
-			*(RPCRequest *)this = o;
+		FindValueRequestT &operator = (const FindValueRequestT &o) {
+			*(RPCRequestT<Bits> *)this = o;
 			key = o.key;
 			return *this;
 		}
 	};
 
-	struct FindValueResponse : public RPCResponse {
-		std::vector<NodeInfo> nodes;
+	template <uint16 Bits>
+	struct FindValueResponseT : public RPCResponseT<Bits> {
+		typedef typename FindNodeResponseT<Bits>::Nodes Nodes;
+		Nodes nodes;
 		std::vector<std::string> values; // may be more than one value
 
-		FindValueResponse(){}
-		FindValueResponse(const FindValueResponse &o) {
+		FindValueResponseT(){}
+		FindValueResponseT(const FindValueResponseT &o) {
 			*this = o;
 		}
 
-		FindValueResponse &operator = (const FindValueResponse &o) {
-			*(RPCResponse *)this = o;
+		FindValueResponseT &operator = (const FindValueResponseT &o) {
+			*(RPCResponseT<Bits> *)this = o;
 			nodes = o.nodes;
 			values = o.values;
 			return *this;
 		}
 	};
 
-	struct DownlistRequest : public RPCRequest {
-		std::vector<NodeID> down_nodes;
+	template <uint16 Bits>
+	struct DownlistRequestT : public RPCRequestT<Bits> {
+		std::vector<NodeIDT<Bits> > down_nodes;
 
-		DownlistRequest(){}
-		DownlistRequest(const DownlistRequest &o) {
+		DownlistRequestT(){}
+		DownlistRequestT(const DownlistRequestT &o) {
 			*this = o;
 		}
 
-		DownlistRequest &operator = (const DownlistRequest &o) {
-			*(RPCRequest *)this = o;
+		DownlistRequestT &operator = (const DownlistRequestT &o) {
+			*(RPCRequestT<Bits> *)this = o;
 			down_nodes = o.down_nodes;
 			return *this;
 		}
 	};
 
-	typedef RPCResponse DownlistResponse;
+	// Declares the RPC messages of the given width inside a class template
+#define DECLARE_RPC_TYPES(bits) \
+	typedef RPCRequestT<bits> RPCRequest; \
+	typedef RPCResponseT<bits> RPCResponse; \
+	typedef RPCRequestT<bits> PingRequest; \
+	typedef RPCResponseT<bits> PingResponse; \
+	typedef StoreRequestT<bits> StoreRequest; \
+	typedef RPCResponseT<bits> StoreResponse; \
+	typedef FindNodeRequestT<bits> FindNodeRequest; \
+	typedef FindNodeResponseT<bits> FindNodeResponse; \
+	typedef FindValueRequestT<bits> FindValueRequest; \
+	typedef FindValueResponseT<bits> FindValueResponse; \
+	typedef DownlistRequestT<bits> DownlistRequest; \
+	typedef RPCResponseT<bits> DownlistResponse;
+
+	DECLARE_RPC_TYPES(NODE_ID_LENGTH_BITS)
 }
 
 #endif // DHT_KAD_RPC_H
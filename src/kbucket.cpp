@@ -7,39 +7,125 @@
 
 namespace dhtpp {
 
-	CKbucket::CKbucket(const NodeID &low_bound_, const NodeID &high_bound_) {
+	template <uint16 Bits>
+	CKbucketT<Bits>::CKbucketT(const NodeID &low_bound_, const NodeID &high_bound_, const NodeID &holder_id_) {
 		low_bound = low_bound_;
 		high_bound = high_bound_;
+		holder_id = holder_id_;
+		contacts_number = 0;
+		replacements_number = 0;
 	}
 
-	bool CKbucket::IdInRange(const NodeID &id) const {
+	template <uint16 Bits>
+	bool CKbucketT<Bits>::IdInRange(const NodeID &id) const {
 		return id >= low_bound && id <= high_bound;
 	}
 
-	RoutingTableErrorCode CKbucket::AddContact(const NodeInfo &info) {
+	template <uint16 Bits>
+	uint16 CKbucketT<Bits>::Find(const NodeID &id) const {
+		uint16 i = 0;
+		while (i < contacts_number && !(ids[i] == id))
+			++i;
+		return i;
+	}
+
+	template <uint16 Bits>
+	void CKbucketT<Bits>::RemoveSlot(uint16 slot) {
+		assert(slot < contacts_number);
+		uint16 last = --contacts_number;
+		uint16 i = 0;
+		while (order[i] != slot)
+			++i;
+		for (; i < last; ++i) {
+			order[i] = order[i + 1];
+		}
+		for (i = 0; by_distance[i] != slot; ++i);
+		for (; i < last; ++i) {
+			by_distance[i] = by_distance[i + 1];
+		}
+
+		// Keep the slots packed, the last one fills the hole
+		if (slot == last)
+			return;
+		ids[slot] = ids[last];
+		addrs[slot] = addrs[last];
+		last_seen[slot] = last_seen[last];
+		rtts[slot] = rtts[last];
+		for (i = 0; order[i] != last; ++i);
+		order[i] = (uint8) slot;
+		for (i = 0; by_distance[i] != last; ++i);
+		by_distance[i] = (uint8) slot;
+	}
+
+	template <uint16 Bits>
+	void CKbucketT<Bits>::AppendSlot(const NodeID &id, const NodeAddress &addr, timestamp seen, const RttEstimate &rtt) {
+		assert(contacts_number < K);
+		uint16 slot = contacts_number++;
+		ids[slot] = id;
+		addrs[slot] = addr;
+		last_seen[slot] = seen;
+		rtts[slot] = rtt;
+		order[slot] = (uint8) slot;
+
+		// Insert into the distance ranking, after the farther contacts
+		uint16 i = slot;
+		for (; i > 0 && IsCloser(ids[by_distance[i - 1]], id, holder_id); --i) {
+			by_distance[i] = by_distance[i - 1];
+		}
+		by_distance[i] = (uint8) slot;
+	}
+
+	template <uint16 Bits>
+	void CKbucketT<Bits>::TouchSlot(uint16 slot) {
+		uint16 i = 0;
+		while (order[i] != slot)
+			++i;
+		for (; i + 1 < contacts_number; ++i) {
+			order[i] = order[i + 1];
+		}
+		order[i] = (uint8) slot;
+	}
+
+	template <uint16 Bits>
+	void CKbucketT<Bits>::GetSlot(uint16 slot, Contact &out) const {
+		out.id = ids[slot];
+		(NodeAddress &)out = addrs[slot];
+		out.last_seen = last_seen[slot];
+		out.rtt = rtts[slot];
+	}
+
+	template <uint16 Bits>
+	RoutingTableErrorCode CKbucketT<Bits>::AddContact(const NodeInfo &info) {
 		Contact contact;
 		(NodeInfo &)contact = info;
 		contact.last_seen = GetTimerInstance()->GetCurrentTime();
 		return AddContact(contact);
 	}
 
-	RoutingTableErrorCode CKbucket::AddContact(const Contact &contact) {
+	template <uint16 Bits>
+	RoutingTableErrorCode CKbucketT<Bits>::AddContact(const Contact &contact) {
 		assert(IdInRange(contact.GetId()));
 
-		if (contacts.size() >= K)
-			return FULL;
+		uint16 slot = Find(contact.id);
+		if (slot < contacts_number) {
+			// Update contact, it becomes the most recently seen one.
+			// The round trip time estimate is kept.
+			addrs[slot] = contact;
+			last_seen[slot] = contact.last_seen;
+			TouchSlot(slot);
+			return EXISTED;
+		}
 
-		std::pair<ContactList::iterator, bool> res = contacts.insert(contact);
-		if (res.second)
-			return SUCCEED;
+		if (contacts_number >= K)
+			return FULL;
 
-		// Update contact
-		*res.first = contact;
-		return EXISTED;
+		AppendSlot(contact.id, contact, contact.last_seen, contact.rtt);
+		return SUCCEED;
 	}
 
-	RoutingTableErrorCode CKbucket::AddContactForceK(const NodeInfo &info, const NodeID &holder_id, uint16 count) {
-		assert(contacts.size() == K);
+	template <uint16 Bits>
+	RoutingTableErrorCode CKbucketT<Bits>::AddContactForceK(const NodeInfo &info, uint16 count) {
+		assert(contacts_number == K);
 		if (!count)
 			return FULL;
 
@@ -47,128 +133,167 @@ namespace dhtpp {
 		return FULL;
 #endif
 
-		// Contacts for sorting
-		struct forceK {
-			ContactList::iterator it;
-			int last_seen_weight, distance_weight;
-
-			const NodeID &GetId() const {
-				return it->GetId();
-			}
-
-			forceK() {
-				last_seen_weight = distance_weight = 0;
-			}
-
-			forceK(const forceK &o) {
-				*this = o;
-			}
-
-			forceK &operator =(const forceK &o) {
-				it = o.it;
-				last_seen_weight = o.last_seen_weight;
-				distance_weight = o.distance_weight;
-				return *this;
-			}
-		} forceK_[K];
-
-		int i;
-		ContactList::iterator it;
-		for (i = 0, it = contacts.begin(); it != contacts.end(); ++it, ++i)
-			forceK_[i].it = it;
-
-		std::partial_sort(forceK_, forceK_ + count, forceK_ + K, distance_comp_ge<forceK>(holder_id));
-
-		// Check this contact in _count_ closest to _holder_id_ contacts
-		if ( (forceK_[count - 1].it->id ^ holder_id) < (info.id ^ holder_id) )
+		// by_distance starts with the _count_ contacts farthest from holder_id,
+		// check this contact is closer than the closest of them
+		if (IsCloser(ids[by_distance[count - 1]], info.id, holder_id))
 			return FULL;
 
-		for (i = 0; i < count; ++i) // only _count_ contacts
-			forceK_[i].distance_weight = i;
-
-		// sort by last_seen
-		struct last_seen_comp {
-			bool operator()(const forceK &f1, const forceK &f2) {
-				return f1.it->last_seen < f2.it->last_seen;
-			}
-		};
-
-		std::sort(forceK_, forceK_ + count, last_seen_comp()); // only _count_ contacts
+		// distance weight is the position in by_distance (0 is the farthest),
+		// last seen weight is the position among the _count_ contacts in the
+		// recency order (0 is the oldest)
+		uint16 distance_weight[K];
+		uint16 i;
+		for (i = 0; i < K; ++i)
+			distance_weight[i] = K;
 		for (i = 0; i < count; ++i)
-			forceK_[i].last_seen_weight = i;
-
-		// find less useful contact
-		int less_useful_ind = 0;
-		int less_useful_weight = forceK_[0].last_seen_weight + forceK_[0].distance_weight;
-		
-		for (i = 1; i < count; ++i) {
-			int weight = forceK_[i].last_seen_weight + forceK_[i].distance_weight;
-			if (weight < less_useful_weight) {
-				less_useful_ind = i;
-				weight = less_useful_weight;
+			distance_weight[by_distance[i]] = i;
+
+		// find less useful contact, the older one on ties
+		uint16 less_useful_slot = K;
+		int less_useful_weight = 0;
+		int last_seen_weight = 0;
+		for (i = 0; i < K; ++i) {
+			uint16 slot = order[i];
+			if (distance_weight[slot] == K)
+				continue;
+			int weight = last_seen_weight++ + distance_weight[slot];
+			if (less_useful_slot == K || weight < less_useful_weight) {
+				less_useful_slot = slot;
+				less_useful_weight = weight;
 			}
 		}
 
 		// replace contact
-		contacts.erase(forceK_[less_useful_ind].it);
+		RemoveSlot(less_useful_slot);
 		return AddContact(info);
 	}
 
-	bool CKbucket::RemoveContact(const NodeID &id) {
-		Contact temp;
-		temp.id = id;
-		return contacts.erase(temp) > 0;
+	template <uint16 Bits>
+	void CKbucketT<Bits>::RemoveReplacement(uint16 i) {
+		--replacements_number;
+		for (; i < replacements_number; ++i) {
+			replacement_ids[i] = replacement_ids[i + 1];
+			replacement_addrs[i] = replacement_addrs[i + 1];
+			replacement_last_seen[i] = replacement_last_seen[i + 1];
+		}
 	}
 
-	bool CKbucket::GetContact(const NodeID &id, Contact &cont) const {
-		Contact temp;
-		temp.id = id;
-		ContactList::const_iterator it = contacts.find(temp);
-		if (it == contacts.end())
+	template <uint16 Bits>
+	void CKbucketT<Bits>::AddReplacement(const NodeInfo &info) {
+		assert(IdInRange(info.id));
+		assert(Find(info.id) == contacts_number);
+
+		uint16 i = 0;
+		while (i < replacements_number && !(replacement_ids[i] == info.id))
+			++i;
+		if (i < replacements_number) {
+			RemoveReplacement(i);
+		} else if (replacements_number == replacement_cache_size) {
+			// Forget the oldest candidate
+			RemoveReplacement(0);
+		}
+
+		i = replacements_number++;
+		replacement_ids[i] = info.id;
+		replacement_addrs[i] = info;
+		replacement_last_seen[i] = GetTimerInstance()->GetCurrentTime();
+	}
+
+	template <uint16 Bits>
+	bool CKbucketT<Bits>::RemoveContact(const NodeID &id, bool &is_promoted, NodeInfo &promoted) {
+		is_promoted = false;
+		uint16 slot = Find(id);
+		if (slot == contacts_number) {
+			// A down node is not a candidate either
+			for (uint16 i = 0; i < replacements_number; ++i) {
+				if (replacement_ids[i] == id) {
+					RemoveReplacement(i);
+					break;
+				}
+			}
 			return false;
-		cont = *it;
+		}
+		RemoveSlot(slot);
+
+		if (replacements_number) {
+			uint16 last = --replacements_number;
+			AppendSlot(replacement_ids[last], replacement_addrs[last], replacement_last_seen[last], RttEstimate());
+			promoted.id = replacement_ids[last];
+			(NodeAddress &)promoted = replacement_addrs[last];
+			is_promoted = true;
+		}
 		return true;
 	}
 
-	bool CKbucket::LastSeenContact(Contact &out) const {
-		if (!contacts.size())
+	template <uint16 Bits>
+	bool CKbucketT<Bits>::GetContact(const NodeID &id, Contact &cont) const {
+		uint16 slot = Find(id);
+		if (slot == contacts_number)
 			return false;
+		GetSlot(slot, cont);
+		return true;
+	}
 
-		ContactList::const_iterator it = contacts.begin(), c = it;
-		timestamp stamp = it->last_seen;
+	template <uint16 Bits>
+	bool CKbucketT<Bits>::UpdateRtt(const NodeID &id, uint64 rtt) {
+		uint16 slot = Find(id);
+		if (slot == contacts_number)
+			return false;
+		rtts[slot].AddSample(rtt);
+		return true;
+	}
 
-		for (; it != contacts.end(); ++it) {
-			if (stamp > it->last_seen) {
-				stamp = it->last_seen;
-				c = it;
-			}
-		}
+	template <uint16 Bits>
+	bool CKbucketT<Bits>::LastSeenContact(Contact &out) const {
+		if (!contacts_number)
+			return false;
 
-		out = *c;
+		GetSlot(order[0], out);
 
 		return true;
 	}
 
-	void CKbucket::GetContacts(std::vector<Contact> &out_contacts) const {
-		out_contacts.insert(out_contacts.end(), contacts.begin(), contacts.end());
+	template <uint16 Bits>
+	void CKbucketT<Bits>::GetContacts(std::vector<Contact> &out_contacts) const {
+		typename std::vector<Contact>::size_type first = out_contacts.size();
+		out_contacts.resize(first + contacts_number);
+		for (uint16 i = 0; i < contacts_number; ++i) {
+			GetSlot(order[i], out_contacts[first + i]);
+		}
+	}
+
+	template <uint16 Bits>
+	void CKbucketT<Bits>::GetContacts(std::vector<NodeInfo> &out_contacts) const {
+		typename std::vector<NodeInfo>::size_type first = out_contacts.size();
+		out_contacts.resize(first + contacts_number);
+		if (contacts_number)
+			GetContacts(&out_contacts[first]);
 	}
 
-	void CKbucket::GetContacts(std::vector<const Contact *> &out_contacts) const {
-		for (ContactList::const_iterator it = contacts.begin(); it != contacts.end(); ++it) {
-			out_contacts.push_back(&*it);
+	template <uint16 Bits>
+	uint16 CKbucketT<Bits>::GetContacts(NodeInfo *out) const {
+		for (uint16 i = 0; i < contacts_number; ++i) {
+			out[i].id = ids[i];
+			(NodeAddress &)out[i] = addrs[i];
 		}
+		return contacts_number;
 	}
 
-	RoutingTableErrorCode CKbucket::CopyContactsTo(CKbucket &bk) const {
-		ContactList::const_iterator it = contacts.begin(), end_it = contacts.end();
-		RoutingTableErrorCode err;
-		for (; it != end_it; ++it) {
-			if (bk.IdInRange(it->GetId())) {
-				if ( (err = bk.AddContact(*it)) != SUCCEED )
-					return err;
-			}
+	template <uint16 Bits>
+	RoutingTableErrorCode CKbucketT<Bits>::CopyContactsTo(CKbucketT &bk) const {
+		// In the recency order, so bk keeps it
+		for (uint16 i = 0; i < contacts_number; ++i) {
+			uint16 slot = order[i];
+			if (!bk.IdInRange(ids[slot]))
+				continue;
+			if (bk.Find(ids[slot]) < bk.contacts_number)
+				return EXISTED;
+			if (bk.contacts_number >= K)
+				return FULL;
+			bk.AppendSlot(ids[slot], addrs[slot], last_seen[slot], rtts[slot]);
 		}
 		return SUCCEED;
 	}
 
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CKbucketT)
 }
\ No newline at end of file
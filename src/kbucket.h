@@ -5,27 +5,43 @@
 #include "contact.h"
 #include "routing_table_error_code.h"
 
-#include <set>
 #include <vector>
 
 namespace dhtpp {
 
-	class CKbucket {
+	template <uint16 Bits>
+	class CKbucketT {
 	public:
-		CKbucket(const NodeID &low_bound, const NodeID &high_bound);
+		DECLARE_NODE_ID_TYPES(Bits)
+
+		CKbucketT(const NodeID &low_bound, const NodeID &high_bound, const NodeID &holder_id);
 
 		bool IdInRange(const NodeID &id) const;
 		RoutingTableErrorCode AddContact(const NodeInfo &info);
 		RoutingTableErrorCode AddContact(const Contact &contact);
 
 		// count = K = number_of_contacts_in_the_holder_bucket
-		RoutingTableErrorCode AddContactForceK(const NodeInfo &info, const NodeID &holder_id, uint16 count);
-		bool RemoveContact(const NodeID &id);
+		RoutingTableErrorCode AddContactForceK(const NodeInfo &info, uint16 count);
+		// Remembers the contact that does not fit into the full bucket
+		void AddReplacement(const NodeInfo &info);
+		// The freshest replacement takes the place of the removed contact
+		bool RemoveContact(const NodeID &id, bool &is_promoted, NodeInfo &promoted);
+		bool RemoveContact(const NodeID &id) {
+			bool is_promoted;
+			NodeInfo promoted;
+			return RemoveContact(id, is_promoted, promoted);
+		}
 		bool GetContact(const NodeID &id, Contact &cont) const;
+		// Adds the round trip time sample to the contact's estimate,
+		// false if there is no such contact
+		bool UpdateRtt(const NodeID &id, uint64 rtt);
 		bool LastSeenContact(Contact &out) const;
+		// From the least to the most recently seen contact
 		void GetContacts(std::vector<Contact> &out_contacts) const;
-		void GetContacts(std::vector<const Contact *> &out_contacts) const;
-		RoutingTableErrorCode CopyContactsTo(CKbucket &bk) const;
+		void GetContacts(std::vector<NodeInfo> &out_contacts) const;
+		// Writes GetContactsNumber() contacts to out and returns their number
+		uint16 GetContacts(NodeInfo *out) const;
+		RoutingTableErrorCode CopyContactsTo(CKbucketT &bk) const;
 
 		const NodeID &GetHighBound() const {
 			return high_bound;
@@ -36,22 +52,42 @@ namespace dhtpp {
 		}
 
 		uint16 GetContactsNumber() const {
-			return (uint16) contacts.size();
+			return contacts_number;
 		}
 
 	private:
-		struct Comp {
-			bool operator()(const Contact &c1, const Contact &c2) const {
-				return c1.GetId() < c2.GetId();
-			}
-		};
+		// Contacts live in the first contacts_number slots, one array per field,
+		// so the scans touch only the ids or only the timestamps
+		NodeID ids[K];
+		NodeAddress addrs[K];
+		timestamp last_seen[K];
+		RttEstimate rtts[K];
+		// Slots from the least to the most recently seen contact
+		uint8 order[K];
+		// Slots from the farthest from holder_id to the closest one
+		uint8 by_distance[K];
+		uint16 contacts_number;
 
-		typedef std::set<Contact, Comp> ContactList;
+		// Replacement cache, from the oldest to the freshest candidate
+		NodeID replacement_ids[replacement_cache_size];
+		NodeAddress replacement_addrs[replacement_cache_size];
+		timestamp replacement_last_seen[replacement_cache_size];
+		uint16 replacements_number;
 
-		ContactList contacts;
-		NodeID low_bound, high_bound;
+		NodeID low_bound, high_bound, holder_id;
+
+		// Slot of the contact or contacts_number if there is no such contact
+		uint16 Find(const NodeID &id) const;
+		void RemoveSlot(uint16 slot);
+		void AppendSlot(const NodeID &id, const NodeAddress &addr, timestamp seen, const RttEstimate &rtt);
+		// Moves the slot to the most recently seen end of the order
+		void TouchSlot(uint16 slot);
+		void RemoveReplacement(uint16 i);
+		void GetSlot(uint16 slot, Contact &out) const;
 	};
 
+	typedef CKbucketT<NODE_ID_LENGTH_BITS> CKbucket;
+
 }
 
 #endif // DHT_KBUCKET_H
@@ -4,151 +4,306 @@
 #include "config.h"
 #include "types.h"
 
+#include <boost/predef/other/endian.h>
+#include <boost/static_assert.hpp>
+
+#include <cstddef>
+
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#include <intrin.h>
+#endif
+
 namespace dhtpp {
 
-	// Big endian
-	struct NodeID {
-		uint8 id[NODE_ID_LENGTH_BYTES];
+	// Converts a word loaded from big endian memory to the host order and back
+	inline uint64 BigEndianWord(uint64 v) {
+#if BOOST_ENDIAN_BIG_BYTE
+		return v;
+#elif defined(_MSC_VER)
+		return _byteswap_uint64(v);
+#elif defined(__GNUC__)
+		return __builtin_bswap64(v);
+#else
+		v = ((v & 0x00ff00ff00ff00ffULL) << 8) | ((v >> 8) & 0x00ff00ff00ff00ffULL);
+		v = ((v & 0x0000ffff0000ffffULL) << 16) | ((v >> 16) & 0x0000ffff0000ffffULL);
+		return (v << 32) | (v >> 32);
+#endif
+	}
+
+	// Number of leading zero bits of v, v != 0
+	inline uint16 CountLeadingZeros(uint64 v) {
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanReverse64(&index, v);
+		return (uint16) (63 - index);
+#elif defined(__GNUC__)
+		return (uint16) __builtin_clzll(v);
+#else
+		uint16 n = 0;
+		for (uint64 mask = 1ULL << 63; !(v & mask); mask >>= 1)
+			++n;
+		return n;
+#endif
+	}
+
+	// Big endian, id[] is the wire representation.
+	// The same bytes are viewed as 64-bit words, so the arithmetic works on
+	// length_words machine words instead of length_bytes bytes.
+	template <uint16 Bits>
+	struct NodeIDT {
+		BOOST_STATIC_ASSERT(Bits % 8 == 0);
+		enum {
+			length_bits = Bits,
+			length_bytes = Bits / 8,
+			length_words = (Bits + 63) / 64,
+			// Unused low bits of the last word, always kept zero
+			padding_bits = length_words * 64 - Bits
+		};
+
+		union {
+			uint8 id[length_bytes];
+			uint64 words[length_words];
+		};
+
+		NodeIDT() {
+			words[length_words - 1] = 0;
+		}
 
-		bool operator <(const NodeID &o) const;
-		bool operator <=(const NodeID &o) const;
-		bool operator >=(const NodeID &o) const {
+		// Numeric value of the i-th word, the 0-th is the most significant
+		uint64 GetWord(uint16 i) const {
+			return BigEndianWord(words[i]);
+		}
+
+		void SetWord(uint16 i, uint64 v) {
+			words[i] = BigEndianWord(v);
+		}
+
+		// count bits starting from the offset-th most significant one, 0 < count <= 32
+		uint32 GetBits(uint16 offset, uint16 count) const {
+			uint16 w = offset / 64;
+			uint16 shift = offset % 64;
+			uint64 v = GetWord(w) << shift;
+			if (shift && w + 1 < length_words)
+				v |= GetWord(w + 1) >> (64 - shift);
+			return (uint32) (v >> (64 - count));
+		}
+
+		bool operator <(const NodeIDT &o) const;
+		bool operator <=(const NodeIDT &o) const;
+		bool operator >=(const NodeIDT &o) const {
 			return !(*this < o);
 		}
-		bool operator >(const NodeID &o) const {
+		bool operator >(const NodeIDT &o) const {
 			return !(*this <= o);
 		}
-		bool operator ==(const NodeID &o) const;
-		NodeID &operator+=(const NodeID &o);
-		NodeID &operator+=(unsigned int v);
-		NodeID &operator-=(const NodeID &o);
-		NodeID &operator >>= (uint16 f);
-		NodeID &operator ^= (const NodeID &o);
+		bool operator ==(const NodeIDT &o) const;
+		NodeIDT &operator+=(const NodeIDT &o);
+		NodeIDT &operator+=(unsigned int v);
+		NodeIDT &operator-=(const NodeIDT &o);
+		NodeIDT &operator >>= (uint16 f);
+		NodeIDT &operator ^= (const NodeIDT &o);
+
+	private:
+		void ClearPadding() {
+			if (padding_bits != 0)
+				SetWord(length_words - 1, GetWord(length_words - 1) & (~0ULL << padding_bits));
+		}
 	};
 
-	inline NodeID operator - (const NodeID &f, const NodeID &s) {
-		NodeID res = f;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> operator - (const NodeIDT<Bits> &f, const NodeIDT<Bits> &s) {
+		NodeIDT<Bits> res = f;
 		return res -= s;
 	}
 
-	inline NodeID operator + (const NodeID &f, const NodeID &s) {
-		NodeID res = f;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> operator + (const NodeIDT<Bits> &f, const NodeIDT<Bits> &s) {
+		NodeIDT<Bits> res = f;
 		return res += s;
 	}
 
-	inline NodeID operator + (const NodeID &f, unsigned int v) {
-		NodeID res = f;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> operator + (const NodeIDT<Bits> &f, unsigned int v) {
+		NodeIDT<Bits> res = f;
 		return res += v;
 	}
 
-	inline NodeID operator ^ (const NodeID &f, const NodeID &s) {
-		NodeID res = f;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> operator ^ (const NodeIDT<Bits> &f, const NodeIDT<Bits> &s) {
+		NodeIDT<Bits> res = f;
 		return res ^= s;
 	}
 
-	inline NodeID operator >> (const NodeID &f, uint16 d) {
-		NodeID res = f;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> operator >> (const NodeIDT<Bits> &f, uint16 d) {
+		NodeIDT<Bits> res = f;
 		return res >>= d;
 	}
 
-	inline bool NodeID::operator <(const dhtpp::NodeID &o) const {
-		for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
-			if (id[i] < o.id[i])
-				return true;
-			if (id[i] > o.id[i])
-				return false;
+	template <uint16 Bits>
+	inline bool NodeIDT<Bits>::operator <(const NodeIDT &o) const {
+		for (uint16 i = 0; i < length_words; ++i) {
+			if (words[i] != o.words[i])
+				return GetWord(i) < o.GetWord(i);
 		}
 		return false;
 	}
 
-	inline bool NodeID::operator <=(const dhtpp::NodeID &o) const {
-		for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
-			if (id[i] < o.id[i])
-				return true;
-			if (id[i] > o.id[i])
-				return false;
+	template <uint16 Bits>
+	inline bool NodeIDT<Bits>::operator <=(const NodeIDT &o) const {
+		for (uint16 i = 0; i < length_words; ++i) {
+			if (words[i] != o.words[i])
+				return GetWord(i) < o.GetWord(i);
 		}
 		return true;
 	}
 
-	inline bool NodeID::operator ==(const dhtpp::NodeID &o) const {
-		for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
-			if (id[i] != o.id[i])
-				return false;
+	template <uint16 Bits>
+	inline bool NodeIDT<Bits>::operator ==(const NodeIDT &o) const {
+		uint64 diff = 0;
+		for (uint16 i = 0; i < length_words; ++i) {
+			diff |= words[i] ^ o.words[i];
 		}
-		return true;
+		return !diff;
 	}
 
-	inline NodeID &NodeID::operator+=(const NodeID &o) {
-		uint8 a = 0;
-		for (uint16 i = NODE_ID_LENGTH_BYTES; i --> 0; ) {
-			uint16 v = id[i] + o.id[i] + a;
-			id[i] = v & 0xff;
-			a = v >> 8;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> &NodeIDT<Bits>::operator+=(const NodeIDT &o) {
+		// The padding bits of both operands are zero, so no carry comes out of them
+		uint64 a = 0;
+		for (uint16 i = length_words; i --> 0; ) {
+			uint64 v = GetWord(i) + a;
+			a = v < a;
+			uint64 s = v + o.GetWord(i);
+			a |= s < v;
+			SetWord(i, s);
 		}
 		return *this;
 	}
 
-	inline NodeID &NodeID::operator+=(unsigned int d) {
-		uint8 a = 0;
-		for (uint16 i = NODE_ID_LENGTH_BYTES; i --> 0 && (d || a); ) {
-			uint16 v = id[i] + (d & 0xff) + a;
-			id[i] = v & 0xff;
-			a = v >> 8;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> &NodeIDT<Bits>::operator+=(unsigned int d) {
+		NodeIDT v;
+		for (uint16 i = 0; i < length_words; ++i) {
+			v.words[i] = 0;
+		}
+		for (uint16 i = length_bytes; i --> 0 && d; ) {
+			v.id[i] = d & 0xff;
 			d >>= 8;
 		}
+		return *this += v;
+	}
+
+	template <uint16 Bits>
+	inline NodeIDT<Bits> &NodeIDT<Bits>::operator-=(const NodeIDT &o) {
+		uint64 a = 0;
+		for (uint16 i = length_words; i --> 0; ) {
+			uint64 v = GetWord(i);
+			uint64 s = o.GetWord(i) + a;
+			a = (s < a) | (v < s);
+			SetWord(i, v - s);
+		}
 		return *this;
 	}
 
-	inline NodeID &NodeID::operator-=(const NodeID &o) {
-		uint8 a = 0;
-		for (uint16 i = NODE_ID_LENGTH_BYTES; i --> 0; ) {
-			uint16 s = a + o.id[i];
-			if (id[i] < s) {
-				id[i] += 256 - s;
-				a = 1;
-			} else {
-				id[i] -= s;
-				a = 0;
+	template <uint16 Bits>
+	inline NodeIDT<Bits> &NodeIDT<Bits>::operator >>= (uint16 f) {
+		uint16 o = f / 64;
+		uint16 bts = f % 64;
+		for (uint16 i = length_words; i --> 0; ) {
+			uint64 v = 0;
+			if (i >= o) {
+				v = GetWord(i - o) >> bts;
+				if (bts && i > o)
+					v |= GetWord(i - o - 1) << (64 - bts);
 			}
+			SetWord(i, v);
 		}
+		ClearPadding();
 		return *this;
 	}
 
-	inline NodeID &NodeID::operator >>= (uint16 f) {
-		uint16 o = f / 8;
-		uint16 bts = f % 8;
-		uint16 ibts = 8 - bts;
-		for (uint16 i = NODE_ID_LENGTH_BYTES; i --> o+1; ) {
-			id[i] = (id[i-o] >> bts) | (id[i-o-1] << ibts);
+	template <uint16 Bits>
+	inline NodeIDT<Bits> &NodeIDT<Bits>::operator ^= (const NodeIDT &o) {
+		for (uint16 i = 0; i < length_words; ++i) {
+			words[i] ^= o.words[i];
 		}
-		id[o] = id[0] >> bts;
 		return *this;
 	}
 
-	inline NodeID &NodeID::operator ^= (const NodeID &o) {
-		for (uint16 i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
-			id[i] ^= o.id[i];
+	// Number of leading zero bits of the distance, Bits for the null distance
+	template <uint16 Bits>
+	inline uint16 LeadingZeroBits(const NodeIDT<Bits> &distance) {
+		for (uint16 i = 0; i < NodeIDT<Bits>::length_words; ++i) {
+			if (distance.words[i])
+				return i*64 + CountLeadingZeros(distance.GetWord(i));
 		}
-		return *this;
+		return Bits;
+	}
+
+	// LeadingZeroBits(a ^ b)
+	template <uint16 Bits>
+	inline uint16 CommonPrefixLength(const NodeIDT<Bits> &a, const NodeIDT<Bits> &b) {
+		for (uint16 i = 0; i < NodeIDT<Bits>::length_words; ++i) {
+			uint64 d = a.words[i] ^ b.words[i];
+			if (d)
+				return i*64 + CountLeadingZeros(BigEndianWord(d));
+		}
+		return Bits;
+	}
+
+	// XOR metric without materializing the distances.
+	// Returns true if a is closer to target than b: (a ^ target) < (b ^ target).
+	// Only the first word where a and b differ decides it.
+	template <uint16 Bits>
+	inline bool IsCloser(const NodeIDT<Bits> &a, const NodeIDT<Bits> &b, const NodeIDT<Bits> &target) {
+		for (uint16 i = 0; i < NodeIDT<Bits>::length_words; ++i) {
+			if (a.words[i] != b.words[i])
+				return BigEndianWord(a.words[i] ^ target.words[i]) < BigEndianWord(b.words[i] ^ target.words[i]);
+		}
+		return false;
 	}
 
+	// Returns true if (a ^ target) < distance
+	template <uint16 Bits>
+	inline bool IsDistanceLess(const NodeIDT<Bits> &a, const NodeIDT<Bits> &target, const NodeIDT<Bits> &distance) {
+		for (uint16 i = 0; i < NodeIDT<Bits>::length_words; ++i) {
+			uint64 d = a.words[i] ^ target.words[i];
+			if (d != distance.words[i])
+				return BigEndianWord(d) < distance.GetWord(i);
+		}
+		return false;
+	}
+
+	// The ids are SHA-1 digests, so any 8 bytes of them are already uniform.
+	// Found by boost::hash, keys the unordered containers.
+	template <uint16 Bits>
+	inline std::size_t hash_value(const NodeIDT<Bits> &id) {
+		return (std::size_t) id.words[0];
+	}
 
-	struct MaxNodeID : public NodeID {
-		MaxNodeID() {
-			for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
-				id[i] = 0xff;
+	template <uint16 Bits>
+	struct MaxNodeIDT : public NodeIDT<Bits> {
+		MaxNodeIDT() {
+			for (int i = 0; i < NodeIDT<Bits>::length_bytes; ++i) {
+				this->id[i] = 0xff;
 			}
 		}
 	};
 
-	struct NullNodeID : public NodeID {
-		NullNodeID() {
-			for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
-				id[i] = 0x00;
+	template <uint16 Bits>
+	struct NullNodeIDT : public NodeIDT<Bits> {
+		NullNodeIDT() {
+			for (int i = 0; i < NodeIDT<Bits>::length_words; ++i) {
+				this->words[i] = 0x00;
 			}
 		}
 	};
+
+	typedef NodeIDT<NODE_ID_LENGTH_BITS> NodeID;
+	typedef MaxNodeIDT<NODE_ID_LENGTH_BITS> MaxNodeID;
+	typedef NullNodeIDT<NODE_ID_LENGTH_BITS> NullNodeID;
 }
 
 #endif // DHT_NODE_ID_H
\ No newline at end of file
@@ -1,95 +1,185 @@
 #include "routing_table.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <fstream>
 #include <iterator>
 
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
 namespace dhtpp {
 
-	CRoutingTable::CRoutingTable(const NodeID &id) {
+	template <uint16 Bits>
+	CRoutingTableT<Bits>::CRoutingTableT(const NodeID &id) {
 		holder_id = id;
-		memset(holder_brother_bucket, NULL, sizeof(holder_brother_bucket));
 
-		holder_bucket = new CKbucketEntry(NullNodeID(), MaxNodeID());
-		buckets.insert(*holder_bucket);
+		buckets.push_back(CKbucket(NullNodeID(), MaxNodeID(), holder_id));
+		holder_range_valid = false;
+	}
+
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::IdInHolderRange(const NodeID &id) const {
+		if (buckets.back().IdInRange(id))
+			return true;
+		return IsCloseToHolder(id);
+	}
+
+	template <uint16 Bits>
+	void CRoutingTableT<Bits>::FillHolderRange() {
+		IsCloseToHolder(holder_id);
 	}
 
-	CRoutingTable::~CRoutingTable() {
-		Buckets::iterator it = buckets.begin();
-		while (it != buckets.end()) {
-			CKbucketEntry *entry = &*it;
-			it = buckets.erase(it);
-			delete entry;
+	template <uint16 Bits>
+	typename CRoutingTableT<Bits>::BucketIndex CRoutingTableT<Bits>::FindBucket(const NodeID &id, uint16 &level) const {
+		uint16 depth = GetDepth();
+		level = CommonPrefixLength(id, holder_id) / rt_r;
+		if (level >= depth) {
+			level = depth;
+			return GetHolderIndex();
 		}
+
+		// The id shares level*rt_r bits with the holder, the next rt_r bits select
+		// the holder brother group and the rest rt_b - rt_r bits the bucket inside it
+		uint32 group = id.GetBits(level * rt_r, rt_b);
+		uint32 holder_group = holder_id.GetBits(level * rt_r, rt_r);
+		uint32 i = group >> (rt_b - rt_r);
+		uint32 j = group & (rt_pow2_b_r - 1);
+		assert(i != holder_group);
+		uint32 ind = (i < holder_group ? i : i - 1) * rt_pow2_b_r + j;
+
+		BucketIndex bucket = level * hld_br_buck_count + ind;
+		assert(buckets[bucket].IdInRange(id));
+		return bucket;
 	}
 
-	bool CRoutingTable::IdInHolderRange(const NodeID &id) const {
-		if (holder_bucket->IdInRange(id))
-			return true;
-		return IsCloseToHolder(id);
+	template <uint16 Bits>
+	void CRoutingTableT<Bits>::SplitHolderBucket() {
+		// The holder bucket is the last one, its place goes to the first new
+		// brother bucket and the new holder bucket is appended after them
+		CKbucket old = buckets.back();
+		buckets.pop_back();
+
+		NodeID wid = (old.GetHighBound() - old.GetLowBound());
+		wid >>= rt_r;
+		NodeID b_wid = wid >> (rt_b - rt_r);
+		NodeID left_bound = old.GetLowBound();
+		NodeID right_bound = left_bound + wid;
+		NodeID holder_left_bound, holder_right_bound;
+		for (int i = 0; i < rt_pow2_r; ++i) {
+			if ((left_bound <= holder_id) && (holder_id <= right_bound)) {
+				holder_left_bound = left_bound;
+				holder_right_bound = right_bound;
+			} else {
+				NodeID b_left_bound = left_bound;
+				NodeID b_right_bound = b_left_bound + b_wid;
+				for (int j = 0; j < rt_pow2_b_r; ++j) {
+					buckets.push_back(CKbucket(b_left_bound, b_right_bound, holder_id));
+					old.CopyContactsTo(buckets.back());
+					b_left_bound = b_right_bound + 1;
+					b_right_bound = b_left_bound + b_wid;
+				}
+			}
+			left_bound = right_bound + 1;
+			right_bound = left_bound + wid;
+		}
+		buckets.push_back(CKbucket(holder_left_bound, holder_right_bound, holder_id));
+		old.CopyContactsTo(buckets.back());
+		assert((buckets.size() - 1) % hld_br_buck_count == 0);
+
+		holder_range_valid = false;
+	}
+
+	template <uint16 Bits>
+	RoutingTableErrorCode CRoutingTableT<Bits>::AddContact(const NodeInfo &info, bool &is_close_to_holder) {
+		uint16 level;
+		BucketIndex ind = FindBucket(info.GetId(), level);
+		RoutingTableErrorCode res = AddToBucket(ind, level, info, is_close_to_holder);
+		if (res == FULL && ind == GetHolderIndex()) {
+			SplitHolderBucket();
+			return AddContact(info, is_close_to_holder);
+		}
+		return res;
+	}
+
+	template <uint16 Bits>
+	uint16 CRoutingTableT<Bits>::AddContacts(const NodeInfo *contacts, uint16 count,
+		RoutingTableErrorCode *results, bool *is_close_to_holder)
+	{
+		assert(count <= K);
+		BucketIndex inds[K];
+		uint16 levels[K];
+		for (uint16 i = 0; i < count; ++i) {
+			inds[i] = FindBucket(contacts[i].id, levels[i]);
+		}
+
+		// Split until the holder bucket has room for all its new contacts
+		for (;;) {
+			BucketIndex holder_ind = GetHolderIndex();
+			const CKbucket &holder = buckets[holder_ind];
+			uint16 holder_contacts = holder.GetContactsNumber();
+			for (uint16 i = 0; i < count; ++i) {
+				if (inds[i] != holder_ind)
+					continue;
+				Contact c;
+				bool known = holder.GetContact(contacts[i].id, c);
+				for (uint16 j = 0; j < i && !known; ++j) {
+					known = contacts[j].id == contacts[i].id;
+				}
+				if (!known)
+					++holder_contacts;
+			}
+			if (holder_contacts <= K)
+				break;
+
+			SplitHolderBucket();
+			// Only the contacts of the old holder bucket move
+			for (uint16 i = 0; i < count; ++i) {
+				if (inds[i] == holder_ind)
+					inds[i] = FindBucket(contacts[i].id, levels[i]);
+			}
+		}
+
+		uint16 added = 0;
+		for (uint16 i = 0; i < count; ++i) {
+			results[i] = AddToBucket(inds[i], levels[i], contacts[i], is_close_to_holder[i]);
+			assert(results[i] != FULL || inds[i] != GetHolderIndex());
+			if (results[i] == SUCCEED)
+				++added;
+		}
+		return added;
 	}
 
-	RoutingTableErrorCode CRoutingTable::AddContact(const NodeInfo &info, bool &is_close_to_holder) {
-		NodeID id = info.GetId();
-		Buckets::iterator it = buckets.lower_bound(id, Comp());
-		assert(it != buckets.end());
+	template <uint16 Bits>
+	RoutingTableErrorCode CRoutingTableT<Bits>::AddToBucket(BucketIndex ind, uint16 level, const NodeInfo &info, bool &is_close_to_holder) {
+		CKbucket &bucket = buckets[ind];
 
 		is_close_to_holder = false;
 
-		CKbucketEntry *ptr = &*it;
-		RoutingTableErrorCode res = ptr->AddContact(info);
+		RoutingTableErrorCode res = bucket.AddContact(info);
 
 		if (res == SUCCEED) {
-			if (ptr == holder_bucket)
+			if (ind == GetHolderIndex())
 				is_close_to_holder = true;
+			ContactsChanged(level);
 			return SUCCEED;
 		} else if (res == FULL) {
-			if (ptr == holder_bucket) {
-				// Split the bucket
-				NodeID wid = (ptr->GetHighBound() - ptr->GetLowBound());
-				wid >>= rt_r;
-				NodeID b_wid = wid >> (rt_b - rt_r);
-				NodeID left_bound = ptr->GetLowBound();
-				NodeID right_bound = left_bound + wid;
-				int ind = 0;
-				for (int i = 0; i < rt_pow2_r; ++i) {
-					if ((left_bound <= holder_id) && (holder_id <= right_bound)) {
-						holder_bucket = new CKbucketEntry(left_bound, right_bound);
-						ptr->CopyContactsTo(*holder_bucket);
-					} else {
-						NodeID b_left_bound = left_bound;
-						NodeID b_right_bound = b_left_bound + b_wid;
-						for (int j = 0; j < rt_pow2_b_r; ++j) {
-							holder_brother_bucket[ind] = new CKbucketEntry(b_left_bound, b_right_bound);
-							ptr->CopyContactsTo(*holder_brother_bucket[ind]);
-							b_left_bound = b_right_bound + 1;
-							b_right_bound = b_left_bound + b_wid;
-							++ind;
-						}
-					}
-					left_bound = right_bound + 1;
-					right_bound = left_bound + wid;
-				}
-				assert(ind == hld_br_buck_count);
-	
-				buckets.erase(it);
-				delete ptr;
-
-				buckets.insert(*holder_bucket);
-				for (int i = 0; i < hld_br_buck_count; ++i) {
-					buckets.insert(*holder_brother_bucket[i]);
-				}
-
-				return AddContact(info, is_close_to_holder);
-			} else if (std::count(holder_brother_bucket, holder_brother_bucket + hld_br_buck_count, ptr)) {
+			if (ind == GetHolderIndex()) {
+				// to be split by the caller
+				return FULL;
+			} else if (level + 1 == GetDepth()) {
 				// ForceK optimization
-				uint16 count = K - holder_bucket->GetContactsNumber();
+				uint16 count = K - buckets.back().GetContactsNumber();
 				assert(count >= 0);
-				if (count > 0) {
-					return ptr->AddContactForceK(info, holder_id, count);
+				if (count > 0 && bucket.AddContactForceK(info, count) == SUCCEED) {
+					ContactsChanged(level);
+					return SUCCEED;
 				}
 			}
 
-			// do nothing
+			// keep it for the next eviction from this bucket
+			bucket.AddReplacement(info);
 			return FULL;
 		}
 
@@ -97,128 +187,297 @@ namespace dhtpp {
 		return EXISTED;
 	}
 
-	bool CRoutingTable::RemoveContact(const NodeID &node_id, bool &is_close_to_holder) {
-		Buckets::iterator it = buckets.lower_bound(node_id, Comp());
-		assert(it != buckets.end());
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::RemoveContact(const NodeID &node_id, bool &is_close_to_holder,
+		bool &is_promoted, NodeInfo &promoted, bool &promoted_close_to_holder)
+	{
+		uint16 level;
+		BucketIndex ind = FindBucket(node_id, level);
 
-		if (&*it == holder_bucket) {
+		if (ind == GetHolderIndex()) {
 			is_close_to_holder = true;
 		} else {
 			is_close_to_holder = IsCloseToHolder(node_id);			
 		}
 
-		bool res = it->RemoveContact(node_id);
+		promoted_close_to_holder = false;
+		bool res = buckets[ind].RemoveContact(node_id, is_promoted, promoted);
+		if (res) {
+			ContactsChanged(level);
+			// The replacement can be farther from the holder than the removed contact
+			if (is_promoted)
+				promoted_close_to_holder = (ind == GetHolderIndex()) || IsCloseToHolder(promoted.id);
+		}
 		return res;
 	}
 
-	bool CRoutingTable::GetContact(const NodeID &node_id, Contact &cont) const {
-		Buckets::const_iterator it = buckets.lower_bound(node_id, Comp());
-		assert(it != buckets.end());
-
-		bool res = it->GetContact(node_id, cont);
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::GetContact(const NodeID &node_id, Contact &cont) const {
+		bool res = buckets[FindBucket(node_id)].GetContact(node_id, cont);
 		return res;
 	}
 
-	bool CRoutingTable::LastSeenContact(const NodeID &node_id, Contact &out) const {
-		Buckets::const_iterator it = buckets.lower_bound(node_id, Comp());
-		assert(it != buckets.end());
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::UpdateRtt(const NodeID &node_id, uint64 rtt) {
+		return buckets[FindBucket(node_id)].UpdateRtt(node_id, rtt);
+	}
 
-		bool res = it->LastSeenContact(out);
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::LastSeenContact(const NodeID &node_id, Contact &out) const {
+		bool res = buckets[FindBucket(node_id)].LastSeenContact(out);
 		return res;
 	}
 
-	void CRoutingTable::GetClosestContacts(const NodeID &id, std::vector<const Contact *> &out_contacts) const {
-		Buckets::const_iterator it = buckets.lower_bound(id, Comp());
-		assert(it != buckets.end());
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::TakeBucket(const CKbucket &bucket, const NodeID &id,
+		NodeInfo *out, uint16 &count, uint16 capacity)
+	{
+		uint16 n = bucket.GetContactsNumber();
+		if (count + n <= capacity) {
+			count += bucket.GetContacts(out + count);
+			return count == capacity;
+		}
 
-		it->GetContacts(out_contacts);
+		// Only the closest part of the last bucket is needed
+		NodeInfo contacts[K];
+		bucket.GetContacts(contacts);
+		uint16 rest = capacity - count;
+		std::nth_element(contacts, contacts + rest, contacts + n, distance_comp_lt<NodeInfo, Bits>(id));
+		std::copy(contacts, contacts + rest, out + count);
+		count = capacity;
+		return true;
+	}
 
-		if (out_contacts.size() == K)
-			return;
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::TakeBrotherBuckets(uint16 level, const NodeID &id, bool before_holder_group,
+		NodeInfo *out, uint16 &count, uint16 capacity) const
+	{
+		// Group g is at the distance key g ^ id_group from the id,
+		// the bucket j inside it at j ^ id_bucket
+		uint32 id_group = id.GetBits(level * rt_r, rt_r);
+		uint32 holder_group = holder_id.GetBits(level * rt_r, rt_r);
+		uint32 id_bucket = rt_b > rt_r ? id.GetBits(level * rt_r + rt_r, rt_b - rt_r) : 0;
+		uint32 holder_key = id_group ^ holder_group;
+
+		uint32 key = before_holder_group ? 0 : holder_key + 1;
+		uint32 end_key = before_holder_group ? holder_key : rt_pow2_r;
+		for (; key < end_key; ++key) {
+			uint32 i = key ^ id_group;
+			BucketIndex ind = level * hld_br_buck_count
+				+ (i < holder_group ? i : i - 1) * rt_pow2_b_r;
+			for (uint32 j = 0; j < rt_pow2_b_r; ++j) {
+				if (TakeBucket(buckets[ind + (j ^ id_bucket)], id, out, count, capacity))
+					return true;
+			}
+		}
+		return false;
+	}
 
-		assert(out_contacts.size() < K);
+	template <uint16 Bits>
+	void CRoutingTableT<Bits>::GetClosestContacts(const NodeID &id, std::vector<NodeInfo> &out_contacts) const {
+		typename std::vector<NodeInfo>::size_type first = out_contacts.size();
+		out_contacts.resize(first + K);
+		out_contacts.resize(first + GetClosestContacts(id, &out_contacts[first], K));
+	}
 
-		// Less than K contacts, continue the searching
-		uint16 contacts_needed = K - out_contacts.size();
-		std::vector<const Contact *> additional_contacts;
+	template <uint16 Bits>
+	uint16 CRoutingTableT<Bits>::GetClosestContacts(const NodeID &id, NodeInfo *out, uint16 capacity) const {
+		// The buckets cover disjoint prefixes, so all the ids of a bucket are
+		// closer to the id than all the ids of a farther bucket. Taking the
+		// buckets by the distance until there are K contacts gives exactly the
+		// K closest ones.
+		// Inside the holder group of a level the deeper levels and the holder
+		// bucket come, so the brother groups of the level closer than the holder
+		// group go before them and the farther ones after.
+		uint16 count = 0;
+		if (!capacity)
+			return count;
+		uint16 depth = GetDepth();
+		// Above this level the id is in the holder group, no brother group is closer
+		uint16 top = std::min<uint16>(CommonPrefixLength(id, holder_id) / rt_r, depth);
+
+		uint16 level;
+		for (level = top; level < depth; ++level) {
+			if (TakeBrotherBuckets(level, id, true, out, count, capacity))
+				return count;
+		}
+		if (TakeBucket(buckets.back(), id, out, count, capacity))
+			return count;
+		while (level-- > 0) {
+			if (TakeBrotherBuckets(level, id, false, out, count, capacity))
+				return count;
+		}
+		return count;
+	}
 
-		// sort buckets by the distance
-		struct Buck {
-			const CKbucketEntry *entry;
-			Buck(const CKbucketEntry *e) {
-				entry = e;
-			}
-			const NodeID &GetId() const {
-				return entry->GetHighBound();
+	template <uint16 Bits>
+	void CRoutingTableT<Bits>::SaveBootstrapContacts(std::vector<NodeAddress> &out) const {
+		typename Buckets::const_iterator it;
+		for (it = buckets.begin(); it != buckets.end(); ++it) {
+			std::vector<Contact> contacts;
+			it->GetContacts(contacts);
+			for (typename std::vector<NodeInfo>::size_type i = 0; i < contacts.size(); ++i) {
+				out.push_back(contacts[i]);
 			}
-		};
+		}
+	}
 
-		std::vector<Buck> sorted_buckets;
-		sorted_buckets.reserve(buckets.size());
-		for (it = buckets.begin(); it != buckets.end(); ++it)
-			sorted_buckets.push_back(Buck(&*it));
+	template <uint16 Bits>
+	std::size_t CRoutingTableT<Bits>::GetFootprint() const {
+		return sizeof(*this) + buckets.capacity() * sizeof(CKbucket);
+	}
 
-		std::sort(sorted_buckets.begin(), sorted_buckets.end(), distance_comp_le<Buck>(id));
+	namespace {
+		const uint32 snapshot_magic = 0x52544853; // "RTHS"
 
-		// extract additional contacts
-		for (std::vector<Buck>::size_type i = 1; i < sorted_buckets.size(); ++i) {
-			sorted_buckets[i].entry->GetContacts(additional_contacts);
-			if (additional_contacts.size() >= contacts_needed)
-				break;
-		}
+		struct SnapshotHeader {
+			uint32 magic;
+			uint16 bits, k, b, r;
+			uint32 buckets_number;
+		};
 
-		if (additional_contacts.size() <= contacts_needed) {
-			// return all what we have
-			out_contacts.insert(out_contacts.end(), additional_contacts.begin(), additional_contacts.end());
-			return;
+		template <typename T>
+		void Put(std::vector<char> &out, const T &v) {
+			out.insert(out.end(), (const char *) &v, (const char *) &v + sizeof(v));
 		}
 
-		// We have more than K contacts
-		// sort them to choose _contacts_needed_ closest contacts
-		std::nth_element(additional_contacts.begin(),
-			additional_contacts.begin() + contacts_needed,
-			additional_contacts.end(),
-			distance_comp_le_ptr<const Contact *>(id));
-		// copy contacts with smallest distance
-		out_contacts.insert(out_contacts.end(), additional_contacts.begin(), additional_contacts.begin() + contacts_needed);
+		// Reads sizeof(v) bytes at pos, false past the end
+		template <typename T>
+		bool Get(const char *data, std::size_t size, std::size_t &pos, T &v) {
+			if (size - pos < sizeof(v))
+				return false;
+			memcpy(&v, data + pos, sizeof(v));
+			pos += sizeof(v);
+			return true;
+		}
 	}
 
-	void CRoutingTable::GetClosestContacts(const NodeID &id, std::vector<NodeInfo> &out_contacts) const {
-		std::vector<const Contact *> out_contacts_;
-		GetClosestContacts(id, out_contacts_);
-		std::vector<const Contact *>::iterator it = out_contacts_.begin();
-		for (; it != out_contacts_.end(); ++it) {
-			out_contacts.push_back(**it);
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::SaveSnapshot(const std::string &filename) const {
+		// header, holder id, then every bucket:
+		// low bound, high bound, contacts number, (id, ip, last_seen) per contact
+		std::vector<char> out;
+		SnapshotHeader header;
+		header.magic = snapshot_magic;
+		header.bits = Bits;
+		header.k = K;
+		header.b = rt_b;
+		header.r = rt_r;
+		header.buckets_number = (uint32) buckets.size();
+		Put(out, header);
+		Put(out, holder_id.id);
+
+		std::vector<Contact> contacts;
+		for (typename Buckets::const_iterator it = buckets.begin(); it != buckets.end(); ++it) {
+			Put(out, it->GetLowBound().id);
+			Put(out, it->GetHighBound().id);
+			contacts.clear();
+			it->GetContacts(contacts);
+			Put(out, (uint16) contacts.size());
+			for (typename std::vector<Contact>::size_type i = 0; i < contacts.size(); ++i) {
+				Put(out, contacts[i].id.id);
+				Put(out, contacts[i].ip);
+				Put(out, contacts[i].last_seen);
+			}
 		}
+
+		std::ofstream f(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+		f.write(&out[0], out.size());
+		return f.good();
 	}
 
-	void CRoutingTable::SaveBootstrapContacts(std::vector<NodeAddress> &out) const {
-		Buckets::const_iterator it;
-		for (it = buckets.begin(); it != buckets.end(); ++it) {
-			std::vector<Contact> contacts;
-			it->GetContacts(contacts);
-			for (std::vector<NodeInfo>::size_type i = 0; i < contacts.size(); ++i) {
-				out.push_back(contacts[i]);
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::LoadSnapshot(const std::string &filename, std::vector<NodeInfo> &out_contacts) {
+		using namespace boost::interprocess;
+		assert(buckets.size() == 1 && !buckets.back().GetContactsNumber());
+
+		file_mapping file;
+		mapped_region region;
+		try {
+			file_mapping(filename.c_str(), read_only).swap(file);
+			mapped_region(file, read_only).swap(region);
+		} catch (const interprocess_exception &) {
+			return false;
+		}
+		const char *data = (const char *) region.get_address();
+		std::size_t size = region.get_size(), pos = 0;
+
+		SnapshotHeader header;
+		NodeID id;
+		if (!Get(data, size, pos, header) || !Get(data, size, pos, id.id))
+			return false;
+		if (header.magic != snapshot_magic || header.bits != Bits || header.k != K ||
+			header.b != rt_b || header.r != rt_r || !(id == holder_id) ||
+			(header.buckets_number - 1) % hld_br_buck_count != 0 ||
+			(header.buckets_number - 1) / hld_br_buck_count > Bits / rt_r)
+		{
+			return false;
+		}
+
+		// The layout of the buckets depends only on the number of the splits
+		CRoutingTableT table(holder_id);
+		while (table.buckets.size() < header.buckets_number)
+			table.SplitHolderBucket();
+
+		typename std::vector<NodeInfo>::size_type first = out_contacts.size();
+		for (typename Buckets::iterator it = table.buckets.begin(); it != table.buckets.end(); ++it) {
+			NodeID low_bound, high_bound;
+			uint16 contacts_number;
+			if (!Get(data, size, pos, low_bound.id) || !Get(data, size, pos, high_bound.id) ||
+				!Get(data, size, pos, contacts_number) ||
+				!(low_bound == it->GetLowBound()) || !(high_bound == it->GetHighBound()) ||
+				contacts_number > K)
+			{
+				out_contacts.resize(first);
+				return false;
+			}
+
+			for (uint16 i = 0; i < contacts_number; ++i) {
+				Contact c;
+				if (!Get(data, size, pos, c.id.id) || !Get(data, size, pos, c.ip) ||
+					!Get(data, size, pos, c.last_seen) || !it->IdInRange(c.id) ||
+					it->AddContact(c) != SUCCEED)
+				{
+					out_contacts.resize(first);
+					return false;
+				}
+				out_contacts.push_back(c);
 			}
 		}
+
+		buckets.swap(table.buckets);
+		holder_range_valid = false;
+		return true;
 	}
 
-	bool CRoutingTable::IsCloseToHolder(const NodeID &id) const {
-		std::vector<const Contact *> close_contacts;
-		// Get contacts closest to us
-		GetClosestContacts(holder_id, close_contacts);
+	template <uint16 Bits>
+	void CRoutingTableT<Bits>::ContactsChanged(uint16 level) {
+		if (holder_range_valid && level >= holder_range_level)
+			holder_range_valid = false;
+	}
 
-		// Get min and max id
-		NodeID min_id = MaxNodeID();
-		NodeID max_id = NullNodeID();
-		std::vector<const Contact *>::iterator it = close_contacts.begin();
-		for (; it != close_contacts.end(); ++it) {
-			if ((*it)->id < min_id)
-				min_id = (*it)->id;
-			if ((*it)->id > max_id)
-				max_id = (*it)->id;
+	template <uint16 Bits>
+	bool CRoutingTableT<Bits>::IsCloseToHolder(const NodeID &id) const {
+		if (!holder_range_valid) {
+			NodeInfo close_contacts[K];
+			// Get contacts closest to us
+			uint16 count = GetClosestContacts(holder_id, close_contacts, K);
+
+			// Get min and max id and the farthest level they come from
+			holder_range_min = MaxNodeID();
+			holder_range_max = NullNodeID();
+			holder_range_level = count < K ? 0 : GetDepth();
+			for (NodeInfo *it = close_contacts; it != close_contacts + count; ++it) {
+				if (it->id < holder_range_min)
+					holder_range_min = it->id;
+				if (it->id > holder_range_max)
+					holder_range_max = it->id;
+				holder_range_level = std::min<uint16>(holder_range_level, CommonPrefixLength(it->id, holder_id) / rt_r);
+			}
+			holder_range_valid = true;
 		}
-		return (min_id <= id) && (id <= max_id);
+		return (holder_range_min <= id) && (id <= holder_range_max);
 	}
 
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CRoutingTableT)
 }
\ No newline at end of file
@@ -4,58 +4,115 @@
 #include "kbucket.h"
 #include "routing_table_error_code.h"
 
-#include <boost/intrusive/set.hpp>
+#include <boost/container/static_vector.hpp>
 
+#include <string>
 #include <vector>
 
 namespace dhtpp {
 
-	class CRoutingTable {
+	template <uint16 Bits>
+	class CRoutingTableT {
 	public:
-		CRoutingTable(const NodeID &id);
-		~CRoutingTable();
+		DECLARE_NODE_ID_TYPES(Bits)
+
+		CRoutingTableT(const NodeID &id);
 
 		bool IdInHolderRange(const NodeID &id) const;
+		// Fills the cached range of the holder neighborhood, until the next
+		// change the const methods do not write to the table
+		void FillHolderRange();
 		RoutingTableErrorCode AddContact(const NodeInfo &info, bool &is_close_to_holder);
-		bool RemoveContact(const NodeID &node_id, bool &is_close_to_holder);
+		// Adds count <= K contacts at once, e.g. the nodes of a response.
+		// The buckets are found once and the holder bucket is split before
+		// adding any of them, as many times as it takes to fit its new
+		// contacts. results and is_close_to_holder get the outcome of
+		// every contact, returns the number of the added ones.
+		uint16 AddContacts(const NodeInfo *contacts, uint16 count,
+			RoutingTableErrorCode *results, bool *is_close_to_holder);
+		// is_close_to_holder is for the removed contact, promoted_close_to_holder
+		// for the replacement promoted in its place (if is_promoted)
+		bool RemoveContact(const NodeID &node_id, bool &is_close_to_holder,
+			bool &is_promoted, NodeInfo &promoted, bool &promoted_close_to_holder);
 		bool GetContact(const NodeID &id, Contact &out) const;
+		bool UpdateRtt(const NodeID &id, uint64 rtt);
 		bool LastSeenContact(const NodeID &node_id, Contact &out) const;
-		void GetClosestContacts(const NodeID &id, std::vector<const Contact *> &out_contacts) const;
 		void GetClosestContacts(const NodeID &id, std::vector<NodeInfo> &out_contacts) const;
+		// Writes at most capacity closest contacts to out and returns their number,
+		// the result is exact for capacity <= K
+		uint16 GetClosestContacts(const NodeID &id, NodeInfo *out, uint16 capacity) const;
+		// Fills the fixed capacity storage, e.g. the nodes of a FindNodeResponse
+		template <std::size_t N>
+		void GetClosestContacts(const NodeID &id, boost::container::static_vector<NodeInfo, N> &out_contacts) const {
+			out_contacts.resize(N, boost::container::default_init);
+			out_contacts.resize(GetClosestContacts(id, out_contacts.data(), (uint16) N));
+		}
 		void SaveBootstrapContacts(std::vector<NodeAddress> &out) const;
+		// Bytes taken by the table, the bucket array included
+		std::size_t GetFootprint() const;
+
+		// Binary snapshot of the buckets: bounds, ids, addresses and last_seen
+		// of the contacts. It is in the host byte order, for a restart of the
+		// node on the same machine.
+		bool SaveSnapshot(const std::string &filename) const;
+		// Replays the splits and the contacts of the snapshot into the empty
+		// table, the loaded contacts are appended to out_contacts.
+		// False (and the table is left empty) if the snapshot does not fit it.
+		bool LoadSnapshot(const std::string &filename, std::vector<NodeInfo> &out_contacts);
 
 	protected:
-		class CKbucketEntry : 
-			public CKbucket, 
-			public boost::intrusive::set_base_hook<> 
-		{
-		public:
-			CKbucketEntry(const NodeID &low_bound, const NodeID &high_bound) :
-				CKbucket(low_bound, high_bound) {}
-
-			bool operator <(const CKbucketEntry &o) const {
-				return GetHighBound() < o.GetHighBound();
-			}
-		};
-
-		struct Comp {
-			bool operator()(const CKbucketEntry &b1, const NodeID &bi2) const {
-				return b1.GetHighBound() < bi2;
-			}
-			bool operator()(const NodeID &bi1, const CKbucketEntry &b2) const {
-				return bi1 < b2.GetHighBound();
-			}
-		};
-
-		typedef boost::intrusive::set<CKbucketEntry> Buckets;
+		typedef CKbucketT<Bits> CKbucket;
+		typedef std::vector<CKbucket> Buckets;
+		typedef typename Buckets::size_type BucketIndex;
 
+		// All the buckets in one array. Every split of the holder bucket adds
+		// hld_br_buck_count holder brother buckets, level i of the table is
+		// buckets[i*hld_br_buck_count ...], the holder bucket is the last one.
 		Buckets buckets;
-		CKbucketEntry *holder_bucket, *holder_brother_bucket[hld_br_buck_count];
 		NodeID holder_id;
 
+		uint16 GetDepth() const {
+			return (uint16) ((buckets.size() - 1) / hld_br_buck_count);
+		}
+
+		BucketIndex GetHolderIndex() const {
+			return buckets.size() - 1;
+		}
+
+		// Bucket covering the id, level is the split level of the bucket
+		// (GetDepth() for the holder bucket)
+		BucketIndex FindBucket(const NodeID &id, uint16 &level) const;
+		BucketIndex FindBucket(const NodeID &id) const {
+			uint16 level;
+			return FindBucket(id, level);
+		}
+		void SplitHolderBucket();
+		// AddContact into the found bucket, FULL for the full holder bucket
+		RoutingTableErrorCode AddToBucket(BucketIndex ind, uint16 level, const NodeInfo &info, bool &is_close_to_holder);
+
 		bool IsCloseToHolder(const NodeID &id) const;
+
+		// Range of the K contacts closest to the holder, cached by IsCloseToHolder.
+		// They come from the levels from holder_range_level down to the holder
+		// bucket, a change above it can not touch them
+		mutable bool holder_range_valid;
+		mutable NodeID holder_range_min, holder_range_max;
+		mutable uint16 holder_range_level;
+		// A contact of the bucket of the level was added or removed
+		void ContactsChanged(uint16 level);
+
+		// Append the contacts of the bucket to out[count ...],
+		// true when they reach capacity (the closest ones are kept)
+		static bool TakeBucket(const CKbucket &bucket, const NodeID &id,
+			NodeInfo *out, uint16 &count, uint16 capacity);
+		// The same for the brother buckets of the level closer to the id than
+		// the holder group (before_holder_group) or farther than it
+		bool TakeBrotherBuckets(uint16 level, const NodeID &id, bool before_holder_group,
+			NodeInfo *out, uint16 &count, uint16 capacity) const;
 	};
 
+	typedef CRoutingTableT<NODE_ID_LENGTH_BITS> CRoutingTable;
+
 }
 
 #endif // DHT_ROUTING_TABLE_H
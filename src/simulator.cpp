@@ -1,6 +1,7 @@
 #include "simulator.h"
 #include "types.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include <boost/bind.hpp>
@@ -18,7 +19,8 @@
 
 #if 0
 #define IMPLEMENT_RPC_METHOD(cl, name)														\
-	void cl::Send##name(const name &r) {													\
+	template <uint16 Bits>																	\
+	void cl<Bits>::Send##name(const name &r) {												\
 		name##_counter++;																	\
 		if (r.to == r.from) {																\
 			Do##name(r); /* loopback	*/											\
@@ -26,11 +28,12 @@
 		bool is_not_lost = (float) rand() / RAND_MAX > packet_loss;							\
 		if (is_not_lost) {																	\
 			uint64 delay = network_delay + network_delay_delta * rand() / RAND_MAX;			\
-			scheduler->AddJob_(delay, boost::bind(&cl::Do##name, this, r), this); \
+			scheduler->AddJob_(delay, boost::bind(&cl<Bits>::Do##name, this, r), this); \
 		}																					\
 	}																						\
-	void cl::Do##name(name r) {															\
-		INode *node = GetNode(r.to);														\
+	template <uint16 Bits>																	\
+	void cl<Bits>::Do##name(name r) {														\
+		INodeT<Bits> *node = GetNode(r.to);													\
 		if (node) {																			\
 			node->On##name(r);																\
 		}																					\
@@ -38,7 +41,8 @@
 #else
 
 #define IMPLEMENT_RPC_METHOD(cl, name)														\
-	void cl::Send##name(const name &r) {													\
+	template <uint16 Bits>																	\
+	void cl<Bits>::Send##name(const name &r) {												\
 		name##_counter++;																	\
 		if (r.to == r.from) {																\
 			Do##name(new name(r)); /* loopback	*/											\
@@ -46,11 +50,12 @@
 		bool is_not_lost = (float) rand() / RAND_MAX >= packet_loss;						\
 		if (is_not_lost) {																	\
 			uint64 delay = network_delay + network_delay_delta * rand() / RAND_MAX;			\
-			scheduler->AddJob_(delay, boost::bind(&cl::Do##name, this, new name(r)), this); \
+			scheduler->AddJob_(delay, boost::bind(&cl<Bits>::Do##name, this, new name(r)), this); \
 		}																					\
 	}																						\
-	void cl::Do##name(name *r) {															\
-		INode *node = GetNode(r->to);														\
+	template <uint16 Bits>																	\
+	void cl<Bits>::Do##name(name *r) {														\
+		INodeT<Bits> *node = GetNode(r->to);													\
 		if (node) {																			\
 			node->On##name(*r);																\
 		}																					\
@@ -65,75 +70,97 @@ namespace dhtpp {
 	const uint64 flush_stats_interval = 60*1000;
 	static boost::mt19937 gen;
 
-	void CalculateDigest(uint8 *out, const uint8 *in, uint32 len) {
-		CSHA1 sha;
-		sha.Update(in, len);
-		sha.Final();
-		sha.GetHash(out);
+	// SHA-1 gives 20 bytes, wider ids are filled by the next blocks,
+	// the i-th of them is SHA-1 of i followed by the input
+	template <uint16 Bits>
+	void CalculateDigest(NodeIDT<Bits> &out, const uint8 *in, uint32 len) {
+		const uint32 sha_len = 20;
+		uint8 hash[sha_len];
+		for (uint32 block = 0; block * sha_len < NodeIDT<Bits>::length_bytes; ++block) {
+			CSHA1 sha;
+			if (block) {
+				uint8 n = (uint8) block;
+				sha.Update(&n, 1);
+			}
+			sha.Update(in, len);
+			sha.Final();
+			sha.GetHash(hash);
+			uint32 offset = block * sha_len;
+			memcpy(out.id + offset, hash, std::min(sha_len, NodeIDT<Bits>::length_bytes - offset));
+		}
 	}
 
-	CTransport::CTransport(CJobScheduler *sched) {
+	template <uint16 Bits>
+	CTransportT<Bits>::CTransportT(CJobScheduler *sched) {
 		scheduler = sched;
 	}
 
-	CTransport::~CTransport() {
+	template <uint16 Bits>
+	CTransportT<Bits>::~CTransportT() {
 		std::string filename = boost::lexical_cast<std::string>(time(NULL));
 		filename += "store_dmp.txt";
 		std::ofstream out(filename.c_str());
 		if (!out)
 			return;
 
-		Nodes::iterator it = nodes.begin();
+		typename Nodes::iterator it = nodes.begin();
 		for (; it != nodes.end(); ++it) {
 			it->second->SaveStoreTo(out);
 		}
 	}
 
-	bool CTransport::AddNode(CKadNode *node) {
+	template <uint16 Bits>
+	bool CTransportT<Bits>::AddNode(CKadNode *node) {
 		return nodes.insert(std::make_pair((NodeAddress)node->GetNodeInfo(), node)).second;
 	}
 
-	bool CTransport::RemoveNode(CKadNode *node) {
+	template <uint16 Bits>
+	bool CTransportT<Bits>::RemoveNode(CKadNode *node) {
 		return nodes.erase(node->GetNodeInfo()) > 0;
 	}
 
-	IMPLEMENT_RPC_METHOD(CTransport, PingRequest)
-	IMPLEMENT_RPC_METHOD(CTransport, StoreRequest)
-	IMPLEMENT_RPC_METHOD(CTransport, FindNodeRequest)
-	IMPLEMENT_RPC_METHOD(CTransport, FindValueRequest)
+	IMPLEMENT_RPC_METHOD(CTransportT, PingRequest)
+	IMPLEMENT_RPC_METHOD(CTransportT, StoreRequest)
+	IMPLEMENT_RPC_METHOD(CTransportT, FindNodeRequest)
+	IMPLEMENT_RPC_METHOD(CTransportT, FindValueRequest)
 
-	IMPLEMENT_RPC_METHOD(CTransport, PingResponse)
-	IMPLEMENT_RPC_METHOD(CTransport, StoreResponse)
-	IMPLEMENT_RPC_METHOD(CTransport, FindNodeResponse)
-	IMPLEMENT_RPC_METHOD(CTransport, FindValueResponse)
+	IMPLEMENT_RPC_METHOD(CTransportT, PingResponse)
+	IMPLEMENT_RPC_METHOD(CTransportT, StoreResponse)
+	IMPLEMENT_RPC_METHOD(CTransportT, FindNodeResponse)
+	IMPLEMENT_RPC_METHOD(CTransportT, FindValueResponse)
 
 #if DOWNLIST_OPTIMIZATION
-	IMPLEMENT_RPC_METHOD(CTransport, DownlistRequest)
-	IMPLEMENT_RPC_METHOD(CTransport, DownlistResponse)
+	IMPLEMENT_RPC_METHOD(CTransportT, DownlistRequest)
+	IMPLEMENT_RPC_METHOD(CTransportT, DownlistResponse)
 #else
 	// Empty
-	void CTransport::SendDownlistRequest(const DownlistRequest &req) {}
-	void CTransport::SendDownlistResponse(const DownlistResponse &resp) {}
+	template <uint16 Bits>
+	void CTransportT<Bits>::SendDownlistRequest(const DownlistRequest &req) {}
+	template <uint16 Bits>
+	void CTransportT<Bits>::SendDownlistResponse(const DownlistResponse &resp) {}
 #endif
 
-	CKadNode *CTransport::GetNode(const NodeAddress &addr) {
-		Nodes::iterator it = nodes.find(addr);
+	template <uint16 Bits>
+	typename CTransportT<Bits>::CKadNode *CTransportT<Bits>::GetNode(const NodeAddress &addr) {
+		typename Nodes::iterator it = nodes.find(addr);
 		if (it == nodes.end())
 			return NULL;
 		return it->second;
 	}
 
-	CKadNode *CTransport::GetRandomNode() {
-		Nodes::size_type count = nodes.size();
+	template <uint16 Bits>
+	typename CTransportT<Bits>::CKadNode *CTransportT<Bits>::GetRandomNode() {
+		typename Nodes::size_type count = nodes.size();
 		if (!count)
 			return NULL;
-		Nodes::size_type pos = rand() * (count - 1) / RAND_MAX;
-		Nodes::iterator it = nodes.begin();
+		typename Nodes::size_type pos = rand() * (count - 1) / RAND_MAX;
+		typename Nodes::iterator it = nodes.begin();
 		std::advance(it, pos);
 		return it->second;
 	}
 
-	CSimulator::CSimulator(int nodesN, CStats *st) {
+	template <uint16 Bits>
+	CSimulatorT<Bits>::CSimulatorT(int nodesN, CStats *st) {
 		transport = new CTransport(&scheduler);
 		stats = st;
 		values_counter = values_total = nodesN * values_per_node;
@@ -145,7 +172,7 @@ namespace dhtpp {
 		info.ip = -1;
 		//info.port = 5555;
 		std::string ip_str = std::string("node") + boost::lexical_cast<std::string>(info.ip);
-		CalculateDigest(info.id.id, (const uint8 *)ip_str.c_str(), ip_str.size());
+		CalculateDigest(info.id, (const uint8 *)ip_str.c_str(), ip_str.size());
 		supernode = new CKadNode(info, &scheduler, transport);
 		active_nodes.insert(supernode);
 		transport->AddNode(supernode);
@@ -158,7 +185,7 @@ namespace dhtpp {
 			nd->bootstrap_contacts.push_back(supernode->GetNodeInfo());
 			nd->info.ip = "node" + boost::lexical_cast<std::string>(i);
 			nd->info.port = 5555;
-			sha.CalculateDigest(nd->info.id.id, (const byte *)nd->info.ip.c_str(), nd->info.ip.size());
+			sha.CalculateDigest(nd->info.id, (const byte *)nd->info.ip.c_str(), nd->info.ip.size());
 			ActivateNode(nd);
 		}
 
@@ -168,9 +195,9 @@ namespace dhtpp {
 			nd->bootstrap_contacts.push_back(supernode->GetNodeInfo());
 			nd->info.ip = "node" + boost::lexical_cast<std::string>(i);
 			nd->info.port = 5555;
-			sha.CalculateDigest(nd->info.id.id, (const byte *)nd->info.ip.c_str(), nd->info.ip.size());
+			sha.CalculateDigest(nd->info.id, (const byte *)nd->info.ip.c_str(), nd->info.ip.size());
 			scheduler.AddJob_(GenerateRandomOffTime(),
-				boost::bind(&CSimulator::ActivateNode, this, nd), nd);
+				boost::bind(&CSimulatorT::ActivateNode, this, nd), nd);
 		}
 
 #else
@@ -182,36 +209,46 @@ namespace dhtpp {
 			nd->info.ip = i;
 			//nd->info.port = 5555;
 			std::string ip_str = std::string("node") + boost::lexical_cast<std::string>(nd->info.ip);
-			CalculateDigest(nd->info.id.id, (const uint8 *)ip_str.c_str(), ip_str.size());
-			scheduler.AddJob_(t, boost::bind(&CSimulator::ActivateNode, this, nd), nd);
+			CalculateDigest(nd->info.id, (const uint8 *)ip_str.c_str(), ip_str.size());
+			scheduler.AddJob_(t, boost::bind(&CSimulatorT::ActivateNode, this, nd), nd);
 		}
 #endif
 	}
 
-	CSimulator::~CSimulator() {
+	template <uint16 Bits>
+	CSimulatorT<Bits>::~CSimulatorT() {
 		delete transport;
 		delete random_lib;
 
-		std::set<CKadNode *>::iterator ait = active_nodes.begin();
+		typename std::set<CKadNode *>::iterator ait = active_nodes.begin();
 		for (; ait != active_nodes.end(); ++ait) {
 			delete *ait;
 		}
 
-		std::set<InactiveNode *>::iterator iit = inactive_nodes.begin();
+		typename std::set<InactiveNode *>::iterator iit = inactive_nodes.begin();
 		for (; iit != inactive_nodes.end(); ++iit) {
 			delete *iit;
 		}
 	}
 
-	void CSimulator::ActivateNode(InactiveNode *nd) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::ActivateNode(InactiveNode *nd) {
 		CKadNode *node = new CKadNode(nd->info, &scheduler, transport);
 		if (!nd->bootstrap_contacts.size()) {
 			nd->bootstrap_contacts.push_back(supernode->GetNodeInfo());
 		}
-		node->JoinNetwork(nd->bootstrap_contacts,
-			boost::bind(&CSimulator::StartNodeLoop, this, node, boost::lambda::_1));
+		bool restored = false;
+		if (nd->snapshot.size()) {
+			restored = node->RestoreRoutingTable(nd->snapshot,
+				boost::bind(&CSimulatorT::StartNodeLoop, this, node, boost::lambda::_1));
+			remove(nd->snapshot.c_str());
+		}
+		if (!restored) {
+			node->JoinNetwork(nd->bootstrap_contacts,
+				boost::bind(&CSimulatorT::StartNodeLoop, this, node, boost::lambda::_1));
+		}
 		scheduler.AddJob_(GenerateRandomOnTime(),
-			boost::bind(&CSimulator::DeactivateNode, this, node), node);
+			boost::bind(&CSimulatorT::DeactivateNode, this, node), node);
 		if (!transport->AddNode(node)) {
 			printf("Error\n");
 		}
@@ -220,13 +257,19 @@ namespace dhtpp {
 		delete nd;
 	}
 
-	void CSimulator::DeactivateNode(CKadNode *node) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::DeactivateNode(CKadNode *node) {
 		InactiveNode *nd = new InactiveNode;
 		node->SaveBootstrapContacts(nd->bootstrap_contacts);
 		nd->info = node->GetNodeInfo();
+#if RT_SNAPSHOT_RESTART
+		nd->snapshot = "rt_" + boost::lexical_cast<std::string>(nd->info.ip) + ".snapshot";
+		if (!node->SaveRoutingTable(nd->snapshot))
+			nd->snapshot.clear();
+#endif
 		scheduler.CancelJobsByOwner(node);
 		scheduler.AddJob_(GenerateRandomOffTime(),
-			boost::bind(&CSimulator::ActivateNode, this, nd), nd);
+			boost::bind(&CSimulatorT::ActivateNode, this, nd), nd);
 		transport->RemoveNode(node);
 
 		if (node->IsJoined()) {
@@ -243,16 +286,33 @@ namespace dhtpp {
 			if (find_value_hist.count.size()) {
 				stats->InformAboutFindValueReqCountHist(find_value_hist);
 			};
+
+			CStats::FindReqsCountHist find_parallelism_hist;
+			find_parallelism_hist.t = GetTimerInstance()->GetCurrentTime();
+			find_parallelism_hist.count = node->GetFindParallelismStats();
+			if (find_parallelism_hist.count.size()) {
+				stats->InformAboutFindParallelismHist(find_parallelism_hist);
+			};
+
+			CStats::FindReqsCountHist rpc_timeout_hist;
+			rpc_timeout_hist.t = GetTimerInstance()->GetCurrentTime();
+			rpc_timeout_hist.count = node->GetRpcTimeoutStats();
+			if (rpc_timeout_hist.count.size()) {
+				stats->InformAboutRpcTimeoutHist(rpc_timeout_hist);
+			};
 		}
 
 		stats->InformAboutStoreToFirstNodeCount(node->GetStoreToFirstNodeCount());
+		stats->InformAboutShortlistPrunedCount(node->GetShortlistPrunedCount());
+		stats->InformAboutFindRequestsCount(node->GetFindRequestsCount(), node->GetHedgedFindRequestsCount());
 
 		//active_nodes.erase(node);
 		//inactive_nodes.insert(nd);
 		delete node;
 	}
 
-	void CSimulator::StartNodeLoop(CKadNode *node, CKadNode::ErrorCode code) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::StartNodeLoop(CKadNode *node, typename CKadNode::ErrorCode code) {
 		if (code == CKadNode::FAILED) {
 			printf("node not joined\n");
 			return;
@@ -262,45 +322,50 @@ namespace dhtpp {
 		for (;values_counter > 0 && i < values_per_node; ++i, --values_counter) {
 			std::string value = "v" + boost::lexical_cast<std::string>(values_counter);
 			NodeID key;
-			CalculateDigest(key.id, (const uint8 *) value.c_str(), value.size());
+			CalculateDigest(key, (const uint8 *) value.c_str(), value.size());
 			node->Store(key, value, expiration_time, 
-				boost::bind(&CSimulator::StoreCallback, this,
+				boost::bind(&CSimulatorT::StoreCallback, this,
 				boost::lambda::_1,
 				boost::lambda::_2,
 				boost::lambda::_3));
 		}
 
 		scheduler.AddJob_(check_value_time_interval, 
-			boost::bind(&CSimulator::CheckRandomValue, this, node), node);
+			boost::bind(&CSimulatorT::CheckRandomValue, this, node), node);
 	}
 
-	uint64 CSimulator::GenerateRandomOnTime() {
+	template <uint16 Bits>
+	uint64 CSimulatorT<Bits>::GenerateRandomOnTime() {
 		return (uint64) (avg_on_time - avg_on_time_delta + 2*((double)rand()/RAND_MAX*avg_on_time_delta));
 	}
 
-	uint64 CSimulator::GenerateRandomOffTime() {
+	template <uint16 Bits>
+	uint64 CSimulatorT<Bits>::GenerateRandomOffTime() {
 		return (uint64) (avg_off_time - avg_off_time_delta + 2*((double)rand()/RAND_MAX*avg_off_time_delta));
 	}
 
-	void CSimulator::Run(uint64 period) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::Run(uint64 period) {
 		scheduler.AddJob_(period, boost::bind(&CJobScheduler::Stop, &scheduler), &scheduler);
-		scheduler.AddJob_(print_time_interval, boost::bind(&CSimulator::PrintTime, this), this);
-		scheduler.AddJob_(begin_stats, boost::bind(&CSimulator::CheckRandomNode, this), this);
-		scheduler.AddJob_(0, boost::bind(&CSimulator::SaveRpcCounts, this), this);
-		scheduler.AddJob_(0, boost::bind(&CSimulator::FlushStats, this), this);
+		scheduler.AddJob_(print_time_interval, boost::bind(&CSimulatorT::PrintTime, this), this);
+		scheduler.AddJob_(begin_stats, boost::bind(&CSimulatorT::CheckRandomNode, this), this);
+		scheduler.AddJob_(0, boost::bind(&CSimulatorT::SaveRpcCounts, this), this);
+		scheduler.AddJob_(0, boost::bind(&CSimulatorT::FlushStats, this), this);
 		scheduler.Run();
 	}
 
-	void CSimulator::PrintTime() {
-		scheduler.AddJob_(print_time_interval, boost::bind(&CSimulator::PrintTime, this), this);
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::PrintTime() {
+		scheduler.AddJob_(print_time_interval, boost::bind(&CSimulatorT::PrintTime, this), this);
 		printf("time = %lld, jobs = %lld, done = %lld\n", 
 			GetTimerInstance()->GetCurrentTime(),
 			scheduler.GetJobsCount(), 
 			scheduler.JobsDone());
 	}
 
-	void CSimulator::CheckRandomNode() {
-		scheduler.AddJob_(check_node_time_interval, boost::bind(&CSimulator::CheckRandomNode, this), this);
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::CheckRandomNode() {
+		scheduler.AddJob_(check_node_time_interval, boost::bind(&CSimulatorT::CheckRandomNode, this), this);
 		CKadNode *node = transport->GetRandomNode();
 		if (!node)
 			return;
@@ -317,7 +382,7 @@ namespace dhtpp {
 		std::vector<NodeInfo> closest;
 		node->GetLocalCloseNodes(node->GetNodeInfo().id, closest);
 		int closest_active = 0;
-		for (std::vector<NodeInfo>::size_type i = 0; i < closest.size(); ++i) {
+		for (typename std::vector<NodeInfo>::size_type i = 0; i < closest.size(); ++i) {
 			if (transport->GetNode(closest[i])) {
 				++closest_active;
 			}
@@ -331,8 +396,9 @@ namespace dhtpp {
 		stats->InformAboutNode(info);
 	}
 
-	void CSimulator::SaveRpcCounts() {
-		scheduler.AddJob_(print_rpc_counts_interval, boost::bind(&CSimulator::SaveRpcCounts, this), this);
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::SaveRpcCounts() {
+		scheduler.AddJob_(print_rpc_counts_interval, boost::bind(&CSimulatorT::SaveRpcCounts, this), this);
 		CStats::RpcCounts counts;
 		counts.t = GetTimerInstance()->GetCurrentTime();
 		counts.ping_reqs = transport->PingRequest_counter;
@@ -348,9 +414,10 @@ namespace dhtpp {
 		stats->InformAboutRpcCounts(counts);
 	}
 
-	void CSimulator::CheckRandomValue(CKadNode *node) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::CheckRandomValue(CKadNode *node) {
 		scheduler.AddJob_(check_value_time_interval, 
-			boost::bind(&CSimulator::CheckRandomValue, this, node), node);
+			boost::bind(&CSimulatorT::CheckRandomValue, this, node), node);
 
 		if (values_counter > 0)
 			return;
@@ -359,15 +426,16 @@ namespace dhtpp {
 		boost::variate_generator<boost::mt19937&, boost::uniform_int<> > rnd(gen, dist);
 		std::string value = "v" + boost::lexical_cast<std::string>(rnd());
 		NodeID key;
-		CalculateDigest(key.id, (const uint8 *) value.c_str(), value.size());
-		node->FindValue(key, boost::bind(&CSimulator::FindValueCallback, this, 
+		CalculateDigest(key, (const uint8 *) value.c_str(), value.size());
+		node->FindValue(key, boost::bind(&CSimulatorT::FindValueCallback, this, 
 			GetTimerInstance()->GetCurrentTime(),
 			boost::lambda::_1, boost::lambda::_2));
 	}
 
-	void CSimulator::FindValueCallback(uint64 start_time, CKadNode::ErrorCode code, const FindValueResponse *resp) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::FindValueCallback(uint64 start_time, typename CKadNode::ErrorCode code, const FindValueResponse *resp) {
 		uint64 finish_time = GetTimerInstance()->GetCurrentTime();
-		if (code == CKadNode::FAILED) {
+		if (code == CKadNode::FAILED || code == CKadNode::OVERLOADED) {
 			stats->InformAboutFailedFindValue(finish_time, finish_time - start_time);
 			//printf("Find value failed\n");
 		} else if (code == CKadNode::SUCCEED) {
@@ -375,14 +443,19 @@ namespace dhtpp {
 		}
 	}
 
-	void CSimulator::StoreCallback(CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance) {
-		if (code == CKadNode::FAILED) {
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::StoreCallback(typename CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance) {
+		if (code == CKadNode::FAILED || code == CKadNode::OVERLOADED) {
 			printf("Store Error\n");
 		}
 	}
 
-	void CSimulator::FlushStats() {
-		scheduler.AddJob_(flush_stats_interval, boost::bind(&CSimulator::FlushStats, this), this);
+	template <uint16 Bits>
+	void CSimulatorT<Bits>::FlushStats() {
+		scheduler.AddJob_(flush_stats_interval, boost::bind(&CSimulatorT::FlushStats, this), this);
 		stats->Flush();
 	}
-}
\ No newline at end of file
+
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CTransportT)
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CSimulatorT)
+}
@@ -6,10 +6,11 @@
 #include "kad_node.h"
 #include "stats.h"
 
-#include <map>
 #include <set>
 #include <vector>
 
+#include <boost/unordered_map.hpp>
+
 class StochasticLib2;
 
 #if 0
@@ -34,10 +35,14 @@ class StochasticLib2;
 
 namespace dhtpp {
 
-	class CTransport : public ITransport {
+	template <uint16 Bits>
+	class CTransportT : public ITransportT<Bits> {
 	public:
-		CTransport(CJobScheduler *scheduler);
-		~CTransport();
+		DECLARE_RPC_TYPES(Bits)
+		typedef CKadNodeT<Bits> CKadNode;
+
+		CTransportT(CJobScheduler *scheduler);
+		~CTransportT();
 		bool AddNode(CKadNode *node);
 		bool RemoveNode(CKadNode *node);
 
@@ -68,16 +73,22 @@ namespace dhtpp {
 		CKadNode *GetNode(const NodeAddress &addr);
 
 	private:
-		typedef std::map<NodeAddress, CKadNode *> Nodes;
+		typedef boost::unordered_map<NodeAddress, CKadNode *> Nodes;
 		Nodes nodes;
 
 		CJobScheduler *scheduler;
 	};
 
-	class CSimulator {
+	template <uint16 Bits>
+	class CSimulatorT {
 	public:
-		CSimulator(int nodesN, CStats *stats);
-		~CSimulator();
+		DECLARE_NODE_ID_TYPES(Bits)
+		DECLARE_RPC_TYPES(Bits)
+		typedef CKadNodeT<Bits> CKadNode;
+		typedef CTransportT<Bits> CTransport;
+
+		CSimulatorT(int nodesN, CStats *stats);
+		~CSimulatorT();
 		void Run(uint64 period);
 
 	protected:
@@ -91,6 +102,8 @@ namespace dhtpp {
 		struct InactiveNode {
 			NodeInfo info;
 			std::vector<NodeAddress> bootstrap_contacts;
+			// Routing table saved on the deactivation, empty if none
+			std::string snapshot;
 		};
 
 		std::set<CKadNode *> active_nodes;
@@ -98,7 +111,7 @@ namespace dhtpp {
 
 		void ActivateNode(InactiveNode *nd);
 		void DeactivateNode(CKadNode *node);
-		void StartNodeLoop(CKadNode *node, CKadNode::ErrorCode code);
+		void StartNodeLoop(CKadNode *node, typename CKadNode::ErrorCode code);
 		uint64 GenerateRandomOnTime();
 		uint64 GenerateRandomOffTime();
 
@@ -106,11 +119,14 @@ namespace dhtpp {
 		void CheckRandomNode();
 		void SaveRpcCounts();
 		void CheckRandomValue(CKadNode *node);
-		void FindValueCallback(uint64 start_time, CKadNode::ErrorCode code, const FindValueResponse *resp);
-		void StoreCallback(CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance);
+		void FindValueCallback(uint64 start_time, typename CKadNode::ErrorCode code, const FindValueResponse *resp);
+		void StoreCallback(typename CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance);
 
 		void FlushStats();
 	};
+
+	typedef CTransportT<NODE_ID_LENGTH_BITS> CTransport;
+	typedef CSimulatorT<NODE_ID_LENGTH_BITS> CSimulator;
 }
 
 #endif // DHT_SIMULATOR_H
@@ -0,0 +1,137 @@
+#ifndef DHT_SLOT_TABLE_H
+#define DHT_SLOT_TABLE_H
+
+#include "types.h"
+
+#include <boost/static_assert.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+namespace dhtpp {
+
+	// Requests in flight indexed by their rpc_id. The id is made of the slot
+	// of the request, the index of a destination within the request and the
+	// generation of the slot:
+	//   | generation | destination | slot |
+	// A response is matched with one array access. The generation changes
+	// every time a slot is freed, so a response to a finished request (or
+	// a forged id) finds another generation and is dropped.
+	// The split of the bits is up to the kind of the requests: how many of
+	// them can be in flight and how many destinations each one has.
+	// The last slot is never used, so invalid_id matches no request.
+	template <typename T, uint16 SlotBits, uint16 DestBits>
+	class CSlotTable {
+	public:
+		enum {
+			slot_bits = SlotBits,
+			dest_bits = DestBits,
+			generation_bits = 32 - slot_bits - dest_bits,
+			max_slots = 1 << slot_bits,
+			max_dests = 1 << dest_bits,
+			invalid_id = 0xffffffff
+		};
+
+		BOOST_STATIC_ASSERT(generation_bits >= 8);
+
+		CSlotTable() {
+			free_head = none;
+			count = 0;
+		}
+
+		// The id of the new request, with the destination 0.
+		// invalid_id if max_slots - 1 requests are in flight already.
+		rpc_id Add(T *value) {
+			uint32 slot = free_head;
+			if (slot == none) {
+				if (slots.size() == max_slots - 1)
+					return invalid_id;
+				slot = (uint32) slots.size();
+				slots.push_back(Slot());
+				slots.back().generation = 0;
+			} else {
+				free_head = slots[slot].next_free;
+			}
+			slots[slot].value = value;
+			++count;
+			return MakeId(slot, 0, slots[slot].generation);
+		}
+
+		// NULL if the request is finished, whatever the destination
+		T *Get(rpc_id id) const {
+			uint32 slot = GetSlot(id);
+			if (slot >= slots.size() || slots[slot].generation != GetGeneration(id))
+				return NULL;
+			return slots[slot].value;
+		}
+
+		void Remove(rpc_id id) {
+			uint32 slot = GetSlot(id);
+			assert(slot < slots.size() && slots[slot].generation == GetGeneration(id));
+			slots[slot].value = NULL;
+			slots[slot].generation = (slots[slot].generation + 1) & ((1 << generation_bits) - 1);
+			slots[slot].next_free = free_head;
+			free_head = slot;
+			--count;
+		}
+
+		uint32 Size() const {
+			return count;
+		}
+
+		// For walking all the requests: the value in the slot, NULL if it is free
+		uint32 SlotsNumber() const {
+			return (uint32) slots.size();
+		}
+		T *GetBySlot(uint32 slot) const {
+			return slots[slot].value;
+		}
+
+		// The n-th id of the reserved slot, for a request answered without
+		// being sent: no request has it and no response matches it.
+		// It is never invalid_id.
+		static rpc_id LocalId(uint32 n) {
+			return MakeId(max_slots - 1, 0, n % ((1 << generation_bits) - 1));
+		}
+
+		static rpc_id WithDest(rpc_id id, uint16 dest) {
+			assert(dest < (uint16) max_dests);
+			return MakeId(GetSlot(id), dest, GetGeneration(id));
+		}
+		static uint16 GetDest(rpc_id id) {
+			return (uint16) ((id >> slot_bits) & (max_dests - 1));
+		}
+
+	private:
+		enum {
+			none = 0xffffffff
+		};
+
+		struct Slot {
+			T *value;
+			uint32 generation;
+			// The chain of the free slots, the last freed is the head
+			uint32 next_free;
+		};
+
+		std::vector<Slot> slots;
+		uint32 free_head;
+		uint32 count;
+
+		static rpc_id MakeId(uint32 slot, uint16 dest, uint32 generation) {
+			return (generation << (slot_bits + dest_bits)) | ((rpc_id) dest << slot_bits) | slot;
+		}
+		static uint32 GetSlot(rpc_id id) {
+			return id & (max_slots - 1);
+		}
+		static uint32 GetGeneration(rpc_id id) {
+			return id >> (slot_bits + dest_bits);
+		}
+
+		CSlotTable(const CSlotTable &);
+		CSlotTable &operator =(const CSlotTable &);
+	};
+}
+
+#endif // DHT_SLOT_TABLE_H
@@ -0,0 +1,260 @@
+#ifndef DHT_SMALL_FUNCTION_H
+#define DHT_SMALL_FUNCTION_H
+
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+namespace dhtpp {
+
+	// Room for a member function pointer and a few arguments, what
+	// boost::bind makes of the callbacks and the jobs of the project
+	enum {
+		small_function_capacity = 64
+	};
+
+	// Storage and life of the callable of a CSmallFunction, apart from the call.
+	// The callable is kept inline if it fits in Capacity bytes, on the heap
+	// otherwise, so copying a small one never allocates.
+	template <std::size_t Capacity>
+	class CSmallFunctionBase {
+	public:
+		bool empty() const {
+			return !manager;
+		}
+
+	protected:
+		enum Operation {
+			CLONE,
+			DESTROY
+		};
+		typedef void (*Manager)(Operation op, const CSmallFunctionBase &from, CSmallFunctionBase &to);
+
+		CSmallFunctionBase() {
+			manager = NULL;
+		}
+
+		CSmallFunctionBase(const CSmallFunctionBase &o) {
+			manager = NULL;
+			Assign(o);
+		}
+
+		~CSmallFunctionBase() {
+			Clear();
+		}
+
+		void Assign(const CSmallFunctionBase &o) {
+			if (this == &o)
+				return;
+			Clear();
+			if (o.manager) {
+				o.manager(CLONE, o, *this);
+				manager = o.manager;
+			}
+		}
+
+		template <typename F>
+		void Init(const F &f) {
+			if (IsInline<F>())
+				new (&storage) F(f);
+			else heap = new F(f);
+			manager = &Manage<F>;
+		}
+
+		template <typename F>
+		F *Get() const {
+			if (IsInline<F>())
+				return reinterpret_cast<F *>(const_cast<Storage *>(&storage));
+			return static_cast<F *>(heap);
+		}
+
+	private:
+		typedef typename boost::aligned_storage<Capacity>::type Storage;
+
+		union {
+			Storage storage;
+			void *heap;
+		};
+		Manager manager;
+
+		template <typename F>
+		static bool IsInline() {
+			return sizeof(F) <= Capacity && boost::alignment_of<Storage>::value % boost::alignment_of<F>::value == 0;
+		}
+
+		template <typename F>
+		static void Manage(Operation op, const CSmallFunctionBase &from, CSmallFunctionBase &to) {
+			if (op == CLONE) {
+				if (IsInline<F>())
+					new (&to.storage) F(*from.Get<F>());
+				else to.heap = new F(*from.Get<F>());
+			} else {
+				if (IsInline<F>())
+					to.Get<F>()->~F();
+				else delete to.Get<F>();
+			}
+		}
+
+		void Clear() {
+			if (manager) {
+				manager(DESTROY, *this, *this);
+				manager = NULL;
+			}
+		}
+	};
+
+	// Replaces boost::function for the callbacks and the jobs: the same
+	// copyable callable, but the small ones are not allocated on the heap.
+	// Takes up to 3 arguments.
+	template <typename Signature, std::size_t Capacity = small_function_capacity>
+	class CSmallFunction;
+
+	template <typename R, std::size_t Capacity>
+	class CSmallFunction<R (), Capacity> : public CSmallFunctionBase<Capacity> {
+		typedef CSmallFunctionBase<Capacity> Base;
+	public:
+		CSmallFunction() {
+			invoker = NULL;
+		}
+		template <typename F>
+		CSmallFunction(const F &f) {
+			this->Init(f);
+			invoker = &Invoke<F>;
+		}
+		CSmallFunction(const CSmallFunction &o) : Base(o) {
+			invoker = o.invoker;
+		}
+		CSmallFunction &operator =(const CSmallFunction &o) {
+			this->Assign(o);
+			invoker = o.invoker;
+			return *this;
+		}
+
+		R operator ()() const {
+			assert(invoker);
+			return invoker(*this);
+		}
+
+	private:
+		typedef R (*Invoker)(const CSmallFunction &f);
+		Invoker invoker;
+
+		template <typename F>
+		static R Invoke(const CSmallFunction &f) {
+			return (*f.template Get<F>())();
+		}
+	};
+
+	template <typename R, typename A1, std::size_t Capacity>
+	class CSmallFunction<R (A1), Capacity> : public CSmallFunctionBase<Capacity> {
+		typedef CSmallFunctionBase<Capacity> Base;
+	public:
+		CSmallFunction() {
+			invoker = NULL;
+		}
+		template <typename F>
+		CSmallFunction(const F &f) {
+			this->Init(f);
+			invoker = &Invoke<F>;
+		}
+		CSmallFunction(const CSmallFunction &o) : Base(o) {
+			invoker = o.invoker;
+		}
+		CSmallFunction &operator =(const CSmallFunction &o) {
+			this->Assign(o);
+			invoker = o.invoker;
+			return *this;
+		}
+
+		R operator ()(A1 a1) const {
+			assert(invoker);
+			return invoker(*this, a1);
+		}
+
+	private:
+		typedef R (*Invoker)(const CSmallFunction &f, A1 a1);
+		Invoker invoker;
+
+		template <typename F>
+		static R Invoke(const CSmallFunction &f, A1 a1) {
+			return (*f.template Get<F>())(a1);
+		}
+	};
+
+	template <typename R, typename A1, typename A2, std::size_t Capacity>
+	class CSmallFunction<R (A1, A2), Capacity> : public CSmallFunctionBase<Capacity> {
+		typedef CSmallFunctionBase<Capacity> Base;
+	public:
+		CSmallFunction() {
+			invoker = NULL;
+		}
+		template <typename F>
+		CSmallFunction(const F &f) {
+			this->Init(f);
+			invoker = &Invoke<F>;
+		}
+		CSmallFunction(const CSmallFunction &o) : Base(o) {
+			invoker = o.invoker;
+		}
+		CSmallFunction &operator =(const CSmallFunction &o) {
+			this->Assign(o);
+			invoker = o.invoker;
+			return *this;
+		}
+
+		R operator ()(A1 a1, A2 a2) const {
+			assert(invoker);
+			return invoker(*this, a1, a2);
+		}
+
+	private:
+		typedef R (*Invoker)(const CSmallFunction &f, A1 a1, A2 a2);
+		Invoker invoker;
+
+		template <typename F>
+		static R Invoke(const CSmallFunction &f, A1 a1, A2 a2) {
+			return (*f.template Get<F>())(a1, a2);
+		}
+	};
+
+	template <typename R, typename A1, typename A2, typename A3, std::size_t Capacity>
+	class CSmallFunction<R (A1, A2, A3), Capacity> : public CSmallFunctionBase<Capacity> {
+		typedef CSmallFunctionBase<Capacity> Base;
+	public:
+		CSmallFunction() {
+			invoker = NULL;
+		}
+		template <typename F>
+		CSmallFunction(const F &f) {
+			this->Init(f);
+			invoker = &Invoke<F>;
+		}
+		CSmallFunction(const CSmallFunction &o) : Base(o) {
+			invoker = o.invoker;
+		}
+		CSmallFunction &operator =(const CSmallFunction &o) {
+			this->Assign(o);
+			invoker = o.invoker;
+			return *this;
+		}
+
+		R operator ()(A1 a1, A2 a2, A3 a3) const {
+			assert(invoker);
+			return invoker(*this, a1, a2, a3);
+		}
+
+	private:
+		typedef R (*Invoker)(const CSmallFunction &f, A1 a1, A2 a2, A3 a3);
+		Invoker invoker;
+
+		template <typename F>
+		static R Invoke(const CSmallFunction &f, A1 a1, A2 a2, A3 a3) {
+			return (*f.template Get<F>())(a1, a2, a3);
+		}
+	};
+}
+
+#endif // DHT_SMALL_FUNCTION_H
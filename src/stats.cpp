@@ -6,10 +6,17 @@ namespace dhtpp {
 
 	CStats::CStats() {
 		store_to_first_node_count = 0;
+		shortlist_pruned_count = 0;
+		find_requests_count = 0;
+		hedged_find_requests_count = 0;
+		node_id_bits = NODE_ID_LENGTH_BITS;
 	}
 
 	CStats::~CStats() {
 		out << "store_to_first_node_count;" << store_to_first_node_count << "\n";
+		out << "shortlist_pruned_count;" << shortlist_pruned_count << "\n";
+		out << "find_requests_count;" << find_requests_count << "\n";
+		out << "hedged_find_requests_count;" << hedged_find_requests_count << "\n";
 	}
 
 	bool CStats::Open(const std::string &filename) {
@@ -18,7 +25,7 @@ namespace dhtpp {
 			return false;
 
 		out << "nodes_number;" << nodesN << "\n";
-		out << "NODE_ID_LENGTH_BYTES;" << NODE_ID_LENGTH_BYTES << "\n";
+		out << "NODE_ID_LENGTH_BITS;" << node_id_bits << "\n";
 		out << "K;" << K << "\n";
 		out << "alpha;" << alpha << "\n";
 		out << "timeout_period;" << timeout_period << "\n";
@@ -36,12 +43,25 @@ namespace dhtpp {
 		out << "values_per_node;" << values_per_node << "\n";
 		out << "min_rt_check_time_interval;" << min_rt_check_time_interval << "\n";
 		out << "republish_treshhold;" << republish_treshhold << "\n";
+		out << "shortlist_size;" << shortlist_size << "\n";
+		out << "max_alpha;" << max_alpha << "\n";
+		out << "slow_reply_time;" << slow_reply_time << "\n";
+		out << "min_rpc_timeout;" << min_rpc_timeout << "\n";
+		out << "max_rpc_timeout;" << max_rpc_timeout << "\n";
+		out << "rpc_timeout_hist_step;" << rpc_timeout_hist_step << "\n";
+		out << "hedge_percentile;" << hedge_percentile << "\n";
+		out << "hedge_min_samples;" << hedge_min_samples << "\n";
+		out << "max_pending_evictions;" << max_pending_evictions << "\n";
 
 		out << "network_delay;" << network_delay << "\n";
 		out << "network_delay_delta;" << network_delay_delta << "\n";
 		out << "packet_loss;" << packet_loss << "\n";
 		out << "FORCE_K_OPTIMIZATION;" << FORCE_K_OPTIMIZATION << "\n";
 		out << "DOWNLIST_OPTIMIZATION;" << DOWNLIST_OPTIMIZATION << "\n";
+		out << "RT_SNAPSHOT_RESTART;" << RT_SNAPSHOT_RESTART << "\n";
+		out << "ADAPTIVE_ALPHA;" << ADAPTIVE_ALPHA << "\n";
+		out << "ADAPTIVE_RPC_TIMEOUT;" << ADAPTIVE_RPC_TIMEOUT << "\n";
+		out << "HEDGED_LOOKUPS;" << HEDGED_LOOKUPS << "\n";
 
 		out << "rt_b;" << rt_b << "\n";
 		out << "rt_r;" << rt_r << "\n";
@@ -92,6 +112,26 @@ namespace dhtpp {
 		out << "\n";
 	}
 
+	void CStats::InformAboutFindParallelismHist(const FindReqsCountHist &counts) {
+		out << "find_parallelism_hist;"
+			<< counts.t << ";";
+		std::map<int, int>::const_iterator it = counts.count.begin();
+		for (;it != counts.count.end(); ++it) {
+			out << it->first << "|" << it->second << ";";
+		}
+		out << "\n";
+	}
+
+	void CStats::InformAboutRpcTimeoutHist(const FindReqsCountHist &counts) {
+		out << "rpc_timeout_hist;"
+			<< counts.t << ";";
+		std::map<int, int>::const_iterator it = counts.count.begin();
+		for (;it != counts.count.end(); ++it) {
+			out << it->first << "|" << it->second << ";";
+		}
+		out << "\n";
+	}
+
 	void CStats::InformAboutFailedFindValue(uint64 t, uint64 duration) {
 		out << "failed_find_value;" << t << ";" << duration << "\n";
 	}
@@ -103,4 +143,13 @@ namespace dhtpp {
 	void CStats::InformAboutStoreToFirstNodeCount(uint64 count) {
 		store_to_first_node_count += count;
 	}
+
+	void CStats::InformAboutShortlistPrunedCount(uint64 count) {
+		shortlist_pruned_count += count;
+	}
+
+	void CStats::InformAboutFindRequestsCount(uint64 count, uint64 hedged) {
+		find_requests_count += count;
+		hedged_find_requests_count += hedged;
+	}
 }
\ No newline at end of file
@@ -37,6 +37,9 @@ namespace dhtpp {
 		void SetNodesN(int nodes) {
 			nodesN = nodes;
 		}
+		void SetNodeIdBits(int bits) {
+			node_id_bits = bits;
+		}
 		void Flush() {
 			out.flush();
 		}
@@ -45,13 +48,24 @@ namespace dhtpp {
 
 		void InformAboutFindNodeReqCountHist(const FindReqsCountHist &hist);
 		void InformAboutFindValueReqCountHist(const FindReqsCountHist &hist);
+		// Histogram of the highest parallelism the lookups reached
+		void InformAboutFindParallelismHist(const FindReqsCountHist &hist);
+		// Histogram of the RPC timeouts, in rpc_timeout_hist_step steps
+		void InformAboutRpcTimeoutHist(const FindReqsCountHist &hist);
 		void InformAboutFailedFindValue(uint64 t, uint64 duration);
 		void InformAboutSucceedFindValue(uint64 t, uint64 duration);
 		void InformAboutStoreToFirstNodeCount(uint64 count);
+		void InformAboutShortlistPrunedCount(uint64 count);
+		// All find requests and the hedged ones among them
+		void InformAboutFindRequestsCount(uint64 count, uint64 hedged);
 
 	private:
 		int nodesN;
+		int node_id_bits;
 		uint64 store_to_first_node_count;
+		uint64 shortlist_pruned_count;
+		uint64 find_requests_count;
+		uint64 hedged_find_requests_count;
 		std::ofstream out;
 	};
 }
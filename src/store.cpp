@@ -5,13 +5,15 @@
 #include <boost/bind.hpp>
 #include <boost/lambda/lambda.hpp>
 #include <boost/math/special_functions/beta.hpp>
+#include <boost/tuple/tuple.hpp>
 
 #include <algorithm>
 #include <stdlib.h>
 
 namespace dhtpp {
 
-	CStore::CStore(CKadNode *node_, CJobScheduler *scheduler_) {
+	template <uint16 Bits>
+	CStoreT<Bits>::CStoreT(CKadNode *node_, CJobScheduler *scheduler_) {
 		node = node_;
 		scheduler = scheduler_;
 		removed_contacts = 0;
@@ -19,8 +21,9 @@ namespace dhtpp {
 		random_rep_time_delta_time = 0;
 	}
 
-	CStore::~CStore() {
-		Store::iterator it = store.begin();
+	template <uint16 Bits>
+	CStoreT<Bits>::~CStoreT() {
+		typename Store::iterator it = store.begin();
 		while (it != store.end()) {
 			PItem item = it->second;
 			scheduler->CancelJobsByOwner(item.get());
@@ -28,10 +31,10 @@ namespace dhtpp {
 		}
 	}
 
-	void CStore::StoreItem(const NodeID &key, const std::string &value, uint64 time_to_live) {
-		Store::iterator it1, it2;
-		it1 = store.lower_bound(key);
-		it2 = store.upper_bound(key);
+	template <uint16 Bits>
+	void CStoreT<Bits>::StoreItem(const NodeID &key, const std::string &value, uint64 time_to_live) {
+		typename Store::iterator it1, it2;
+		boost::tie(it1, it2) = store.equal_range(key);
 		PItem item;
 		uint64 cur_time = GetTimerInstance()->GetCurrentTime();
 		for (; it1 != it2; ++it1) {
@@ -51,72 +54,90 @@ namespace dhtpp {
 		}
 		item->max_distance_setted = false;
 		scheduler->AddJob_(GetRandomRepublishTime(), 
-			boost::bind(&CStore::RepublishItem, this, key, item), item.get());
+			boost::bind(&CStoreT::RepublishItem, this, key, item), item.get());
 		//scheduler->AddJob_(item->expiration_time - cur_time, 
-		//	boost::bind(&CStore::DeleteItem, this, key, item), item.get());
+		//	boost::bind(&CStoreT::DeleteItem, this, key, item), item.get());
 	}
 
-	void CStore::GetItems(const NodeID &key, std::vector<std::string> &out_values) {
-		Store::iterator it1, it2;
-		it1 = store.lower_bound(key);
-		it2 = store.upper_bound(key);
+	template <uint16 Bits>
+	void CStoreT<Bits>::GetItems(const NodeID &key, std::vector<std::string> &out_values) {
+		typename Store::iterator it1, it2;
+		boost::tie(it1, it2) = store.equal_range(key);
 		for (; it1 != it2; ++it1) {
 			out_values.push_back(it1->second->value);
 		}
 	}
 
-	void CStore::OnNewContact(const NodeInfo &contact, bool is_close_to_holder) {
+	template <uint16 Bits>
+	void CStoreT<Bits>::OnNewContact(const NodeInfo &contact, bool is_close_to_holder) {
+		OnNewContacts(&contact, &is_close_to_holder, 1);
+	}
+
+	template <uint16 Bits>
+	void CStoreT<Bits>::OnNewContacts(const NodeInfo *contacts, const bool *is_close_to_holder, uint16 count) {
+		if (!count)
+			return;
+		bool any_close = false;
+		for (uint16 i = 0; i < count; ++i) {
+			any_close = any_close || is_close_to_holder[i];
+		}
+		any_close = any_close && node->IsJoined();
+
 		uint64 cur_time = GetTimerInstance()->GetCurrentTime();
-		Store::iterator it;
+		typename Store::iterator it;
 		for (it = store.begin(); it != store.end(); ++it) {
 			PItem item = it->second;
-			NodeID distance = it->first ^ contact.id;
-			if ((item->max_distance_setted && distance < item->max_distance) 
-				|| (node->IsJoined() && is_close_to_holder && node->IdInHolderRange(it->first)))
-			{
-				node->StoreToNode(contact, it->first, item->value, item->expiration_time - cur_time,
-					boost::bind(&CStore::StoreCallback, this, item,
-					boost::lambda::_1, boost::lambda::_2, boost::lambda::_3));
+			bool in_holder_range = any_close && node->IdInHolderRange(it->first);
+			for (uint16 i = 0; i < count; ++i) {
+				if ((item->max_distance_setted && IsDistanceLess(it->first, contacts[i].id, item->max_distance)) 
+					|| (is_close_to_holder[i] && in_holder_range))
+				{
+					node->StoreToNode(contacts[i], it->first, item->value, item->expiration_time - cur_time,
+						boost::bind(&CStoreT::StoreCallback, this, item,
+						boost::lambda::_1, boost::lambda::_2, boost::lambda::_3));
+				}
 			}
 		}
 	}
 
-	void CStore::OnRemoveContact(const NodeID &contact, bool is_close_to_holder) {
+	template <uint16 Bits>
+	void CStoreT<Bits>::OnRemoveContact(const NodeID &contact, bool is_close_to_holder) {
 		if (is_close_to_holder) {
 			if (++removed_contacts >= republish_treshhold) {
 				removed_contacts = 0;
 				uint64 cur_time = GetTimerInstance()->GetCurrentTime();
-				Store::iterator it;
+				typename Store::iterator it;
 				for (it = store.begin(); it != store.end(); ++it) {
 					if (node->IdInHolderRange(it->first)) {
 						PItem item = it->second;
 						scheduler->CancelJobsByOwner(item.get());
 						scheduler->AddJob_(GetRandomRepublishTimeDelta(), 
-							boost::bind(&CStore::RepublishItem, this, it->first, item), item.get());
+							boost::bind(&CStoreT::RepublishItem, this, it->first, item), item.get());
 						//scheduler->AddJob_(item->expiration_time - cur_time, 
-						//	boost::bind(&CStore::DeleteItem, this, it->first, item), item.get());
+						//	boost::bind(&CStoreT::DeleteItem, this, it->first, item), item.get());
 					}
 				}
 			}
 		}
 	}
 
-	void CStore::RepublishItem(NodeID key, PItem item) {
+	template <uint16 Bits>
+	void CStoreT<Bits>::RepublishItem(NodeID key, PItem item) {
 		uint64 cur_time = GetTimerInstance()->GetCurrentTime();
 		if (cur_time >= item->expiration_time)
 			return;
 		node->Store(key, item->value, item->expiration_time - cur_time, 
-			boost::bind(&CStore::StoreCallback, this, item,
+			boost::bind(&CStoreT::StoreCallback, this, item,
 			boost::lambda::_1, boost::lambda::_2, boost::lambda::_3));
 		scheduler->AddJob_(GetRandomRepublishTime(), 
-			boost::bind(&CStore::RepublishItem, this, key, item), item.get());
+			boost::bind(&CStoreT::RepublishItem, this, key, item), item.get());
 	}
 
-	void CStore::DeleteItem(NodeID key, PItem item) {
+	template <uint16 Bits>
+	void CStoreT<Bits>::DeleteItem(NodeID key, PItem item) {
 		scheduler->CancelJobsByOwner(item.get());
-		Store::iterator it1, it2;
-		it1 = store.lower_bound(key);
-		it2 = store.upper_bound(key);
+		typename Store::iterator it1, it2;
+		boost::tie(it1, it2) = store.equal_range(key);
 		for (; it1 != it2; ++it1) {
 			PItem t = it1->second;
 			if (t == item) {
@@ -126,14 +147,16 @@ namespace dhtpp {
 		}
 	}
 
-	void CStore::StoreCallback(PItem item, CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance) {
+	template <uint16 Bits>
+	void CStoreT<Bits>::StoreCallback(PItem item, typename CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance) {
 		if (code == CKadNode::SUCCEED) {
 			item->max_distance_setted = true;
 			item->max_distance = *max_distance;
 		}
 	}
 
-	uint64 CStore::GetRandomRepublishTime() {
+	template <uint16 Bits>
+	uint64 CStoreT<Bits>::GetRandomRepublishTime() {
 #if 0
 		return republish_time;
 #else
@@ -142,7 +165,8 @@ namespace dhtpp {
 #endif
 	}
 
-	uint64 CStore::GetRandomRepublishTimeDelta() {
+	template <uint16 Bits>
+	uint64 CStoreT<Bits>::GetRandomRepublishTimeDelta() {
 		if (random_rep_time_delta_cached &&
 			(GetTimerInstance()->GetCurrentTime() - random_rep_time_delta_time < 10000))
 		{
@@ -155,18 +179,19 @@ namespace dhtpp {
 		return random_rep_time_delta_cached = (uint64)(2*republish_time_delta*Ibeta);
 	}
 
-	void CStore::SaveStoreTo(std::ofstream &f) const {
+	template <uint16 Bits>
+	void CStoreT<Bits>::SaveStoreTo(std::ofstream &f) const {
 		if (store.empty())
 			return;
 		f << store.size() << ";";
 
-		Store::const_iterator it = store.begin();
+		typename Store::const_iterator it = store.begin();
 		for (; it != store.end(); ++it) {
 			f << it->second->value << ";";
 		}
 
 		f << "\n";
 	}
-}
-
 
+	INSTANTIATE_FOR_NODE_ID_WIDTHS(CStoreT)
+}
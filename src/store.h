@@ -6,19 +6,25 @@
 #include "kad_node.h"
 
 #include <fstream>
-#include <map>
 #include <string>
 #include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace dhtpp {
 
-	class CStore {
+	template <uint16 Bits>
+	class CStoreT {
 	public:
-		CStore(CKadNode *node, CJobScheduler *scheduler);
-		~CStore();
+		DECLARE_NODE_ID_TYPES(Bits)
+		typedef CKadNodeT<Bits> CKadNode;
+
+		CStoreT(CKadNode *node, CJobScheduler *scheduler);
+		~CStoreT();
 		void StoreItem(const NodeID &key, const std::string &value, uint64 time_to_live);
 		void GetItems(const NodeID &key, std::vector<std::string> &out_values);
 		void OnNewContact(const NodeInfo &contact, bool is_close_to_holder);
+		// The same for several contacts in one pass over the items
+		void OnNewContacts(const NodeInfo *contacts, const bool *is_close_to_holder, uint16 count);
 		void OnRemoveContact(const NodeID &contact, bool is_close_to_holder);
 		void SaveStoreTo(std::ofstream &f) const;
 
@@ -34,7 +40,7 @@ namespace dhtpp {
 			NodeID max_distance;
 		};
 		typedef boost::shared_ptr<Item> PItem;
-		typedef std::multimap<NodeID, PItem> Store;
+		typedef boost::unordered_multimap<NodeID, PItem> Store;
 		Store store;
 		CKadNode *node;
 		CJobScheduler *scheduler;
@@ -44,11 +50,13 @@ namespace dhtpp {
 		void DeleteItem(NodeID key, PItem item);
 		uint64 GetRandomRepublishTime();
 		uint64 GetRandomRepublishTimeDelta();
-		void StoreCallback(PItem item, CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance);
+		void StoreCallback(PItem item, typename CKadNode::ErrorCode code, rpc_id id, const NodeID *max_distance);
 
 		uint64 random_rep_time_delta_cached;
 		uint64 random_rep_time_delta_time;
 	};
+
+	typedef CStoreT<NODE_ID_LENGTH_BITS> CStore;
 }
 
 #endif // DHT_STORE_H
@@ -5,8 +5,13 @@
 
 namespace dhtpp {
 
-	class INode {
+	template <uint16 Bits>
+	class INodeT {
 	public:
+		DECLARE_RPC_TYPES(Bits)
+		typedef NodeInfoT<Bits> NodeInfo;
+
+		virtual ~INodeT() {}
 		virtual const NodeInfo &GetNodeInfo() const = 0;
 		virtual void OnPingRequest(const PingRequest &req) = 0;
 		virtual void OnStoreRequest(const StoreRequest &req) = 0;
@@ -21,8 +26,12 @@ namespace dhtpp {
 		virtual void OnDownlistResponse(const DownlistResponse &resp) = 0;
 	};
 
-	class ITransport {
+	template <uint16 Bits>
+	class ITransportT {
 	public:
+		DECLARE_RPC_TYPES(Bits)
+
+		virtual ~ITransportT() {}
 		virtual void SendPingRequest(const PingRequest &req) = 0;
 		virtual void SendStoreRequest(const StoreRequest &req) = 0;
 		virtual void SendFindNodeRequest(const FindNodeRequest &req) = 0;
@@ -36,6 +45,8 @@ namespace dhtpp {
 		virtual void SendDownlistResponse(const DownlistResponse &resp) = 0;
 	};
 
+	typedef INodeT<NODE_ID_LENGTH_BITS> INode;
+	typedef ITransportT<NODE_ID_LENGTH_BITS> ITransport;
 }
 
 #endif // DHT_TRANSPORT_H
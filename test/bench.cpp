@@ -0,0 +1,427 @@
+#include "../src/routing_table.h"
+#include "../src/concurrent_routing_table.h"
+#include "../src/kad_node.h"
+#include "../src/slot_table.h"
+#include "../src/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+using namespace dhtpp;
+
+// Gives access to the lookup state of CKadNode
+class CBenchNode : public CKadNode {
+public:
+	typedef CKadNode::FindRequestData FindRequestData;
+};
+
+static NodeID RandomNodeID() {
+	NodeID res;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		res.id[i] = rand() & 0xff;
+	}
+	return res;
+}
+
+static NodeInfo RandomNodeInfo() {
+	NodeInfo info;
+	info.ip = rand();
+	info.id = RandomNodeID();
+	return info;
+}
+
+// Random id sharing a random-length prefix with the id
+static NodeID RandomNodeIDNear(const NodeID &id, int max_prefix) {
+	NodeID res = RandomNodeID();
+	int prefix = rand() % max_prefix;
+	for (int i = 0; i < prefix / 8; ++i) {
+		res.id[i] = id.id[i];
+	}
+	uint8 mask = 0xff << (8 - prefix % 8);
+	res.id[prefix / 8] = (id.id[prefix / 8] & mask) | (res.id[prefix / 8] & ~mask);
+	return res;
+}
+
+static double ElapsedMs(clock_t start) {
+	return 1000.0 * (clock() - start) / CLOCKS_PER_SEC;
+}
+
+// The byte by byte comparison NodeID used before the word layout
+struct ByteWiseLess {
+	bool operator()(const NodeID &a, const NodeID &b) const {
+		for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+			if (a.id[i] < b.id[i])
+				return true;
+			if (a.id[i] > b.id[i])
+				return false;
+		}
+		return false;
+	}
+};
+
+struct WordLess {
+	bool operator()(const NodeID &a, const NodeID &b) const {
+		return a < b;
+	}
+};
+
+void benchNodeIdCompare() {
+	const int idsN = 200000;
+	std::vector<NodeID> ids;
+	for (int i = 0; i < idsN; ++i) {
+		ids.push_back(RandomNodeID());
+	}
+
+	std::vector<NodeID> v = ids;
+	clock_t start = clock();
+	std::sort(v.begin(), v.end(), ByteWiseLess());
+	double byte_wise = ElapsedMs(start);
+
+	v = ids;
+	start = clock();
+	std::sort(v.begin(), v.end(), WordLess());
+	double word_wise = ElapsedMs(start);
+
+	printf("sort %d ids: byte-wise %.1f ms, word-wise %.1f ms\n", idsN, byte_wise, word_wise);
+}
+
+// Distance comparison through two temporary NodeIDs, as the comparators did before IsCloser
+struct TemporaryDistanceLess {
+	TemporaryDistanceLess(const NodeID &target_) : target(target_) {}
+
+	bool operator()(const Contact &c1, const Contact &c2) const {
+		return (c1.GetId() ^ target) < (c2.GetId() ^ target);
+	}
+
+	NodeID target;
+};
+
+template <typename Comp>
+static double SortByDistance(const std::vector<Contact> &contacts, const NodeID &target, bool nth) {
+	const int repeatsN = 50;
+	std::vector<Contact> v;
+	double total = 0;
+	for (int i = 0; i < repeatsN; ++i) {
+		v = contacts;
+		clock_t start = clock();
+		if (nth) {
+			std::nth_element(v.begin(), v.begin() + K, v.end(), Comp(target));
+		} else {
+			std::sort(v.begin(), v.end(), Comp(target));
+		}
+		total += ElapsedMs(start);
+	}
+	return total;
+}
+
+void benchDistanceSort() {
+	const int contactsN = 10000;
+	std::vector<Contact> contacts;
+	for (int i = 0; i < contactsN; ++i) {
+		Contact c;
+		(NodeInfo &) c = RandomNodeInfo();
+		c.last_seen = i;
+		contacts.push_back(c);
+	}
+	NodeID target = RandomNodeID();
+
+	printf("sort %d contacts by distance x50: temporaries %.1f ms, fused %.1f ms\n", contactsN,
+		SortByDistance<TemporaryDistanceLess>(contacts, target, false),
+		SortByDistance<distance_comp_lt<Contact> >(contacts, target, false));
+	printf("nth_element %d contacts by distance x50: temporaries %.1f ms, fused %.1f ms\n", contactsN,
+		SortByDistance<TemporaryDistanceLess>(contacts, target, true),
+		SortByDistance<distance_comp_lt<Contact> >(contacts, target, true));
+}
+
+void benchGetClosestContacts() {
+	const int contactsN = 100000;
+	const int queriesN = 200000;
+	NodeID holder_id = RandomNodeID();
+	CRoutingTable table(holder_id);
+	bool is_close_to_holder;
+	for (int i = 0; i < contactsN; ++i) {
+		table.AddContact(RandomNodeInfo(), is_close_to_holder);
+	}
+
+	// Targets around the holder land in sparse buckets, which makes
+	// GetClosestContacts sort the buckets and the contacts by distance
+	std::vector<NodeID> targets;
+	for (int i = 0; i < queriesN; ++i) {
+		targets.push_back(RandomNodeIDNear(holder_id, 24));
+	}
+
+	std::vector<NodeInfo> out;
+	size_t total = 0;
+	clock_t start = clock();
+	for (int i = 0; i < queriesN; ++i) {
+		out.clear();
+		table.GetClosestContacts(targets[i], out);
+		total += out.size();
+	}
+	printf("GetClosestContacts: %d queries in %.1f ms (%u contacts)\n", queriesN, ElapsedMs(start), (unsigned) total);
+
+	FindNodeResponse resp;
+	total = 0;
+	start = clock();
+	for (int i = 0; i < queriesN; ++i) {
+		table.GetClosestContacts(targets[i], resp.nodes);
+		total += resp.nodes.size();
+	}
+	printf("GetClosestContacts into FindNodeResponse: %d queries in %.1f ms (%u contacts)\n", queriesN, ElapsedMs(start), (unsigned) total);
+}
+
+void benchRoutingTableFill() {
+	const int tablesN = 20;
+	const int contactsN = 20000;
+	std::vector<NodeInfo> infos;
+	for (int i = 0; i < contactsN; ++i) {
+		infos.push_back(RandomNodeInfo());
+	}
+
+	size_t added = 0, found = 0, footprint = 0;
+	clock_t start = clock();
+	for (int t = 0; t < tablesN; ++t) {
+		CRoutingTable table(RandomNodeID());
+		bool is_close_to_holder;
+		for (int i = 0; i < contactsN; ++i) {
+			if (table.AddContact(infos[i], is_close_to_holder) == SUCCEED)
+				++added;
+		}
+		Contact c;
+		for (int i = 0; i < contactsN; ++i) {
+			if (table.GetContact(infos[i].id, c))
+				++found;
+		}
+		footprint += table.GetFootprint();
+	}
+	printf("CRoutingTable fill: %d tables x %d contacts in %.1f ms (%u added, %u found), sizeof(CKbucket) = %u, %u bytes per table\n",
+		tablesN, contactsN, ElapsedMs(start), (unsigned) added, (unsigned) found, (unsigned) sizeof(CKbucket),
+		(unsigned) (footprint / tablesN));
+
+	added = found = 0;
+	start = clock();
+	for (int t = 0; t < tablesN; ++t) {
+		CRoutingTable table(RandomNodeID());
+		RoutingTableErrorCode results[K];
+		bool is_close_to_holder[K];
+		for (int i = 0; i + K <= contactsN; i += K) {
+			added += table.AddContacts(&infos[i], K, results, is_close_to_holder);
+		}
+		Contact c;
+		for (int i = 0; i < contactsN; ++i) {
+			if (table.GetContact(infos[i].id, c))
+				++found;
+		}
+	}
+	printf("CRoutingTable bulk fill: %d tables x %d contacts in %.1f ms (%u added, %u found)\n",
+		tablesN, contactsN, ElapsedMs(start), (unsigned) added, (unsigned) found);
+}
+
+// Nodes near the holder go on and off as in CSimulator. They share at most
+// 12 bits with the holder, so the holder bucket stays thin and the inserts
+// into the full deepest holder brother buckets take the ForceK path
+void benchHolderBrotherChurn() {
+	const int nodesN = 4000;
+	const int eventsN = 1000000;
+	NodeID holder_id = RandomNodeID();
+	CRoutingTable table(holder_id);
+
+	std::vector<NodeInfo> nodes;
+	std::vector<bool> online(nodesN, false);
+	for (int i = 0; i < nodesN; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		info.id = RandomNodeIDNear(holder_id, 12);
+		nodes.push_back(info);
+	}
+
+	const double on_ratio = avg_on_time / (avg_on_time + avg_off_time);
+	bool is_close_to_holder, is_promoted, promoted_close_to_holder;
+	NodeInfo promoted;
+	size_t added = 0;
+	clock_t start = clock();
+	for (int e = 0; e < eventsN; ++e) {
+		int i = rand() % nodesN;
+		bool on = (double) rand() / RAND_MAX < on_ratio;
+		if (on) {
+			if (table.AddContact(nodes[i], is_close_to_holder) == SUCCEED)
+				++added;
+		} else if (online[i]) {
+			table.RemoveContact(nodes[i].id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder);
+		}
+		online[i] = on;
+	}
+	printf("holder brother churn: %d events in %.1f ms (%u added)\n", eventsN, ElapsedMs(start), (unsigned) added);
+}
+
+void benchCandidatesInsert() {
+	typedef CBenchNode::FindRequestData FindRequestData;
+	const int lookupsN = 2000;
+	const int responsesN = 20;
+
+	FindNodeResponse::Nodes responses[responsesN];
+	for (int i = 0; i < responsesN; ++i) {
+		for (int j = 0; j < K; ++j) {
+			responses[i].push_back(RandomNodeInfo());
+		}
+	}
+
+	size_t total = 0;
+	clock_t start = clock();
+	for (int l = 0; l < lookupsN; ++l) {
+		FindRequestData data;
+		data.target = RandomNodeID();
+		for (int i = 0; i < responsesN; ++i) {
+			data.Update(responses[(i + l) % responsesN]);
+		}
+		total += data.candidates.size();
+		// the candidates go away with the arena of the lookup
+	}
+	printf("FindRequestData::Update: %d lookups in %.1f ms (%u candidates)\n", lookupsN, ElapsedMs(start), (unsigned) total);
+}
+
+// Like PingRequestData: the set lookup needs a temp one to compare with
+struct BenchRequest {
+	PingRequest req;
+	boost::function<void (int)> callback;
+};
+
+struct BenchRequestComp {
+	bool operator()(const BenchRequest *r1, const BenchRequest *r2) const {
+		return r1->req.id < r2->req.id;
+	}
+};
+
+void benchRequestDemux() {
+	const int requestsN = 1000;
+	const int responsesN = 1000000;
+
+	std::vector<BenchRequest> requests(requestsN);
+	std::set<BenchRequest *, BenchRequestComp> requests_set;
+	CSlotTable<BenchRequest, 12, 0> requests_table;
+	std::vector<rpc_id> set_ids, table_ids;
+	for (int i = 0; i < requestsN; ++i) {
+		requests[i].req.id = i;
+		requests_set.insert(&requests[i]);
+		set_ids.push_back(i);
+		table_ids.push_back(requests_table.Add(&requests[i]));
+	}
+	std::vector<int> order;
+	for (int i = 0; i < responsesN; ++i) {
+		order.push_back(rand() % requestsN);
+	}
+
+	size_t found = 0;
+	clock_t start = clock();
+	for (int i = 0; i < responsesN; ++i) {
+		BenchRequest temp;
+		temp.req.id = set_ids[order[i]];
+		found += requests_set.find(&temp) != requests_set.end();
+	}
+	printf("std::set demux: %d responses in %.1f ms (%u found)\n", responsesN, ElapsedMs(start), (unsigned) found);
+
+	found = 0;
+	start = clock();
+	for (int i = 0; i < responsesN; ++i) {
+		found += requests_table.Get(table_ids[order[i]]) != NULL;
+	}
+	printf("CSlotTable demux: %d responses in %.1f ms (%u found)\n", responsesN, ElapsedMs(start), (unsigned) found);
+}
+
+struct BenchTimeoutTarget {
+	void Timeout(int *data, int *cand) {
+	}
+};
+
+// The pattern of a lookup: every request schedules its timeout and most
+// of them are cancelled by the reply
+void benchScheduleTimeouts() {
+	const int roundsN = 100000;
+	const int pendingN = 16;
+
+	BenchTimeoutTarget target;
+	int data, cands[pendingN];
+	CJobScheduler scheduler;
+	clock_t start = clock();
+	for (int r = 0; r < roundsN; ++r) {
+		for (int i = 0; i < pendingN; ++i) {
+			scheduler.AddJob_(100 + i, boost::bind(&BenchTimeoutTarget::Timeout, &target, &data, &cands[i]), &cands[i]);
+		}
+		for (int i = 0; i < pendingN; ++i) {
+			scheduler.CancelJobsByOwner(&cands[i]);
+		}
+	}
+	printf("CJobScheduler: %d timeouts scheduled and cancelled in %.1f ms\n", roundsN * pendingN, ElapsedMs(start));
+}
+
+static void ConcurrentReads(CConcurrentRoutingTable *table, const std::vector<NodeID> *targets, int queries) {
+	CConcurrentRoutingTable::CReader reader(*table);
+	FindNodeResponse resp;
+	for (int i = 0; i < queries; ++i) {
+		reader.GetClosestContacts((*targets)[i % targets->size()], resp.nodes);
+	}
+}
+
+// Readers of the concurrent table against one writer doing a change per 100 queries.
+// Wall clock time, the threads run in parallel
+void benchConcurrentReads() {
+	const int contactsN = 20000;
+	const int queriesN = 400000;
+	NodeID holder_id = RandomNodeID();
+	CConcurrentRoutingTable table(holder_id);
+	bool is_close_to_holder, is_promoted, promoted_close_to_holder;
+	NodeInfo promoted;
+	std::vector<NodeInfo> infos;
+	for (int i = 0; i < contactsN; ++i) {
+		infos.push_back(RandomNodeInfo());
+		table.AddContact(infos[i], is_close_to_holder);
+	}
+	std::vector<NodeID> targets;
+	for (int i = 0; i < 10000; ++i) {
+		targets.push_back(RandomNodeID());
+	}
+
+	for (int readersN = 1; readersN <= 8; readersN *= 2) {
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		boost::thread_group readers;
+		for (int i = 0; i < readersN; ++i) {
+			readers.create_thread(boost::bind(&ConcurrentReads, &table, &targets, queriesN / readersN));
+		}
+		for (int i = 0; i < queriesN / 100; ++i) {
+			const NodeInfo &info = infos[rand() % contactsN];
+			if (i % 2) {
+				table.AddContact(info, is_close_to_holder);
+			} else {
+				table.RemoveContact(info.id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder);
+			}
+		}
+		readers.join_all();
+		double ms = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000.0;
+		printf("CConcurrentRoutingTable: %d readers, %d queries and %d writes in %.1f ms\n", readersN, queriesN, queriesN / 100, ms);
+	}
+}
+
+int main() {
+	srand(0);
+
+	benchNodeIdCompare();
+	benchDistanceSort();
+	benchGetClosestContacts();
+	benchRoutingTableFill();
+	benchHolderBrotherChurn();
+	benchCandidatesInsert();
+	benchRequestDemux();
+	benchScheduleTimeouts();
+	benchConcurrentReads();
+
+	return 0;
+}
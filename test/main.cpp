@@ -1,23 +1,65 @@
+#include "../src/arena.h"
+#include "../src/slot_table.h"
 #include "../src/kbucket.h"
+#include "../src/routing_table.h"
+#include "../src/concurrent_routing_table.h"
 #include "../src/simulator.h"
 #include "../src/stats.h"
 #include "../src/config.h"
 
+#include <algorithm>
 #include <cassert>
 #include <stdlib.h>
 #include <string>
 #include <stdlib.h>
 
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <crtdbg.h>
 
+#include <new>
+#include <stdexcept>
+
 using namespace dhtpp;
 
+// Heap allocations made so far, for the tests of the allocation free paths
+static unsigned long allocations_count = 0;
+
+void *operator new(std::size_t size) {
+	++allocations_count;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t size) {
+	return operator new(size);
+}
+
+void operator delete(void *p) throw() {
+	free(p);
+}
+
+void operator delete[](void *p) throw() {
+	operator delete(p);
+}
+
+// The sized forms a C++14 compiler calls instead
+void operator delete(void *p, std::size_t) throw() {
+	operator delete(p);
+}
+
+void operator delete[](void *p, std::size_t) throw() {
+	operator delete(p);
+}
+
 void testKBucket() {
 	NullNodeID null_id;
 	MaxNodeID max_id;
-	CKbucket bucket(null_id, max_id);
+	CKbucket bucket(null_id, max_id, null_id);
 
 	// bucket is empty
 	Contact temp;
@@ -57,8 +99,121 @@ void testKBucket() {
 	temp.last_seen = 1;
 	assert(bucket.AddContact(temp) == FULL);
 
+	// a full bucket still updates the contacts it has
+	temp.id.id[0] = 3;
+	temp.last_seen = 5;
+	assert(bucket.AddContact(temp) == EXISTED);
+	assert(bucket.GetContact(temp.id, temp2) == true);
+	assert(temp2.last_seen == 5);
+
 	temp.id.id[0] = 5;
 	assert(bucket.RemoveContact(temp.id) == true);
+
+	// contacts are kept in the recency order
+	CKbucket lru(null_id, max_id, null_id);
+	memset(temp.id.id, 0, sizeof(temp.id.id));
+	for (int i = 0; i < K; ++i) {
+		temp.id.id[0] = i;
+		temp.last_seen = 100;
+		assert(lru.AddContact(temp) == SUCCEED);
+	}
+	temp.id.id[0] = 0;
+	assert(lru.AddContact(temp) == EXISTED);
+	assert(lru.LastSeenContact(temp2) && temp2.id.id[0] == 1);
+	temp.id.id[0] = 1;
+	assert(lru.RemoveContact(temp.id) == true);
+	assert(lru.LastSeenContact(temp2) && temp2.id.id[0] == 2);
+	temp.id.id[0] = K - 1;
+	assert(lru.RemoveContact(temp.id) == true);
+	for (int i = 2; i < K - 1; ++i) {
+		assert(lru.LastSeenContact(temp2) && temp2.id.id[0] == i);
+		assert(lru.AddContact(temp2) == EXISTED);
+	}
+	assert(lru.LastSeenContact(temp2) && temp2.id.id[0] == 0);
+
+	// the freshest replacement takes the place of the removed contact
+	temp.id.id[0] = 1;
+	assert(lru.AddContact(temp) == SUCCEED);
+	temp.id.id[0] = K - 1;
+	assert(lru.AddContact(temp) == SUCCEED);
+	for (int i = 0; i < replacement_cache_size + 2; ++i) {
+		temp.id.id[0] = K + i;
+		assert(lru.AddContact(temp) == FULL);
+		lru.AddReplacement(temp);
+	}
+	bool is_promoted;
+	NodeInfo promoted;
+	temp.id.id[0] = K;
+	assert(lru.RemoveContact(temp.id, is_promoted, promoted) == false && !is_promoted);
+	temp.id.id[0] = 3;
+	assert(lru.RemoveContact(temp.id, is_promoted, promoted) == true && is_promoted);
+	assert(promoted.id.id[0] == K + replacement_cache_size + 1);
+	assert(lru.GetContact(promoted.id, temp2) == true);
+	assert(lru.GetContactsNumber() == K);
+}
+
+void testForceK() {
+	NullNodeID holder_id;
+	MaxNodeID max_id;
+	CKbucket bucket(holder_id, max_id, holder_id);
+
+	// the distance to the null holder is the id itself, the five farthest
+	// contacts are 10 > 9 > 8 > 7 > 6 and their recency order is 6, 10, 9, 8, 7
+	const int ids[K] = {6, 10, 9, 8, 7, 1, 2, 3, 4, 5};
+	Contact temp;
+	memset(temp.id.id, 0, sizeof(temp.id.id));
+	for (int i = 0; i < K; ++i) {
+		temp.id.id[0] = ids[i];
+		temp.last_seen = i;
+		assert(bucket.AddContact(temp) == SUCCEED);
+	}
+
+	// not closer than the closest of the five
+	NodeInfo info;
+	info.id = temp.id;
+	info.id.id[0] = 6;
+	info.id.id[1] = 1;
+	assert(bucket.AddContactForceK(info, 5) == FULL);
+
+	// weights (distance + last seen): 6 -> 4+0, 10 -> 0+1, 9 -> 1+2, 8 -> 2+3, 7 -> 3+4,
+	// so 10 is replaced
+	info.id.id[0] = 0;
+	assert(bucket.AddContactForceK(info, 5) == SUCCEED);
+	Contact c;
+	temp.id.id[0] = 10;
+	assert(!bucket.GetContact(temp.id, c));
+	for (int i = 0; i < K; ++i) {
+		temp.id.id[0] = ids[i];
+		assert(bucket.GetContact(temp.id, c) == (ids[i] != 10));
+	}
+	assert(bucket.GetContact(info.id, c));
+
+	// on equal weights the older contact goes: 9 -> 0+1, 8 -> 1+0
+	temp.id.id[0] = 9;
+	temp.last_seen = 20;
+	assert(bucket.AddContact(temp) == EXISTED);
+	info.id.id[1] = 2;
+	assert(bucket.AddContactForceK(info, 2) == SUCCEED);
+	temp.id.id[0] = 8;
+	assert(!bucket.GetContact(temp.id, c));
+	temp.id.id[0] = 9;
+	assert(bucket.GetContact(temp.id, c));
+}
+
+template <uint16 Bits>
+void testNodeIdWidth() {
+	typedef NodeIDT<Bits> NodeID;
+	typedef MaxNodeIDT<Bits> MaxNodeID;
+	typedef NullNodeIDT<Bits> NullNodeID;
+
+	NodeID id = MaxNodeID();
+	id += 1;
+	assert(id == NullNodeID());
+	assert((MaxNodeID() >> (Bits - 1)) == NullNodeID() + 1);
+	assert(NullNodeID() - (NullNodeID() + 1) == MaxNodeID());
+	assert(LeadingZeroBits(NullNodeID() + 1) == Bits - 1);
+	assert(CommonPrefixLength(NodeID(MaxNodeID()), NodeID(MaxNodeID() >> 1)) == 0);
+	assert(IsCloser(NodeID(NullNodeID() + 1), NodeID(MaxNodeID()), NodeID(NullNodeID())));
 }
 
 void testNodeId() {
@@ -92,9 +247,1223 @@ void testNodeId() {
 	c = a + b;
 	idc = NullNodeID() + c;
 	assert(idb == idc);
+
+	// byte view of the words
+	assert(ida.id[NODE_ID_LENGTH_BYTES - 1] == (a & 0xff));
+	assert(ida.id[NODE_ID_LENGTH_BYTES - 3] == ((a >> 16) & 0xff));
+
+	// carries and shifts across the words
+	idc = MaxNodeID();
+	idc += 1;
+	assert(idc == NullNodeID());
+	assert((MaxNodeID() >> (NODE_ID_LENGTH_BYTES*8 - 1)) == NullNodeID() + 1);
+	assert(NullNodeID() - (NullNodeID() + 1) == MaxNodeID());
+	assert(MaxNodeID() > (MaxNodeID() >> 1));
+
+	// XOR distance comparison
+	assert(IsCloser(ida, idb, ida));
+	assert(!IsCloser(idb, ida, ida));
+	assert(!IsCloser(ida, ida, idb));
+	assert(IsDistanceLess(ida, idb, ida ^ idb ^ (NullNodeID() + 1)) == ((ida ^ idb) < (ida ^ idb ^ (NullNodeID() + 1))));
+	assert(IsDistanceLess(ida, idb, MaxNodeID()));
+
+	testNodeIdWidth<128>();
+	testNodeIdWidth<160>();
+	testNodeIdWidth<256>();
+}
+
+void testRoutingTable() {
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CRoutingTable table(holder_id);
+
+	std::vector<NodeInfo> added;
+	bool is_close_to_holder;
+	for (int i = 0; i < 5000; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		// half of the ids share a prefix with the holder to make the table deep
+		int prefix = (i % 2) ? rand() % 32 : 0;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		for (int j = 0; j < prefix; ++j) {
+			uint8 mask = 0x80 >> (j % 8);
+			info.id.id[j / 8] = (info.id.id[j / 8] & ~mask) | (holder_id.id[j / 8] & mask);
+		}
+		if (table.AddContact(info, is_close_to_holder) == SUCCEED)
+			added.push_back(info);
+	}
+	assert(added.size() > K);
+
+	// every bucket lookup has to find the contacts added to it
+	int found = 0;
+	for (std::vector<NodeInfo>::size_type i = 0; i < added.size(); ++i) {
+		Contact c;
+		if (table.GetContact(added[i].id, c)) {
+			assert(c.ip == added[i].ip);
+			++found;
+			assert(table.LastSeenContact(added[i].id, c));
+		}
+	}
+	assert(found >= K);
+
+	// the closest contacts are exactly the K closest ones of the table
+	std::vector<NodeInfo> present;
+	for (std::vector<NodeInfo>::size_type i = 0; i < added.size(); ++i) {
+		Contact c;
+		if (table.GetContact(added[i].id, c))
+			present.push_back(added[i]);
+	}
+	for (int t = 0; t < 200; ++t) {
+		NodeID target = (t % 2) ? holder_id : present[rand() % present.size()].id;
+		for (int j = (t % 4 < 2) ? NODE_ID_LENGTH_BYTES - 1 : rand() % NODE_ID_LENGTH_BYTES; j < NODE_ID_LENGTH_BYTES; ++j) {
+			target.id[j] = rand() & 0xff;
+		}
+		std::vector<NodeInfo> closest;
+		table.GetClosestContacts(target, closest);
+		assert(closest.size() == K);
+		std::sort(closest.begin(), closest.end(), distance_comp_lt<NodeInfo>(target));
+		std::vector<NodeInfo> expected = present;
+		std::sort(expected.begin(), expected.end(), distance_comp_lt<NodeInfo>(target));
+		for (int i = 0; i < K; ++i) {
+			assert(closest[i].id == expected[i].id);
+		}
+	}
+
+	// removals and re-adds keep the cached range of the holder neighborhood exact
+	bool is_promoted, promoted_close_to_holder;
+	NodeInfo promoted;
+	for (int t = 0; t < 300; ++t) {
+		std::sort(present.begin(), present.end(), distance_comp_lt<NodeInfo>(holder_id));
+		NodeID min_id = MaxNodeID(), max_id = NullNodeID();
+		for (int i = 0; i < K; ++i) {
+			min_id = std::min(min_id, present[i].id);
+			max_id = std::max(max_id, present[i].id);
+		}
+		// half of the removals hit the neighborhood itself
+		std::vector<NodeInfo>::size_type r = rand() % ((t % 2) ? 2*K : present.size());
+		NodeInfo removed = present[r];
+		assert(table.RemoveContact(removed.id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder));
+		assert(is_close_to_holder == (min_id <= removed.id && removed.id <= max_id));
+		present.erase(present.begin() + r);
+		if (is_promoted)
+			present.push_back(promoted);
+		if (t % 3 == 0 && table.AddContact(removed, is_close_to_holder) == SUCCEED)
+			present.push_back(removed);
+	}
+
+	NodeID far_id = holder_id ^ MaxNodeID();
+	assert(CommonPrefixLength(holder_id, far_id) == 0);
+	assert(CommonPrefixLength(holder_id, holder_id) == NODE_ID_LENGTH_BYTES*8);
+	assert(LeadingZeroBits(NullNodeID() + 1) == NODE_ID_LENGTH_BYTES*8 - 1);
+}
+
+// The replacement promoted in place of a contact of the holder neighborhood
+// can be outside of it
+void testRemoveContactPromoted() {
+	// with the null holder the ids are the distances
+	NodeID holder_id = NullNodeID();
+	CRoutingTable table(holder_id);
+	bool is_close_to_holder;
+
+	// 010... ids, after the splits they share a brother bucket of level 1
+	NodeInfo brothers[K];
+	for (int i = 0; i < K; ++i) {
+		brothers[i].ip = i;
+		brothers[i].id = NullNodeID();
+		brothers[i].id.id[0] = 0x40;
+		brothers[i].id.id[NODE_ID_LENGTH_BYTES - 1] = i + 1;
+		assert(table.AddContact(brothers[i], is_close_to_holder) == SUCCEED);
+	}
+	NodeInfo near[2];
+	for (int i = 0; i < 2; ++i) {
+		near[i].ip = K + i;
+		near[i].id = NullNodeID();
+		near[i].id.id[NODE_ID_LENGTH_BYTES - 1] = i + 1;
+		assert(table.AddContact(near[i], is_close_to_holder) == SUCCEED);
+	}
+	// farther than all the brothers, it is only a replacement
+	NodeInfo far_brother;
+	far_brother.ip = K + 2;
+	far_brother.id = NullNodeID();
+	far_brother.id.id[0] = 0x50;
+	assert(table.AddContact(far_brother, is_close_to_holder) == FULL);
+
+	// the K closest are near and brothers[0 .. K-3]
+	bool is_promoted, promoted_close_to_holder;
+	NodeInfo promoted;
+	assert(table.RemoveContact(brothers[0].id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder));
+	assert(is_close_to_holder);
+	assert(is_promoted && promoted.id == far_brother.id);
+	assert(!promoted_close_to_holder);
+}
+
+// Contacts added in batches are found and the closest contacts stay exact
+void testRoutingTableBulk() {
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CRoutingTable table(holder_id);
+
+	std::vector<NodeInfo> present;
+	for (int b = 0; b < 500; ++b) {
+		NodeInfo batch[K];
+		for (int i = 0; i < K; ++i) {
+			batch[i].ip = b * K + i;
+			for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+				batch[i].id.id[j] = rand() & 0xff;
+			}
+			// most of them near the holder to split the holder bucket
+			int prefix = (i % 3) ? rand() % 24 : 0;
+			for (int j = 0; j < prefix; ++j) {
+				uint8 mask = 0x80 >> (j % 8);
+				batch[i].id.id[j / 8] = (batch[i].id.id[j / 8] & ~mask) | (holder_id.id[j / 8] & mask);
+			}
+		}
+		// a contact repeated in the batch and a known one
+		batch[K - 1] = batch[0];
+		if (present.size())
+			batch[K - 2] = present[rand() % present.size()];
+
+		RoutingTableErrorCode results[K];
+		bool is_close_to_holder[K];
+		uint16 added = table.AddContacts(batch, K, results, is_close_to_holder);
+		assert(results[K - 1] != SUCCEED);
+		if (b)
+			assert(results[K - 2] == EXISTED);
+		uint16 succeed = 0;
+		for (int i = 0; i < K; ++i) {
+			Contact c;
+			if (results[i] == SUCCEED) {
+				++succeed;
+				assert(table.GetContact(batch[i].id, c));
+				present.push_back(batch[i]);
+			}
+		}
+		assert(succeed == added);
+	}
+
+	// ForceK evicts some of the added contacts later
+	std::vector<NodeInfo> added = present;
+	present.clear();
+	for (std::vector<NodeInfo>::size_type i = 0; i < added.size(); ++i) {
+		Contact c;
+		if (table.GetContact(added[i].id, c))
+			present.push_back(added[i]);
+	}
+	for (int t = 0; t < 100; ++t) {
+		NodeID target = (t % 2) ? holder_id : present[rand() % present.size()].id;
+		target.id[NODE_ID_LENGTH_BYTES - 1] = rand() & 0xff;
+		std::vector<NodeInfo> closest;
+		table.GetClosestContacts(target, closest);
+		assert(closest.size() == K);
+		std::sort(closest.begin(), closest.end(), distance_comp_lt<NodeInfo>(target));
+		std::vector<NodeInfo> expected = present;
+		std::sort(expected.begin(), expected.end(), distance_comp_lt<NodeInfo>(target));
+		for (int i = 0; i < K; ++i) {
+			assert(closest[i].id == expected[i].id);
+		}
+	}
+}
+
+class CDepthRoutingTable : public CRoutingTable {
+public:
+	CDepthRoutingTable(const NodeID &id) : CRoutingTable(id) {}
+	using CRoutingTable::GetDepth;
+};
+
+// A random contact sharing exactly prefix bits with the holder
+static NodeInfo MakeContactWithPrefix(const NodeID &holder_id, int prefix, uint32 ip) {
+	NodeInfo info;
+	info.ip = ip;
+	for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+		info.id.id[j] = rand() & 0xff;
+	}
+	for (int j = 0; j <= prefix; ++j) {
+		uint8 mask = 0x80 >> (j % 8);
+		uint8 bit = holder_id.id[j / 8] & mask;
+		if (j == prefix)
+			bit ^= mask;
+		info.id.id[j / 8] = (info.id.id[j / 8] & ~mask) | bit;
+	}
+	return info;
+}
+
+// One batch can split the holder bucket more than once
+void testRoutingTableBulkSplits() {
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CDepthRoutingTable table(holder_id);
+
+	// They leave the holder bucket at the second split only
+	NodeInfo old_contacts[K];
+	bool is_close_to_holder;
+	for (int i = 0; i < K; ++i) {
+		old_contacts[i] = MakeContactWithPrefix(holder_id, 1, i);
+		assert(table.AddContact(old_contacts[i], is_close_to_holder) == SUCCEED);
+	}
+	assert(table.GetDepth() == 0);
+
+	NodeInfo batch[K];
+	for (int i = 0; i < K; ++i) {
+		batch[i] = MakeContactWithPrefix(holder_id, 3, K + i);
+	}
+	RoutingTableErrorCode results[K];
+	bool batch_close_to_holder[K];
+	assert(table.AddContacts(batch, K, results, batch_close_to_holder) == K);
+	assert(table.GetDepth() == 2);
+	for (int i = 0; i < K; ++i) {
+		Contact c;
+		assert(results[i] == SUCCEED);
+		assert(batch_close_to_holder[i]);
+		assert(table.GetContact(batch[i].id, c));
+		assert(table.GetContact(old_contacts[i].id, c));
+	}
+}
+
+// Serving a FIND_NODE from a warm routing table does not touch the heap
+void testClosestContactsAllocations() {
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CRoutingTable table(holder_id);
+	bool is_close_to_holder;
+	for (int i = 0; i < 2000; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		table.AddContact(info, is_close_to_holder);
+	}
+
+	for (int t = 0; t < 100; ++t) {
+		NodeID target;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			target.id[j] = rand() & 0xff;
+		}
+
+		unsigned long allocations = allocations_count;
+		FindNodeResponse resp;
+		table.GetClosestContacts(target, resp.nodes);
+		FindNodeResponse copy = resp;
+		assert(allocations_count == allocations);
+
+		// the same contacts as the vector overload
+		std::vector<NodeInfo> expected;
+		table.GetClosestContacts(target, expected);
+		assert(copy.nodes.size() == K && expected.size() == K);
+		std::sort(copy.nodes.begin(), copy.nodes.end(), distance_comp_lt<NodeInfo>(target));
+		std::sort(expected.begin(), expected.end(), distance_comp_lt<NodeInfo>(target));
+		for (int i = 0; i < K; ++i) {
+			assert(copy.nodes[i].id == expected[i].id);
+		}
+	}
+}
+
+// The estimate follows the samples and stays with the contact
+void testRttEstimate() {
+	RttEstimate rtt;
+	assert(!rtt.IsKnown());
+	rtt.AddSample(100);
+	assert(rtt.IsKnown() && rtt.srtt == 100 && rtt.rttvar == 50);
+	assert(rtt.GetTimeout() == 300);
+	for (int i = 0; i < 100; ++i) {
+		rtt.AddSample(40);
+	}
+	assert(rtt.srtt >= 40 && rtt.srtt < 48 && rtt.rttvar < 4);
+	rtt.AddSample(1000000);
+	assert(rtt.IsKnown());
+
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CRoutingTable table(holder_id);
+	bool is_close_to_holder;
+	NodeInfo first;
+	first.ip = 0;
+	first.id = holder_id;
+	first.id.id[NODE_ID_LENGTH_BYTES - 1] ^= 1;
+	table.AddContact(first, is_close_to_holder);
+	assert(table.UpdateRtt(first.id, 80));
+	// the holder bucket splits many times
+	for (int i = 1; i < 1000; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		table.AddContact(info, is_close_to_holder);
+	}
+	// seen again
+	table.AddContact(first, is_close_to_holder);
+
+	Contact contact;
+	assert(table.GetContact(first.id, contact));
+	assert(contact.rtt.IsKnown() && contact.rtt.srtt == 80 && contact.rtt.rttvar == 40);
+	Contact copy = contact;
+	assert(copy.rtt.srtt == 80);
+}
+
+struct ArenaObject {
+	static int alive;
+	int value;
+	ArenaObject(int v) {
+		value = v;
+		++alive;
+	}
+	~ArenaObject() {
+		--alive;
+	}
+};
+
+int ArenaObject::alive = 0;
+
+// One allocation per block, every object destroyed on release
+void testArena() {
+	for (int n = 0; n < 100; n += 7) {
+		CArena<ArenaObject, 8> arena;
+		std::vector<ArenaObject *> objects;
+		objects.reserve(n);
+		unsigned long allocations = allocations_count;
+		for (int i = 0; i < n; ++i) {
+			objects.push_back(new (arena.Allocate()) ArenaObject(i));
+		}
+		assert(allocations_count - allocations == (unsigned long) (n + 7) / 8);
+		assert(ArenaObject::alive == n);
+		for (int i = 0; i < n; ++i) {
+			assert(objects[i]->value == i);
+		}
+		arena.Release();
+		assert(ArenaObject::alive == 0);
+
+		// reusable after the release
+		new (arena.Allocate()) ArenaObject(n);
+		assert(ArenaObject::alive == 1);
+	}
+	assert(ArenaObject::alive == 0);
+}
+
+// Every destination of a request finds it, the ids of the finished ones do not
+void testSlotTable() {
+	typedef CSlotTable<int, 12, 6> Table;
+	Table table;
+	int values[3] = {0, 1, 2};
+	rpc_id ids[3];
+	for (int i = 0; i < 3; ++i) {
+		ids[i] = table.Add(&values[i]);
+	}
+	assert(table.Size() == 3);
+	for (int i = 0; i < 3; ++i) {
+		assert(table.Get(ids[i]) == &values[i]);
+		assert(Table::GetDest(ids[i]) == 0);
+		rpc_id dest_id = Table::WithDest(ids[i], Table::max_dests - 1);
+		assert(dest_id != ids[i] && Table::GetDest(dest_id) == Table::max_dests - 1);
+		assert(table.Get(dest_id) == &values[i]);
+	}
+
+	// the slot is reused by the next request, with another generation
+	table.Remove(ids[1]);
+	assert(!table.Get(ids[1]) && !table.Get(Table::WithDest(ids[1], 5)));
+	rpc_id id = table.Add(&values[1]);
+	assert(id != ids[1] && table.Get(id) == &values[1]);
+	assert(!table.Get(ids[1]));
+	assert(table.SlotsNumber() == 3 && table.Size() == 3);
+
+	// an id of a slot never used
+	assert(!table.Get(ids[2] + 1));
+
+	table.Remove(id);
+	table.Remove(ids[0]);
+	table.Remove(ids[2]);
+	assert(!table.Size());
+	for (uint32 slot = 0; slot < table.SlotsNumber(); ++slot) {
+		assert(!table.GetBySlot(slot));
+	}
+
+	// a full table turns the new requests down
+	typedef CSlotTable<int, 4, 0> SmallTable;
+	SmallTable small;
+	std::vector<rpc_id> small_ids;
+	for (int i = 0; i < SmallTable::max_slots - 1; ++i) {
+		small_ids.push_back(small.Add(&values[0]));
+		assert(small_ids.back() != SmallTable::invalid_id);
+	}
+	assert(small.Add(&values[1]) == SmallTable::invalid_id);
+	assert(small.Size() == SmallTable::max_slots - 1);
+	assert(!small.Get(SmallTable::invalid_id));
+	small.Remove(small_ids[3]);
+	id = small.Add(&values[1]);
+	assert(id != SmallTable::invalid_id && small.Get(id) == &values[1]);
+	assert(small.Add(&values[2]) == SmallTable::invalid_id);
+
+	// the ids of the reserved slot match no request, the last one before
+	// invalid_id wraps around
+	uint32 last = (1 << SmallTable::generation_bits) - 2;
+	uint32 ns[4] = {0, 1, last - 1, last};
+	for (int i = 0; i < 4; ++i) {
+		rpc_id local = SmallTable::LocalId(ns[i]);
+		assert(local != SmallTable::invalid_id && !small.Get(local));
+		assert(!i || local != SmallTable::LocalId(ns[i - 1]));
+	}
+	assert(SmallTable::LocalId(last + 1) == SmallTable::LocalId(0));
+}
+
+// Keeps the find node requests, the test answers them
+class CLookupTransport : public ITransport {
+public:
+	std::vector<FindNodeRequest> find_node_requests;
+
+	void SendPingRequest(const PingRequest &req) {}
+	void SendStoreRequest(const StoreRequest &req) {}
+	void SendFindNodeRequest(const FindNodeRequest &req) {
+		find_node_requests.push_back(req);
+	}
+	void SendFindValueRequest(const FindValueRequest &req) {}
+	void SendDownlistRequest(const DownlistRequest &req) {}
+
+	void SendPingResponse(const PingResponse &resp) {}
+	void SendStoreResponse(const StoreResponse &resp) {}
+	void SendFindNodeResponse(const FindNodeResponse &resp) {}
+	void SendFindValueResponse(const FindValueResponse &resp) {}
+	void SendDownlistResponse(const DownlistResponse &resp) {}
+};
+
+static void JoinCallback(int *calls, CKadNode::ErrorCode code) {
+	assert(code == CKadNode::SUCCEED);
+	++*calls;
+}
+
+// The table loaded from a snapshot has the same buckets and contacts
+void testRoutingTableSnapshot() {
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CRoutingTable table(holder_id);
+	bool is_close_to_holder;
+	std::vector<NodeInfo> added;
+	for (int i = 0; i < 3000; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		if (table.AddContact(info, is_close_to_holder) == SUCCEED)
+			added.push_back(info);
+	}
+	const std::string filename = "test_rt.snapshot";
+	assert(table.SaveSnapshot(filename));
+
+	CRoutingTable loaded(holder_id);
+	std::vector<NodeInfo> loaded_contacts;
+	assert(loaded.LoadSnapshot(filename, loaded_contacts));
+	assert(loaded_contacts.size() == added.size());
+	for (std::vector<NodeInfo>::size_type i = 0; i < added.size(); ++i) {
+		Contact c1, c2;
+		assert(table.GetContact(added[i].id, c1));
+		assert(loaded.GetContact(added[i].id, c2));
+		assert(c1.ip == c2.ip && c1.last_seen == c2.last_seen);
+
+		// the recency order is kept as well
+		Contact last1, last2;
+		assert(table.LastSeenContact(added[i].id, last1));
+		assert(loaded.LastSeenContact(added[i].id, last2));
+		assert(last1.id == last2.id);
+	}
+	for (int t = 0; t < 100; ++t) {
+		std::vector<NodeInfo> closest1, closest2;
+		NodeID target = added[rand() % added.size()].id;
+		table.GetClosestContacts(target, closest1);
+		loaded.GetClosestContacts(target, closest2);
+		assert(closest1.size() == closest2.size());
+		for (std::vector<NodeInfo>::size_type i = 0; i < closest1.size(); ++i) {
+			assert(closest1[i].id == closest2[i].id);
+		}
+	}
+
+	// the snapshot of another node does not fit
+	CRoutingTable other(added[0].id);
+	loaded_contacts.clear();
+	assert(!other.LoadSnapshot(filename, loaded_contacts));
+	assert(!loaded_contacts.size());
+
+	// a node terminated before the revalidation of the restored
+	// contacts leaves no job behind
+	CJobScheduler scheduler;
+	CLookupTransport transport;
+	NodeInfo info;
+	info.ip = 3000;
+	info.id = holder_id;
+	int joined = 0;
+	CKadNode *node = new CKadNode(info, &scheduler, &transport);
+	assert(node->RestoreRoutingTable(filename, boost::bind(&JoinCallback, &joined, _1)));
+	scheduler.AddJob_(1, boost::bind(&CJobScheduler::Stop, &scheduler), &scheduler);
+	scheduler.Run();
+	assert(joined == 1 && scheduler.GetJobsCount());
+	node->Terminate();
+	assert(!scheduler.GetJobsCount());
+	delete node;
+
+	remove(filename.c_str());
+	assert(!other.LoadSnapshot(filename, loaded_contacts));
+}
+
+// Every answer of a reader is a consistent set of K known contacts,
+// the ip of a contact is its index in nodes
+static void ConcurrentReader(CConcurrentRoutingTable *table, const std::vector<NodeInfo> *nodes, int queries) {
+	CConcurrentRoutingTable::CReader reader(*table);
+	for (int q = 0; q < queries; ++q) {
+		const NodeID &target = (*nodes)[rand() % nodes->size()].id;
+		FindNodeResponse resp;
+		reader.GetClosestContacts(target, resp.nodes);
+		assert(resp.nodes.size() == K);
+		for (int i = 0; i < K; ++i) {
+			assert(resp.nodes[i].ip >= 0 && resp.nodes[i].ip < (int) nodes->size());
+			assert(resp.nodes[i].id == (*nodes)[resp.nodes[i].ip].id);
+			for (int j = 0; j < i; ++j) {
+				assert(!(resp.nodes[i].id == resp.nodes[j].id));
+			}
+		}
+	}
+}
+
+void testConcurrentRoutingTable() {
+	const int nodesN = 2000;
+	const int stableN = 200;
+	std::vector<NodeInfo> nodes;
+	for (int i = 0; i < nodesN; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		nodes.push_back(info);
+	}
+
+	NodeID holder_id = nodes[0].id;
+	CConcurrentRoutingTable table(holder_id);
+	bool is_close_to_holder, is_promoted, promoted_close_to_holder;
+	NodeInfo promoted;
+	// the first stableN nodes are never removed, so there are always K contacts
+	for (int i = 1; i < stableN; ++i) {
+		table.AddContact(nodes[i], is_close_to_holder);
+	}
+
+	boost::thread_group readers;
+	for (int i = 0; i < 3; ++i) {
+		readers.create_thread(boost::bind(&ConcurrentReader, &table, &nodes, 20000));
+	}
+	for (int i = 0; i < 20000; ++i) {
+		int n = stableN + rand() % (nodesN - stableN);
+		if (rand() % 2) {
+			table.AddContact(nodes[n], is_close_to_holder);
+		} else {
+			table.RemoveContact(nodes[n].id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder);
+		}
+	}
+	readers.join_all();
+
+	// the last published table has every change
+	CConcurrentRoutingTable::CReader reader(table);
+	Contact c;
+	assert(reader.GetContact(nodes[1].id, c) && c.ip == 1);
+	assert(reader.IdInHolderRange(holder_id));
+
+	// a refresh waits for the next change of the contacts
+	uint64 last_seen = c.last_seen;
+	GetTimerInstance()->AddTimeInterval(10);
+	assert(table.AddContact(nodes[1], is_close_to_holder) == EXISTED);
+	assert(reader.GetContact(nodes[1].id, c) && c.last_seen == last_seen);
+	int n = stableN;
+	while (!reader.GetContact(nodes[n].id, c)) {
+		++n;
+	}
+	assert(table.RemoveContact(nodes[n].id, is_close_to_holder, is_promoted, promoted, promoted_close_to_holder));
+	assert(reader.GetContact(nodes[1].id, c) && c.last_seen == last_seen + 10);
+	assert(!reader.GetContact(nodes[n].id, c));
+	// a replacement may take the freed slot
+	assert(!is_promoted || reader.GetContact(promoted.id, c));
+
+	// the batch is published once its contacts are in, a neighbor
+	// of the holder always has room in the holder bucket
+	NodeInfo neighbor;
+	neighbor.ip = nodesN;
+	neighbor.id = holder_id;
+	neighbor.id.id[NODE_ID_LENGTH_BYTES - 1] ^= 1;
+	RoutingTableErrorCode results[K];
+	bool batch_close_to_holder[K];
+	assert(table.AddContacts(&neighbor, 1, results, batch_close_to_holder) == 1);
+	assert(results[0] == SUCCEED && batch_close_to_holder[0]);
+	assert(reader.GetContact(neighbor.id, c));
+
+	// one reader more than the slots
+	std::vector<CConcurrentRoutingTable::CReader *> more;
+	bool thrown = false;
+	try {
+		while (more.size() < CConcurrentRoutingTable::max_readers) {
+			more.push_back(new CConcurrentRoutingTable::CReader(table));
+		}
+	} catch (const std::runtime_error &) {
+		thrown = true;
+	}
+	// reader holds one of the slots
+	assert(thrown && more.size() == CConcurrentRoutingTable::max_readers - 1);
+	for (std::vector<CConcurrentRoutingTable::CReader *>::size_type i = 0; i < more.size(); ++i) {
+		delete more[i];
+	}
+}
+
+static void HolderRangeReader(CConcurrentRoutingTable *table, const std::vector<NodeID> *ids, const std::vector<char> *expected, int rounds) {
+	CConcurrentRoutingTable::CReader reader(*table);
+	for (int r = 0; r < rounds; ++r) {
+		for (std::vector<NodeID>::size_type i = 0; i < ids->size(); ++i) {
+			assert(reader.IdInHolderRange((*ids)[i]) == ((*expected)[i] != 0));
+		}
+	}
+}
+
+// The published table comes with its holder range, the readers asking for
+// ids out of the holder bucket do not write to it
+void testConcurrentHolderRange() {
+	NodeID holder_id;
+	for (int i = 0; i < NODE_ID_LENGTH_BYTES; ++i) {
+		holder_id.id[i] = rand() & 0xff;
+	}
+	CConcurrentRoutingTable table(holder_id);
+	CRoutingTable plain(holder_id);
+	bool is_close_to_holder;
+	for (int i = 0; i < 1000; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		table.AddContact(info, is_close_to_holder);
+		plain.AddContact(info, is_close_to_holder);
+	}
+
+	// ids near the holder, most of them out of its bucket
+	std::vector<NodeID> ids;
+	std::vector<char> expected;
+	for (int i = 0; i < 200; ++i) {
+		NodeID id = holder_id;
+		int bit = 1 + rand() % 10;
+		id.id[bit / 8] ^= 0x80 >> (bit % 8);
+		id.id[NODE_ID_LENGTH_BYTES - 1] = rand() & 0xff;
+		ids.push_back(id);
+		expected.push_back(plain.IdInHolderRange(id));
+	}
+
+	boost::thread_group readers;
+	for (int i = 0; i < 4; ++i) {
+		readers.create_thread(boost::bind(&HolderRangeReader, &table, &ids, &expected, 100));
+	}
+	readers.join_all();
+}
+
+template <uint16 Bits>
+void RunSimulation(int nodesN) {
+	CStats stats;
+	stats.SetNodesN(nodesN);
+	stats.SetNodeIdBits(Bits);
+	std::string filename;
+	filename = boost::lexical_cast<std::string>(time(NULL));
+	filename += ".txt";
+	stats.Open(filename);
+
+	CSimulatorT<Bits> sim(nodesN, &stats);
+	sim.Run(run_time);
+}
+
+struct LookupResult {
+	int calls;
+	CKadNode::ErrorCode code;
+	rpc_id id;
+	std::vector<NodeInfo> nodes;
+};
+
+void LookupCallback(LookupResult *result, CKadNode::ErrorCode code, const FindNodeResponse *resp) {
+	++result->calls;
+	result->code = code;
+	if (resp) {
+		result->id = resp->id;
+		result->nodes.assign(resp->nodes.begin(), resp->nodes.end());
+	}
+}
+
+static NodeID RandomId() {
+	NodeID id;
+	for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+		id.id[j] = rand() & 0xff;
+	}
+	return id;
+}
+
+// nodes[0] is the holder, the ip of a node is its index
+static void MakeBootstrappedNodes(std::vector<NodeInfo> &nodes) {
+	for (int i = 0; i <= K; ++i) {
+		NodeInfo info;
+		info.ip = i;
+		info.id = RandomId();
+		nodes.push_back(info);
+	}
+}
+
+// The other nodes ping the holder, it knows all of them
+static void Bootstrap(CKadNode &node, const std::vector<NodeInfo> &nodes) {
+	for (std::vector<NodeInfo>::size_type i = 1; i < nodes.size(); ++i) {
+		PingRequest req;
+		req.Init(nodes[i], nodes[0], nodes[i].id, i);
+		node.OnPingRequest(req);
+	}
+}
+
+// A lookup for a target already searched joins the running one
+void testLookupCoalescing() {
+	LookupResult first, second, later;
+	first.calls = second.calls = later.calls = 0;
+
+	std::vector<NodeInfo> nodes;
+	MakeBootstrappedNodes(nodes);
+
+	CJobScheduler scheduler;
+	CLookupTransport transport;
+	CKadNode node(nodes[0], &scheduler, &transport);
+	Bootstrap(node, nodes);
+
+	NodeID target = RandomId();
+	rpc_id id = node.FindCloseNodes(target, boost::bind(&LookupCallback, &first, _1, _2));
+	assert(transport.find_node_requests.size() == alpha);
+	assert(node.FindCloseNodes(target, boost::bind(&LookupCallback, &second, _1, _2)) == id);
+	assert(transport.find_node_requests.size() == alpha);
+
+	// every node answers without new contacts
+	while (transport.find_node_requests.size()) {
+		FindNodeRequest req = transport.find_node_requests.back();
+		transport.find_node_requests.pop_back();
+		FindNodeResponse resp;
+		resp.Init(req.to, req.from, nodes[req.to.ip].id, req.id);
+		node.OnFindNodeResponse(resp);
+	}
+
+	assert(first.calls == 1 && second.calls == 1);
+	assert(first.code == CKadNode::SUCCEED && second.code == CKadNode::SUCCEED);
+	assert(first.id == id && second.id == id);
+	assert(first.nodes.size() == K && second.nodes.size() == K);
+	for (int i = 0; i < K; ++i) {
+		assert(first.nodes[i].id == second.nodes[i].id);
+	}
+
+	// the finished lookup is not joined
+	assert(node.FindCloseNodes(target, boost::bind(&LookupCallback, &later, _1, _2)) != id);
+	assert(transport.find_node_requests.size() == alpha);
+	node.Terminate();
+	assert(later.calls == 1 && later.code == CKadNode::TERMINATED);
+	assert(first.calls == 1 && second.calls == 1);
+}
+
+// Gives access to the request state of CKadNode
+class CTestNode : public CKadNode {
+public:
+	typedef CKadNode::FindRequests FindRequests;
+	typedef CKadNode::FindRequestData FindRequestData;
+	typedef CKadNode::ReplyTimes ReplyTimes;
+
+	CTestNode(const NodeInfo &info, CJobScheduler *sched, ITransport *transport)
+		: CKadNode(info, sched, transport) {}
+
+	using CKadNode::GetFindData;
+	using CKadNode::find_reply_times;
+};
+
+// Runs the jobs of the next milliseconds of the virtual time
+static void RunFor(CJobScheduler &scheduler, uint64 milliseconds) {
+	scheduler.AddJob_(milliseconds, boost::bind(&CJobScheduler::Stop, &scheduler), &scheduler);
+	scheduler.Run();
+}
+
+// The request is answered without new nodes
+static void AnswerFindNode(CKadNode &node, const FindNodeRequest &req, const std::vector<NodeInfo> &nodes) {
+	FindNodeResponse resp;
+	resp.Init(req.to, req.from, nodes[req.to.ip].id, req.id);
+	node.OnFindNodeResponse(resp);
+}
+
+static void AnswerLastFindNode(CKadNode &node, CLookupTransport &transport, const std::vector<NodeInfo> &nodes) {
+	FindNodeRequest req = transport.find_node_requests.back();
+	transport.find_node_requests.pop_back();
+	AnswerFindNode(node, req, nodes);
+}
+
+static NodeInfo MakeContactAt(uint8 first_byte, uint8 last_byte) {
+	NodeInfo info;
+	info.ip = (first_byte << 8) | last_byte;
+	info.id = NullNodeID();
+	info.id.id[0] = first_byte;
+	info.id.id[NODE_ID_LENGTH_BYTES - 1] = last_byte;
+	return info;
+}
+
+// A full shortlist keeps its size and the candidates already asked
+void testShortlistCap() {
+	typedef CTestNode::FindRequestData FindRequestData;
+	typedef FindRequestData::Candidate Candidate;
+	FindRequestData data;
+	// with the null target the ids are the distances
+	data.target = NullNodeID();
+
+	for (int i = 0; i < shortlist_size; ++i) {
+		assert(data.AddCandidate(MakeContactAt(0x80, i)));
+	}
+	// the farthest ones are asked already
+	Candidate *up = data.GetCandidate(MakeContactAt(0x80, shortlist_size - 1).id);
+	Candidate *down = data.GetCandidate(MakeContactAt(0x80, shortlist_size - 2).id);
+	Candidate *pending = data.GetCandidate(MakeContactAt(0x80, shortlist_size - 3).id);
+	up->type = Candidate::UP;
+	down->type = Candidate::DOWN;
+	pending->type = Candidate::PENDING;
+
+	// farther than the whole shortlist
+	assert(!data.AddCandidate(MakeContactAt(0x90, 0)));
+	assert(data.pruned == 1);
+
+	// the closer ones evict the not asked ones, farthest first, then
+	// they are farther than the candidates they could evict
+	for (int i = 0; i < shortlist_size; ++i) {
+		Candidate *cand = data.AddCandidate(MakeContactAt(0x40, i));
+		assert(!cand == (i >= shortlist_size - 3));
+		assert(data.candidates.size() == shortlist_size);
+	}
+	assert(data.pruned == 1 + shortlist_size);
+	assert(data.GetCandidate(up->id) == up && up->type == Candidate::UP);
+	assert(data.GetCandidate(down->id) == down && down->type == Candidate::DOWN);
+	assert(data.GetCandidate(pending->id) == pending && pending->type == Candidate::PENDING);
+	for (int i = 0; i < shortlist_size - 3; ++i) {
+		assert(!data.GetCandidate(MakeContactAt(0x80, i).id));
+	}
+
+	// with every candidate asked even the closest node is turned down
+	FindRequestData::Candidates::iterator it;
+	for (it = data.candidates.begin(); it != data.candidates.end(); ++it) {
+		if (it->type == Candidate::UNKNOWN)
+			it->type = Candidate::DOWN;
+	}
+	assert(!data.AddCandidate(MakeContactAt(0, 1)));
+	assert(data.candidates.size() == shortlist_size && data.pruned == 2 + shortlist_size);
+}
+
+// A lookup over the limit of the running ones fails at once
+void testLookupOverload() {
+	std::vector<NodeInfo> nodes;
+	MakeBootstrappedNodes(nodes);
+
+	CJobScheduler scheduler;
+	CLookupTransport transport;
+	CKadNode node(nodes[0], &scheduler, &transport);
+	Bootstrap(node, nodes);
+
+	LookupResult running, overloaded;
+	running.calls = overloaded.calls = 0;
+	NodeID target = NullNodeID();
+	for (int i = 0; i < CTestNode::FindRequests::max_slots - 1; ++i) {
+		target.id[NODE_ID_LENGTH_BYTES - 1] = i & 0xff;
+		target.id[NODE_ID_LENGTH_BYTES - 2] = i >> 8;
+		assert(node.FindCloseNodes(target, boost::bind(&LookupCallback, &running, _1, _2)) != CTestNode::FindRequests::invalid_id);
+	}
+	std::vector<FindNodeRequest>::size_type sent = transport.find_node_requests.size();
+	assert(!running.calls);
+
+	target.id[0] ^= 0xff;
+	assert(node.FindCloseNodes(target, boost::bind(&LookupCallback, &overloaded, _1, _2)) == CTestNode::FindRequests::invalid_id);
+	assert(overloaded.calls == 1 && overloaded.code == CKadNode::OVERLOADED);
+	assert(transport.find_node_requests.size() == sent);
+
+	node.Terminate();
+	assert(running.calls == CTestNode::FindRequests::max_slots - 1 && running.code == CKadNode::TERMINATED);
+	assert(overloaded.calls == 1);
+}
+
+// A timeout adds a request in flight, a fast reply takes one back
+void testAdaptiveParallelism() {
+	std::vector<NodeInfo> nodes;
+	MakeBootstrappedNodes(nodes);
+
+	CJobScheduler scheduler;
+	CLookupTransport transport;
+	CTestNode node(nodes[0], &scheduler, &transport);
+	Bootstrap(node, nodes);
+
+	LookupResult result;
+	result.calls = 0;
+	NodeID target = RandomId();
+	CTestNode::FindRequestData *data = node.GetFindData(
+		node.FindCloseNodes(target, boost::bind(&LookupCallback, &result, _1, _2)));
+	assert(data->parallelism == alpha && transport.find_node_requests.size() == alpha);
+
+	// the requests time out together, each one widens and is sent again
+	RunFor(scheduler, timeout_period);
+	assert(data->parallelism == max_alpha && data->max_parallelism == max_alpha);
+	assert(data->pending_nodes == max_alpha);
+	assert(transport.find_node_requests.size() == alpha + max_alpha);
+
+	// a fast reply narrows, nothing is sent in its place
+	AnswerLastFindNode(node, transport, nodes);
+	assert(data->parallelism == max_alpha - 1 && data->pending_nodes == max_alpha - 1);
+	assert(transport.find_node_requests.size() == alpha + max_alpha - 1);
+
+	// a slow one widens again, two requests take its place
+	GetTimerInstance()->AddTimeInterval(slow_reply_time + 1);
+	AnswerLastFindNode(node, transport, nodes);
+	assert(data->parallelism == max_alpha && data->pending_nodes == max_alpha);
+	assert(transport.find_node_requests.size() == alpha + max_alpha);
+
+	assert(!result.calls);
+	node.Terminate();
+	assert(result.calls == 1 && result.code == CKadNode::TERMINATED);
+}
+
+// The percentile of the reply times, before and after the halving
+void testReplyTimes() {
+	typedef CTestNode::ReplyTimes ReplyTimes;
+	ReplyTimes times;
+	for (uint32 i = 0; i + 1 < hedge_min_samples; ++i) {
+		times.Add(45);
+	}
+	assert(!times.GetPercentile(90));
+	times.Add(45);
+	assert(times.GetPercentile(90) == 50 && times.GetPercentile(100) == 50);
+
+	// the last one halves the counts: 60 of 45 ms and 4 of 305 ms are left
+	for (uint32 i = 0; i < hedge_min_samples - 8; ++i) {
+		times.Add(45);
+	}
+	for (int i = 0; i < 8; ++i) {
+		times.Add(305);
+	}
+	assert(times.total == hedge_min_samples);
+	assert(times.GetPercentile(90) == 50 && times.GetPercentile(95) == 310);
+
+	// the halving drops the single replies, fewer than hedge_min_samples
+	// are left and they still give the percentile
+	ReplyTimes spread;
+	for (uint32 i = 0; i + 1 < ReplyTimes::buckets; ++i) {
+		spread.Add(i * ReplyTimes::step);
+	}
+	uint32 slow = 2*hedge_min_samples - (ReplyTimes::buckets - 1);
+	for (uint32 i = 0; i < slow; ++i) {
+		spread.Add(2*max_rpc_timeout);
+	}
+	assert(spread.total == slow / 2 && spread.total < hedge_min_samples);
+	assert(spread.GetPercentile(90) == ReplyTimes::buckets * ReplyTimes::step);
+}
+
+// A request pending past the hedge deadline gives its slot to the next
+// candidate, and its late reply is still taken
+void testHedgedLookup() {
+	std::vector<NodeInfo> nodes;
+	MakeBootstrappedNodes(nodes);
+
+	CJobScheduler scheduler;
+	CLookupTransport transport;
+	CTestNode node(nodes[0], &scheduler, &transport);
+	Bootstrap(node, nodes);
+	// the hedge deadline is 50 ms
+	for (uint32 i = 0; i < hedge_min_samples; ++i) {
+		node.find_reply_times.Add(45);
+	}
+
+	LookupResult result;
+	result.calls = 0;
+	NodeID target = RandomId();
+	CTestNode::FindRequestData *data = node.GetFindData(
+		node.FindCloseNodes(target, boost::bind(&LookupCallback, &result, _1, _2)));
+	assert(data->hedge_deadline == 50);
+	assert(transport.find_node_requests.size() == alpha);
+
+	std::vector<NodeInfo> by_distance(nodes.begin() + 1, nodes.end());
+	std::sort(by_distance.begin(), by_distance.end(), distance_comp_lt<NodeInfo>(target));
+
+	// the alpha requests are hedged together, the next alpha candidates are sent
+	RunFor(scheduler, data->hedge_deadline);
+	assert(node.GetHedgedFindRequestsCount() == alpha);
+	assert(data->hedged_nodes == alpha && data->pending_nodes == 2*alpha);
+	assert(transport.find_node_requests.size() == 2*alpha);
+	for (int i = 0; i < 2*alpha; ++i) {
+		assert(transport.find_node_requests[i].to.ip == by_distance[i].ip);
+	}
+
+	// the late reply frees a hedged candidate, no slot
+	AnswerFindNode(node, transport.find_node_requests[0], nodes);
+	CTestNode::FindRequestData::Candidate *late = data->GetCandidate(by_distance[0].id);
+	assert(late->type == CTestNode::FindRequestData::Candidate::UP && !late->hedged);
+	assert(data->hedged_nodes == alpha - 1 && data->pending_nodes == 2*alpha - 1);
+	assert(transport.find_node_requests.size() == 2*alpha);
+	assert(node.find_reply_times.total == hedge_min_samples + 1);
+	assert(node.GetHedgedFindRequestsCount() == alpha);
+
+	assert(!result.calls);
+	node.Terminate();
+	assert(result.calls == 1 && result.code == CKadNode::TERMINATED);
+}
+
+struct JobTarget {
+	int calls;
+	void Timeout(int *data, int *cand) {
+		++calls;
+	}
+};
+
+static int Sum(int a, int b, int c) {
+	return a + b + c;
 }
 
-int main() {
+// The requests of a lookup with their timeout and hedge jobs, the jobs
+// copied into the scheduler included, do not allocate once the pool of
+// the jobs is filled
+void testSmallFunctionAllocations() {
+	std::vector<NodeInfo> nodes;
+	MakeBootstrappedNodes(nodes);
+
+	CJobScheduler scheduler;
+	CLookupTransport transport;
+	transport.find_node_requests.reserve(4*K);
+	CTestNode node(nodes[0], &scheduler, &transport);
+	Bootstrap(node, nodes);
+	for (uint32 i = 0; i < hedge_min_samples; ++i) {
+		node.find_reply_times.Add(45);
+	}
+
+	// the first lookup fills the pool
+	LookupResult result;
+	result.calls = 0;
+	for (int n = 0; n < 2; ++n) {
+		NodeID target = RandomId();
+		CTestNode::FindRequestData *data = node.GetFindData(
+			node.FindCloseNodes(target, boost::bind(&LookupCallback, &result, _1, _2)));
+		uint64 hedged = node.GetHedgedFindRequestsCount();
+		uint64 sent = node.GetFindRequestsCount();
+		transport.find_node_requests.clear();
+
+		unsigned long allocations = allocations_count;
+		// the hedge jobs send the next candidates every deadline,
+		// then the first requests time out and are sent again
+		RunFor(scheduler, data->hedge_deadline);
+		assert(node.GetHedgedFindRequestsCount() == hedged + alpha);
+		RunFor(scheduler, timeout_period - data->hedge_deadline);
+		assert(node.GetFindRequestsCount() > sent + alpha);
+		if (n)
+			assert(allocations_count == allocations);
+		node.Terminate();
+	}
+	assert(result.calls == 2);
+
+	JobTarget target;
+	target.calls = 0;
+	int data, cands[1];
+	unsigned long allocations = allocations_count;
+
+	// the copies call the same target
+	CJobScheduler::Job job = boost::bind(&JobTarget::Timeout, &target, &data, &cands[0]);
+	CJobScheduler::Job copy = job;
+	job();
+	copy();
+	assert(target.calls == 2);
+	CJobScheduler::Job empty;
+	assert(empty.empty() && !job.empty());
+	copy = empty;
+	assert(copy.empty());
+	assert(allocations_count == allocations);
+
+	CSmallFunction<int (int, int, int)> sum = boost::bind(&Sum, _1, _2, _3);
+	assert(sum(1, 2, 3) == 6);
+	assert(allocations_count == allocations);
+
+	// too big for the buffer, it goes to the heap
+	CSmallFunction<int (int, int), 8> big = boost::bind(&Sum, _1, _2, 40);
+	assert(allocations_count == allocations + 1);
+	CSmallFunction<int (int, int), 8> big_copy = big;
+	assert(allocations_count == allocations + 2);
+	assert(big(1, 1) == 42 && big_copy(2, 0) == 42);
+}
+
+class CPingCountTransport : public CLookupTransport {
+public:
+	CPingCountTransport() {
+		pings = 0;
+	}
+	void SendPingRequest(const PingRequest &req) {
+		++pings;
+	}
+	int pings;
+};
+
+// A message from a known contact, or from a new one for a bucket with room,
+// is taken without a heap allocation. A full bucket pings its least recently
+// seen contact once, however many new contacts wait for it.
+void testUpdateRoutingTableAllocations() {
+	NodeInfo holder;
+	holder.ip = 0;
+	for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+		holder.id.id[j] = rand() & 0xff;
+	}
+	CJobScheduler scheduler;
+	CPingCountTransport transport;
+	CKadNode node(holder, &scheduler, &transport);
+
+	// all of them in one bucket of the half of the id space without the
+	// holder, the second K farther than the first K so ForceK keeps the first
+	std::vector<PingRequest> requests(2*K);
+	for (int i = 0; i < 2*K; ++i) {
+		NodeInfo info;
+		info.ip = i + 1;
+		for (int j = 0; j < NODE_ID_LENGTH_BYTES; ++j) {
+			info.id.id[j] = rand() & 0xff;
+		}
+		uint8 far_bit = (i < K) ? (holder.id.id[0] & 0x20) : (~holder.id.id[0] & 0x20);
+		info.id.id[0] = (info.id.id[0] & 0x1f) | (~holder.id.id[0] & 0x80) | (holder.id.id[0] & 0x40) | far_bit;
+		requests[i].Init(info, holder, info.id, i);
+	}
+
+	unsigned long allocations = allocations_count;
+	for (int n = 0; n < 10; ++n) {
+		for (int i = 0; i < K; ++i) {
+			node.OnPingRequest(requests[i]);
+		}
+	}
+	assert(allocations_count == allocations);
+
+	// the bucket splits, its far half is full
+	for (int i = K; i < 2*K; ++i) {
+		node.OnPingRequest(requests[i]);
+	}
+	assert(!transport.pings);
+
+	GetTimerInstance()->AddTimeInterval(min_rt_check_time_interval + 1);
+	for (int i = K; i < 2*K; ++i) {
+		node.OnPingRequest(requests[i]);
+	}
+	assert(transport.pings == 1);
+
+	// the terminated ping frees its entry
+	node.Terminate();
+	for (int i = K; i < 2*K; ++i) {
+		node.OnPingRequest(requests[i]);
+	}
+	assert(transport.pings == 2);
+	node.Terminate();
+}
+
+// The first argument selects the id width: 128, 160 or 256 bits
+int main(int argc, char **argv) {
 	//testKBucket();
 	//_CrtSetDbgFlag(
 	//	_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) |
@@ -104,20 +1473,46 @@ int main() {
 	//	);
 
 	//testNodeId();
+	//testRoutingTable();
+	//testRemoveContactPromoted();
+	//testForceK();
+	//testClosestContactsAllocations();
+	//testArena();
+	//testSlotTable();
+	//testRttEstimate();
+	//testRoutingTableSnapshot();
+	//testRoutingTableBulk();
+	//testRoutingTableBulkSplits();
+	//testConcurrentRoutingTable();
+	//testConcurrentHolderRange();
+	//testLookupCoalescing();
+	//testLookupOverload();
+	//testShortlistCap();
+	//testAdaptiveParallelism();
+	//testReplyTimes();
+	//testHedgedLookup();
+	//testSmallFunctionAllocations();
+	//testUpdateRoutingTableAllocations();
 
 	int nodesN = 20000;
 
 	srand(time(0));
 
-	CStats stats;
-	stats.SetNodesN(nodesN);
-	std::string filename;
-	filename = boost::lexical_cast<std::string>(time(NULL));
-	filename += ".txt";
-	stats.Open(filename);
-
-	CSimulator sim(nodesN, &stats);
-	sim.Run(run_time);
+	int bits = argc > 1 ? atoi(argv[1]) : NODE_ID_LENGTH_BITS;
+	switch (bits) {
+		case 128:
+			RunSimulation<128>(nodesN);
+			break;
+		case 160:
+			RunSimulation<160>(nodesN);
+			break;
+		case 256:
+			RunSimulation<256>(nodesN);
+			break;
+		default:
+			printf("Unsupported id width %d\n", bits);
+			return 1;
+	}
 
 	return 0;
 }
\ No newline at end of file